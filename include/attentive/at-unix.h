@@ -9,9 +9,124 @@
 #ifndef ATTENTIVE_AT_UNIX_H
 #define ATTENTIVE_AT_UNIX_H
 
+#include <stdint.h>
 #include <termios.h>
 
 #include <attentive/at.h>
+#include <attentive/record.h>
+#include <attentive/transport.h>
+
+/**
+ * Create a serial port transport. This is what channels use by default.
+ *
+ * @param devpath Device path. Not copied.
+ * @param baudrate If non-zero, sets device baudrate (see termios.h).
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at_transport *at_transport_serial_alloc(const char *devpath, speed_t baudrate);
+
+/**
+ * Storage size needed by at_transport_serial_init.
+ *
+ * @returns Size in bytes.
+ */
+size_t at_transport_serial_sizeof(void);
+
+/**
+ * Set up a serial port transport in caller-provided storage (see
+ * attentive/storage.h).
+ *
+ * @param storage At least at_transport_serial_sizeof() bytes.
+ * @param devpath Device path. Not copied.
+ * @param baudrate If non-zero, sets device baudrate (see termios.h).
+ * @returns Instance pointer (equal to storage).
+ */
+struct at_transport *at_transport_serial_init(void *storage, const char *devpath, speed_t baudrate);
+
+/**
+ * Create a TCP transport, e.g. for a modem behind a ser2net-style terminal
+ * server. Every open makes a new connection.
+ *
+ * @param host Host name or address. Copied.
+ * @param port TCP port.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at_transport *at_transport_tcp_alloc(const char *host, uint16_t port);
+
+/**
+ * Create an in-memory transport: one end of a connected socket pair, the
+ * other end being the modem (see at_transport_loopback_peer). Runs at CPU
+ * speed, for tests and benchmarks.
+ *
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at_transport *at_transport_loopback_alloc(void);
+
+/**
+ * Modem end of a loopback transport. Read commands from it and write
+ * responses to it. Stays valid until the transport is freed.
+ *
+ * @param transport Transport from at_transport_loopback_alloc.
+ * @returns Blocking file descriptor.
+ */
+int at_transport_loopback_peer(struct at_transport *transport);
+
+/**
+ * Event loops reading from many AT channels.
+ *
+ * By default every channel has a reader thread blocked in read(). Channels
+ * created with a reactor in their settings have none; the reactor's threads
+ * watch all of them with epoll and feed their parsers instead, so the thread
+ * count follows the reactor size rather than the number of modems. Commands
+ * still block the calling thread until the response arrives. Linux only.
+ */
+struct at_reactor;
+
+/**
+ * Create a reactor.
+ *
+ * @param nthreads Number of event loop threads, or zero for one per online CPU.
+ * @returns Instance pointer on success, NULL and sets errno on failure
+ *          (ENOSYS if the platform has no reactor support).
+ */
+struct at_reactor *at_reactor_alloc(int nthreads);
+
+/**
+ * Stop and free a reactor. Free all channels using it first.
+ *
+ * @param reactor Reactor from at_reactor_alloc.
+ */
+void at_reactor_free(struct at_reactor *reactor);
+
+/**
+ * AT channel settings. Zero-initialized fields select the defaults.
+ */
+struct at_unix_config {
+    size_t bufsize;         /**< Initial response buffer size (default: 256). */
+    size_t bufsize_step;    /**< Response buffer growth increment (default: bufsize). */
+    size_t bufsize_max;     /**< Maximum response buffer size (default: no growth). */
+    size_t log_size;        /**< Log ring capacity in messages (default: 256). */
+    int log_drain_ms;       /**< Drain the log from a background thread (default: on demand). */
+    size_t response_slabs;  /**< Responses retained at once by at_command_retain (default: 4). */
+    struct at_reactor *reactor;     /**< Read from a reactor instead of a reader thread (default: none). */
+    size_t queue_length;    /**< Commands queued by at_command_async at once (default: 8). */
+    size_t stats_commands;  /**< Command prefixes tracked by at_get_stats (default: no statistics). */
+    size_t stats_urcs;      /**< URC prefixes tracked by at_get_stats (default: no statistics). */
+    struct at_transport *transport; /**< Talk over this instead of devpath (default: serial port).
+                                         Not owned; free it after the channel. */
+    struct at_record *record;       /**< Record all traffic into this (default: none).
+                                         Not owned; free it after the channel. */
+    bool flow_control;      /**< RTS/CTS hardware flow control (default: off).
+                                 See at_set_flow_control. */
+    bool low_latency;       /**< Have the serial driver pass input on right away (default: off).
+                                 Sets ASYNC_LOW_LATENCY on Linux, which also cuts the
+                                 latency timer of USB adapters to 1 ms. */
+    int reader_priority;    /**< Run the reader thread SCHED_FIFO at this priority
+                                 (default: 0, normal scheduling). Needs CAP_SYS_NICE.
+                                 Reader thread settings do nothing with a reactor. */
+    unsigned long reader_cpus;      /**< Pin the reader thread to these CPUs, bit n for CPU n
+                                         (default: 0, any). Linux only. */
+};
 
 /**
  * Create an AT channel instance.
@@ -22,6 +137,40 @@
  */
 struct at *at_alloc_unix(const char *devpath, speed_t baudrate);
 
+/**
+ * Create an AT channel instance with custom settings.
+ *
+ * @param devpath Device path. Unused if the settings name a transport.
+ * @param baudrate If non-zero, sets device baudrate (see termios.h).
+ * @param config Channel settings. Not referenced after the call.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at *at_alloc_unix_config(const char *devpath, speed_t baudrate,
+                                const struct at_unix_config *config);
+
+/**
+ * Storage size needed by at_init_unix.
+ *
+ * @param config Channel settings (NULL for defaults).
+ * @returns Size in bytes.
+ */
+size_t at_sizeof_unix(const struct at_unix_config *config);
+
+/**
+ * Set up an AT channel instance in caller-provided storage (see
+ * attentive/storage.h). The log ring and the response buffer are part of
+ * the storage. Release the instance with at_free, which doesn't free the
+ * storage.
+ *
+ * @param storage At least at_sizeof_unix(config) bytes.
+ * @param devpath Device path.
+ * @param baudrate If non-zero, sets device baudrate (see termios.h).
+ * @param config Channel settings (NULL for defaults). Not referenced after the call.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at *at_init_unix(void *storage, const char *devpath, speed_t baudrate,
+                        const struct at_unix_config *config);
+
 #endif
 
 /* vim: set ts=4 sw=4 et: */
@@ -9,7 +9,11 @@
 #ifndef ATTENTIVE_AT_H
 #define ATTENTIVE_AT_H
 
+#include <attentive/log.h>
 #include <attentive/parser.h>
+#include <attentive/response.h>
+#include <attentive/stats.h>
+#include <attentive/tokenizer.h>
 
 /*
  * Publicly accessible fields. Platform-specific implementations may add private
@@ -20,11 +24,42 @@ struct at {
     const struct at_callbacks *cbs;
     void *arg;
     at_line_scanner_t command_scanner;
+    struct at_log *log;
 };
 
+/**
+ * URC handler callback.
+ *
+ * @param line URC line (NULL-terminated).
+ * @param len Line length.
+ * @param offset Offset of the first character past the matched prefix.
+ * @param arg Private argument passed to at_set_callbacks.
+ */
+typedef void (*at_urc_handler_t)(const char *line, size_t len, size_t offset, void *arg);
+
+/**
+ * URC dispatch table entry. Lines starting with the prefix are classified as
+ * URCs and passed to the handler; a NULL handler silently drops them.
+ */
+struct at_urc_handler {
+    const char *prefix;
+    at_urc_handler_t handler;
+};
+
+/**
+ * Completion callback of at_command_async.
+ *
+ * @param response Response (see at_command), NULL on failure. Valid until
+ *                 the callback returns.
+ * @param status Zero on success, otherwise the errno at_command would set.
+ * @param arg Private argument passed to at_command_async.
+ */
+typedef void (*at_command_handler_t)(const char *response, int status, void *arg);
+
 struct at_callbacks {
     at_line_scanner_t scan_line;
     at_response_handler_t handle_urc;
+    const struct at_urc_handler *urcs; /**< Terminated by a NULL prefix. */
 };
 
 /**
@@ -63,15 +98,63 @@ void at_free(struct at *at);
 /**
  * Set AT channel callbacks.
  *
+ * The URC table, if any, is compiled here and matched against every line
+ * before the scan_line callback is consulted. Lines matching an entry are
+ * dispatched to its handler; other URCs go to handle_urc.
+ *
  * @param at AT channel instance.
  * @param cbs Set of callbacks. Not copied.
  * @param arg Private argument passed to callbacks.
  */
 void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg);
 
+/**
+ * Set the channel's log message handler (see at_log_set_handler).
+ *
+ * Messages are queued in a per-channel ring and passed to the handler when
+ * the log is drained: after every command, on at_log_flush and on close.
+ *
+ * @param at AT channel instance.
+ * @param handler Message handler (NULL to discard messages).
+ * @param arg Private argument passed to the handler.
+ */
+void at_set_log_handler(struct at *at, at_log_handler_t handler, void *arg);
+
+/**
+ * Set the channel's log level. Received lines and sent commands are logged
+ * at AT_LOG_DEBUG.
+ *
+ * @param at AT channel instance.
+ * @param level Most verbose level logged.
+ */
+void at_set_log_level(struct at *at, enum at_log_level level);
+
+/**
+ * Pass all queued log messages to the log handler.
+ *
+ * @param at AT channel instance.
+ */
+void at_log_flush(struct at *at);
+
+/**
+ * Take a snapshot of the channel's statistics: bytes in and out, and per
+ * command prefix counts, error finals, timeouts and latency histograms (see
+ * attentive/stats.h). Enabled by the stats_commands and stats_urcs settings.
+ *
+ * @param at AT channel instance.
+ * @param reset Zero the channel's statistics after taking the snapshot.
+ * @returns Snapshot to release with at_stats_free, or NULL and sets errno
+ *          on failure (ENOTSUP if statistics are disabled).
+ */
+struct at_stats *at_get_stats(struct at *at, bool reset);
+
 /**
  * Set custom per-command line scanner for the next command.
  *
+ * This and the other per-command settings below apply to the next
+ * synchronous command (at_command and friends), never to commands queued
+ * with at_command_async, and are cleared when it returns.
+ *
  * @param at AT channel instance.
  * @param scanner Line scanner callback.
  */
@@ -84,6 +167,28 @@ void at_set_command_scanner(struct at *at, at_line_scanner_t scanner);
  */
 void at_expect_dataprompt(struct at *at);
 
+/**
+ * Store the raw data block of the next command's response directly in
+ * a caller-supplied buffer (see at_parser_set_data_buffer).
+ *
+ * @param at AT channel instance.
+ * @param buf Destination buffer.
+ * @param size Destination buffer size in bytes.
+ */
+void at_set_data_buffer(struct at *at, void *buf, size_t size);
+
+/**
+ * Stream the intermediate lines of the next command's response to a callback
+ * (see at_parser_set_line_handler). Useful for listings that are too long for
+ * the response buffer, e.g. AT+COPS=? or AT+CMGL. The handler is called from
+ * the reader thread.
+ *
+ * @param at AT channel instance.
+ * @param handler Line handler.
+ * @param arg Private argument passed to the handler.
+ */
+void at_set_line_handler(struct at *at, at_response_handler_t handler, void *arg);
+
 /**
  * Set command timeout.
  *
@@ -92,6 +197,58 @@ void at_expect_dataprompt(struct at *at);
  */
 void at_set_timeout(struct at *at, int timeout);
 
+/**
+ * Set command timeout with millisecond resolution. Timeouts run on a
+ * monotonic clock where available, unaffected by setting the system time.
+ *
+ * @param at AT channel instance.
+ * @param timeout_ms Timeout in milliseconds (zero to disable).
+ */
+void at_set_timeout_ms(struct at *at, int timeout_ms);
+
+/**
+ * Enable or disable RTS/CTS hardware flow control on the port. Applies right
+ * away if the channel is open and on every later open. The modem has to be
+ * switched over too; the cellular drivers do both (see
+ * cellular_set_flow_control).
+ *
+ * @param at AT channel instance.
+ * @param enable Use hardware flow control.
+ * @returns Zero on success, -1 and sets errno on failure (ENOTSUP if the
+ *          transport has no flow control lines).
+ */
+int at_set_flow_control(struct at *at, bool enable);
+
+/**
+ * Check whether hardware flow control is enabled.
+ *
+ * @param at AT channel instance.
+ */
+bool at_get_flow_control(struct at *at);
+
+/**
+ * Change the port's line speed between commands, once the modem has been
+ * told to switch (e.g. AT+IPR). Output still queued goes out at the old
+ * speed; input received meanwhile is discarded and the parser reset. The
+ * cellular drivers negotiate the speed themselves (see
+ * cellular_set_baudrates).
+ *
+ * @param at AT channel instance.
+ * @param bps Bits per second, e.g. 460800.
+ * @returns Zero on success, -1 and sets errno on failure (ENOTSUP if the
+ *          transport has no line speed, EINVAL if it can't do this one,
+ *          EBUSY if commands are queued).
+ */
+int at_set_baudrate(struct at *at, unsigned long bps);
+
+/**
+ * Get the port's line speed.
+ *
+ * @param at AT channel instance.
+ * @returns Bits per second, or zero if unknown (e.g. not a serial port).
+ */
+unsigned long at_get_baudrate(struct at *at);
+
 /**
  * Send an AT command and receive a response. Accepts printf-compatible
  * format and arguments.
@@ -100,11 +257,52 @@ void at_set_timeout(struct at *at, int timeout);
  * @param format printf-comaptible format.
  * @returns Pointer to response (valid until next at_command) or NULL
  *          if a timeout occurs. Response is newline-delimited and does
- *          not include the final "OK".
+ *          not include the final "OK". If the response didn't fit in the
+ *          response buffer, returns NULL and sets errno to ENOBUFS.
  */
 __attribute__ ((format (printf, 2, 3)))
 const char *at_command(struct at *at, const char *format, ...);
 
+/**
+ * Send an AT command and retain its response. Works like at_command, but the
+ * response is copied to a slab from the channel's fixed response pool and
+ * stays valid, across later commands and threads, until released with
+ * at_response_release.
+ *
+ * @param at AT channel instance.
+ * @param format printf-comaptible format.
+ * @returns Response handle, or NULL and sets errno on failure (as at_command;
+ *          also ENOBUFS if all slabs are in use).
+ */
+__attribute__ ((format (printf, 2, 3)))
+struct at_response *at_command_retain(struct at *at, const char *format, ...);
+
+/**
+ * Queue an AT command without waiting for the response. Queued commands are
+ * sent in order, each as soon as the previous one completes, and the handler
+ * gets each response. It's called from the reader thread with the channel
+ * locked: it may queue further commands, but must not call at_command or
+ * at_command_drain. Per-command settings (at_set_*) don't apply to queued
+ * commands. at_command waits for the queue to drain first.
+ *
+ * @param at AT channel instance.
+ * @param handler Completion callback (NULL to ignore the response).
+ * @param arg Private argument passed to the handler.
+ * @param format printf-comaptible format.
+ * @returns Zero on success, -1 and sets errno on failure (ENOBUFS: queue
+ *          full, ENODEV: channel closed).
+ */
+__attribute__ ((format (printf, 4, 5)))
+int at_command_async(struct at *at, at_command_handler_t handler, void *arg, const char *format, ...);
+
+/**
+ * Wait until all commands queued with at_command_async have completed.
+ * Closing the channel fails the remaining ones with ENODEV.
+ *
+ * @param at AT channel instance.
+ */
+void at_command_drain(struct at *at);
+
 /**
  * Send raw data over the AT channel.
  *
@@ -151,7 +349,8 @@ const char *at_command_raw(struct at *at, const void *data, size_t size);
 #define _NUMARGS(...) (sizeof((void *[]){0, ##__VA_ARGS__})/sizeof(void *)-1)
 
 /**
- * Scanf a response and return -1 if it fails.
+ * Scanf a response and return -1 if it fails. Superseded by the tokenizer
+ * (attentive/tokenizer.h), which is bounds-checked and locale-independent.
  */
 #define at_simple_scanf(_response, format, ...)                             \
     do {                                                                    \
@@ -39,6 +39,8 @@ struct cellular {
     const char *apn;
     int pdp_failures;
     int pdp_threshold;
+    bool flow_control;
+    const unsigned long *baudrates;
 };
 
 struct cellular_ops {
@@ -102,6 +104,28 @@ struct cellular *cellular_alloc(void);
  */
 int cellular_attach(struct cellular *modem, struct at *at, const char *apn);
 
+/**
+ * Use RTS/CTS hardware flow control. Applied by the next cellular_attach, to
+ * the modem first and then to the AT channel, so both ends agree. Attach
+ * also turns it on if the channel already has it enabled.
+ *
+ * @param modem Cellular modem instance.
+ * @param enable Use hardware flow control.
+ */
+void cellular_set_flow_control(struct cellular *modem, bool enable);
+
+/**
+ * Negotiate a faster line speed on the next cellular_attach: the fastest
+ * candidate both the modem (AT+IPR) and the AT channel can do, kept only
+ * once an AT gets through at it. The modem isn't told to save it, so it
+ * comes back up at the usual speed after a reset.
+ *
+ * @param modem Cellular modem instance.
+ * @param baudrates Candidates in bits per second, fastest first,
+ *                  zero-terminated. Not copied. NULL to keep the speed.
+ */
+void cellular_set_baudrates(struct cellular *modem, const unsigned long *baudrates);
+
 /**
  * Detach cellular modem instance.
  * @param modem Cellular modem instance.
@@ -117,15 +141,22 @@ int cellular_detach(struct cellular *modem);
 void cellular_free(struct cellular *modem);
 
 
-/* Modem-specific variants below. */
+/* Modem-specific variants below. The *_init functions set up an instance in
+ * caller-provided storage of *_sizeof() bytes (see attentive/storage.h). */
 
 struct cellular *cellular_generic_alloc(void);
+size_t cellular_generic_sizeof(void);
+struct cellular *cellular_generic_init(void *storage);
 void cellular_generic_free(struct cellular *modem);
 
 struct cellular *cellular_telit2_alloc(void);
+size_t cellular_telit2_sizeof(void);
+struct cellular *cellular_telit2_init(void *storage);
 void cellular_telit2_free(struct cellular *modem);
 
 struct cellular *cellular_sim800_alloc(void);
+size_t cellular_sim800_sizeof(void);
+struct cellular *cellular_sim800_init(void *storage);
 void cellular_sim800_free(struct cellular *modem);
 
 #endif
@@ -0,0 +1,127 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_CORO_H
+#define ATTENTIVE_CORO_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Coroutines for running many modem workflows on a few threads.
+ *
+ * A scheduler runs coroutines on the thread that calls at_coro_sched_run.
+ * Each coroutine has its own stack, so driver code stays as it is: when a
+ * coroutine calls at_command() (or any cellular op built on it), it yields
+ * to the scheduler until the response arrives or the command times out, and
+ * at_coro_sleep_ms() yields instead of sleeping. Responses are delivered by
+ * the channel's reader thread or, better for large banks, a reactor (see
+ * at_reactor_alloc), so a thousand modems take one scheduler thread per CPU
+ * plus the reactor's.
+ *
+ * Rules:
+ * - A coroutine stays on its scheduler's thread.
+ * - Only one coroutine at a time may use a given AT channel.
+ * - Anything else that blocks (file I/O, a plain sleep()) blocks every
+ *   coroutine on the scheduler.
+ */
+struct at_coro_sched;
+struct at_coro;
+
+typedef void (*at_coro_func_t)(void *arg);
+
+/**
+ * Create a scheduler.
+ *
+ * @param stack_size Stack size of its coroutines in bytes (zero for the
+ *                   default, 64 KiB). Stacks are mapped on demand, with a
+ *                   guard page below, so unused pages cost nothing.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at_coro_sched *at_coro_sched_alloc(size_t stack_size);
+
+/**
+ * Start a coroutine. It first runs on the scheduler's next pass. Safe to
+ * call from any thread, including other coroutines.
+ *
+ * @param sched Scheduler instance.
+ * @param func Coroutine body. The coroutine ends when it returns.
+ * @param arg Passed to func.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_coro_spawn(struct at_coro_sched *sched, at_coro_func_t func, void *arg);
+
+/**
+ * Run coroutines on the calling thread until all of them have returned.
+ *
+ * @param sched Scheduler instance.
+ */
+void at_coro_sched_run(struct at_coro_sched *sched);
+
+/**
+ * Free a scheduler. Coroutines that haven't returned are dropped without
+ * being resumed.
+ *
+ * @param sched Scheduler instance.
+ */
+void at_coro_sched_free(struct at_coro_sched *sched);
+
+/**
+ * Get the running coroutine.
+ *
+ * @returns Coroutine, or NULL if not called from one.
+ */
+struct at_coro *at_coro_self(void);
+
+/**
+ * Let the other ready coroutines run first. Does nothing outside a
+ * coroutine.
+ */
+void at_coro_yield(void);
+
+/**
+ * Sleep. Only the calling coroutine waits; outside a coroutine, the thread
+ * sleeps.
+ *
+ * @param ms Time to sleep in milliseconds.
+ */
+void at_coro_sleep_ms(int ms);
+
+/**
+ * Coroutines waiting for something guarded by a mutex, like a condition
+ * variable. Zero-initialize. Fields are private.
+ */
+struct at_coro_waitq {
+    struct at_coro *head;
+};
+
+/**
+ * Park the running coroutine on a wait queue, like pthread_cond_timedwait.
+ * Releases the mutex while parked and relocks it before returning. The mutex
+ * must be locked exactly once. Wakeups may be spurious; recheck the
+ * condition.
+ *
+ * @param waitq Wait queue, guarded by the mutex.
+ * @param mutex Mutex guarding the condition.
+ * @param timeout_ms Give up after this long (zero: never).
+ * @returns False on timeout.
+ */
+bool at_coro_wait(struct at_coro_waitq *waitq, pthread_mutex_t *mutex, int timeout_ms);
+
+/**
+ * Wake all coroutines on a wait queue, like pthread_cond_broadcast. Call
+ * with the queue's mutex held. Safe from any thread.
+ *
+ * @param waitq Wait queue.
+ */
+void at_coro_wake_all(struct at_coro_waitq *waitq);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
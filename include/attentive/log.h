@@ -0,0 +1,155 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_LOG_H
+#define ATTENTIVE_LOG_H
+
+#include <stddef.h>
+
+#include <attentive/storage.h>
+
+/**
+ * Log message severity.
+ */
+enum at_log_level {
+    AT_LOG_OFF = 0,         /**< Logging disabled. */
+    AT_LOG_ERROR,           /**< Failures. */
+    AT_LOG_WARNING,         /**< Unexpected conditions, lost messages. */
+    AT_LOG_INFO,            /**< Notable events, e.g. unhandled URCs. */
+    AT_LOG_DEBUG,           /**< Every command and received line. */
+};
+
+/**
+ * Most verbose level compiled in. Messages above it cost nothing at run time;
+ * build with -DAT_LOG_LEVEL=AT_LOG_OFF to compile logging out entirely.
+ */
+#ifndef AT_LOG_LEVEL
+#define AT_LOG_LEVEL AT_LOG_DEBUG
+#endif
+
+/**
+ * Log message handler. Called from the thread draining the log, never from
+ * the thread that logged the message.
+ *
+ * @param level Message severity.
+ * @param msg Message text (NULL-terminated, without a trailing newline).
+ * @param len Message length.
+ * @param arg Private argument passed to at_log_set_handler.
+ */
+typedef void (*at_log_handler_t)(enum at_log_level level, const char *msg, size_t len, void *arg);
+
+/*
+ * Publicly accessible fields. The implementation adds private fields at the
+ * end of this struct.
+ */
+struct at_log {
+    enum at_log_level level;    /**< Messages above this level are dropped. */
+};
+
+/**
+ * Log a printf-style message if its level is enabled. Doesn't block: the
+ * message is formatted into a lock-free ring and handed to the log handler
+ * when the log is drained. Messages are dropped if the ring is full.
+ *
+ * @param log Log instance (may be NULL).
+ * @param level Message severity.
+ */
+#define at_log(_log, _level, ...)                                           \
+    do {                                                                    \
+        if ((_level) <= AT_LOG_LEVEL && (_log) && (_level) <= (_log)->level) \
+            at_log_write(_log, _level, __VA_ARGS__);                        \
+    } while (0)
+
+/**
+ * Allocate a log instance. The initial level is AT_LOG_INFO and messages are
+ * written to stdout with at_log_stream_handler.
+ *
+ * @param slots Ring capacity in messages; rounded up to a power of two.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at_log *at_log_alloc(size_t slots);
+
+/**
+ * Storage size needed by at_log_init.
+ *
+ * @param slots Ring capacity in messages.
+ * @returns Size in bytes.
+ */
+size_t at_log_sizeof(size_t slots);
+
+/**
+ * Set up a log instance in caller-provided storage (see attentive/storage.h).
+ *
+ * @param storage At least at_log_sizeof(slots) bytes.
+ * @param slots Ring capacity in messages; rounded up to a power of two.
+ * @returns Instance pointer (equal to storage).
+ */
+struct at_log *at_log_init(void *storage, size_t slots);
+
+/**
+ * Set the log message handler.
+ *
+ * @param log Log instance.
+ * @param handler Message handler (NULL to discard messages).
+ * @param arg Private argument passed to the handler.
+ */
+void at_log_set_handler(struct at_log *log, at_log_handler_t handler, void *arg);
+
+/**
+ * Set the most verbose level logged at run time.
+ *
+ * @param log Log instance.
+ * @param level Log level.
+ */
+void at_log_set_level(struct at_log *log, enum at_log_level level);
+
+/**
+ * Queue a log message unconditionally. Use the at_log macro instead.
+ *
+ * @param log Log instance.
+ * @param level Message severity.
+ * @param format printf-compatible format.
+ */
+__attribute__ ((format (printf, 3, 4)))
+void at_log_write(struct at_log *log, enum at_log_level level, const char *format, ...);
+
+/**
+ * Pass all queued messages to the log handler. Safe to call from any thread,
+ * concurrently with at_log_write.
+ *
+ * @param log Log instance.
+ * @returns Number of messages drained.
+ */
+size_t at_log_drain(struct at_log *log);
+
+/**
+ * Start a background thread draining the log periodically.
+ *
+ * @param log Log instance.
+ * @param interval_ms Drain interval in milliseconds.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_log_start(struct at_log *log, int interval_ms);
+
+/**
+ * Stop the background thread (if any), drain and free a log instance.
+ *
+ * @param log Log instance from at_log_alloc or at_log_init.
+ */
+void at_log_free(struct at_log *log);
+
+/**
+ * Log handler writing messages to a stdio stream, one per line.
+ *
+ * @param arg FILE pointer.
+ */
+void at_log_stream_handler(enum at_log_level level, const char *msg, size_t len, void *arg);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
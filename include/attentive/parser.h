@@ -14,6 +14,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <attentive/log.h>
+#include <attentive/storage.h>
+
 /**
  * AT response type.
  *
@@ -65,6 +68,28 @@ struct at_parser_callbacks {
  */
 struct at_parser *at_parser_alloc(const struct at_parser_callbacks *cbs, size_t bufsize, void *priv);
 
+/**
+ * Storage size needed by at_parser_init.
+ *
+ * @param bufsize Response buffer size in bytes.
+ * @returns Size in bytes.
+ */
+size_t at_parser_sizeof(size_t bufsize);
+
+/**
+ * Set up a parser instance in caller-provided storage (see
+ * attentive/storage.h). The response buffer is part of the storage; it's
+ * only moved to the heap if buffer growth is enabled.
+ *
+ * @param storage At least at_parser_sizeof(bufsize) bytes.
+ * @param cbs Parser callbacks. Structure is not copied; must persist for
+ *            the lifetime of the parser.
+ * @param bufsize Response buffer size on bytes.
+ * @param priv Private argument; passed to callbacks.
+ * @returns Parser instance pointer (equal to storage).
+ */
+struct at_parser *at_parser_init(void *storage, const struct at_parser_callbacks *cbs, size_t bufsize, void *priv);
+
 /**
  * Reset parser instance to initial state.
  *
@@ -77,12 +102,62 @@ void at_parser_reset(struct at_parser *parser);
  *
  * Some AT commands, mostly those used for transmitting raw data, return a "> "
  * prompt (without a newline). The parser must be told explicitly to expect it
- * on a per-command basis.
+ * on a per-command basis; at_parser_await_response consumes the setting.
  *
  * @param parser Parser instance.
  */
 void at_parser_expect_dataprompt(struct at_parser *parser);
 
+/**
+ * Store the data block of the next response in a caller-supplied buffer.
+ *
+ * Applies to blocks announced with AT_RESPONSE_RAWDATA_FOLLOWS and
+ * AT_RESPONSE_HEXDATA_FOLLOWS (stored decoded). The block is written directly
+ * to the buffer and is not included in the response, so it doesn't count
+ * against the response buffer size. Bytes that don't fit are discarded.
+ * The setting is cleared when the response completes.
+ *
+ * @param parser Parser instance.
+ * @param buf Destination buffer.
+ * @param size Destination buffer size in bytes.
+ */
+void at_parser_set_data_buffer(struct at_parser *parser, void *buf, size_t size);
+
+/**
+ * Stream the intermediate lines of the next response to a callback.
+ *
+ * Each intermediate line is passed to the handler as soon as it's complete
+ * and then dropped, so it doesn't count against the response buffer size;
+ * the response only holds the final line (and any data blocks). The setting
+ * is cleared when the response completes.
+ *
+ * @param parser Parser instance.
+ * @param handler Line handler (NULL to accumulate lines as usual).
+ * @param arg Private argument passed to the handler.
+ */
+void at_parser_set_line_handler(struct at_parser *parser, at_response_handler_t handler, void *arg);
+
+/**
+ * Let the response buffer grow when a response doesn't fit.
+ *
+ * The buffer grows in step-sized increments, up to max bytes, and only while
+ * a response is awaited. Responses that still don't fit are flagged (see
+ * at_parser_overflowed).
+ *
+ * @param parser Parser instance.
+ * @param step Growth increment in bytes (zero disables growth).
+ * @param max Maximum response buffer size in bytes.
+ */
+void at_parser_set_buffer_growth(struct at_parser *parser, size_t step, size_t max);
+
+/**
+ * Log received lines (at AT_LOG_DEBUG) to a log instance.
+ *
+ * @param parser Parser instance.
+ * @param log Log instance (NULL to disable).
+ */
+void at_parser_set_log(struct at_parser *parser, struct at_log *log);
+
 /**
  * Inform the parser that a command will be invoked. Causes a response callback
  * at the next command completion.
@@ -91,6 +166,28 @@ void at_parser_expect_dataprompt(struct at_parser *parser);
  */
 void at_parser_await_response(struct at_parser *parser);
 
+/**
+ * Check if the last response overflowed the response buffer.
+ *
+ * On overflow the lines accumulated before the one that didn't fit are
+ * dropped, so the response passed to the callback is incomplete. The flag is
+ * cleared by at_parser_await_response.
+ *
+ * @param parser Parser instance.
+ * @returns True if response data was lost, false otherwise.
+ */
+bool at_parser_overflowed(const struct at_parser *parser);
+
+/**
+ * Check if the last response ended with a generic error final response:
+ * ERROR, NO CARRIER, +CME ERROR or +CMS ERROR. Valid from the response
+ * callback on; cleared by at_parser_await_response.
+ *
+ * @param parser Parser instance.
+ * @returns True if the command failed, false otherwise.
+ */
+bool at_parser_failed(const struct at_parser *parser);
+
 /**
  * Feed parser. Callbacks are always called from this function's context.
  *
@@ -103,19 +200,69 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len);
 /**
  * Deallocate a parser instance.
  *
- * @param parser Parser instance allocated with at_parser_alloc.
+ * @param parser Parser instance from at_parser_alloc or at_parser_init.
  */
 void at_parser_free(struct at_parser *parser);
 
 /**
  * Check if a response starts with one of the prefixes in a table.
  *
+ * Walks the whole table; use a compiled at_prefix_matcher for tables that
+ * are matched against every received line.
+ *
  * @param line AT response line.
  * @param table List of prefixes.
  * @returns True if found, false otherwise.
  */
 bool at_prefix_in_table(const char *line, const char *const table[]);
 
+/**
+ * Compile a prefix table for fast matching.
+ *
+ * The compiled form is a trie indexed by the first character; matching takes
+ * time proportional to the length of the matched prefix, regardless of the
+ * number of entries.
+ *
+ * @param table NULL-terminated list of prefixes. Not referenced after the call.
+ * @returns Matcher instance pointer on success, NULL and sets errno on failure.
+ */
+struct at_prefix_matcher *at_prefix_matcher_alloc(const char *const table[]);
+
+/**
+ * Storage size needed by at_prefix_matcher_init.
+ *
+ * @param table NULL-terminated list of prefixes.
+ * @returns Size in bytes on success, zero and sets errno if the table is
+ *          too large to compile.
+ */
+size_t at_prefix_matcher_sizeof(const char *const table[]);
+
+/**
+ * Compile a prefix table in caller-provided storage (see attentive/storage.h).
+ *
+ * @param storage At least at_prefix_matcher_sizeof(table) bytes.
+ * @param table NULL-terminated list of prefixes. Not referenced after the call.
+ * @returns Matcher instance pointer on success, NULL and sets errno on failure.
+ */
+struct at_prefix_matcher *at_prefix_matcher_init(void *storage, const char *const table[]);
+
+/**
+ * Find the table entry a line starts with.
+ *
+ * @param matcher Compiled prefix table.
+ * @param line AT response line.
+ * @returns Index of the first matching table entry (in table order),
+ *          or -1 if none matches.
+ */
+int at_prefix_matcher_find(const struct at_prefix_matcher *matcher, const char *line);
+
+/**
+ * Free a compiled prefix table.
+ *
+ * @param matcher Matcher from at_prefix_matcher_alloc or at_prefix_matcher_init.
+ */
+void at_prefix_matcher_free(struct at_prefix_matcher *matcher);
+
 #endif
 
 /* vim: set ts=4 sw=4 et: */
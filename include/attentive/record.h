@@ -0,0 +1,183 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_RECORD_H
+#define ATTENTIVE_RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <attentive/parser.h>
+
+/*
+ * Recordings of AT channel traffic: every byte in both directions, command
+ * boundaries and timestamps, for reproducing problems seen in the field.
+ *
+ * File format: the magic "ATREC01\n", then records of
+ *
+ *     type        1 byte (enum at_record_type)
+ *     delta       varint, microseconds since the previous record
+ *     length      varint, payload bytes
+ *     payload
+ *
+ * Varints are little-endian base 128 (7 bits per byte, high bit set on all
+ * but the last byte). Files are append-only: every recorder starts with an
+ * AT_RECORD_START record, so several sessions can follow each other in one
+ * file and deltas never span two sessions.
+ */
+
+#define AT_RECORD_MAGIC "ATREC01\n"
+#define AT_RECORD_MAGIC_SIZE 8
+
+enum at_record_type {
+    AT_RECORD_START = 0,    /**< Session start. Payload: wall clock time, 8 bytes LE, us since the epoch. */
+    AT_RECORD_INPUT = 1,    /**< Bytes received from the modem. */
+    AT_RECORD_COMMAND = 2,  /**< Bytes sent to the modem; a command starts. */
+    AT_RECORD_RESPONSE = 3, /**< The command ended. Payload: errno (0 on success), error final flag. */
+    AT_RECORD_GAP = 4,      /**< Records lost to a full buffer or a failed write. Payload: varint, bytes lost. */
+};
+
+/**
+ * Recorder: a buffered writer appending to a recording. Writers only copy
+ * into a memory buffer; a background thread does the file I/O, so recording
+ * doesn't slow down the reader thread. Records that don't fit in the buffer
+ * are dropped and replaced by an AT_RECORD_GAP record.
+ */
+struct at_record;
+
+/**
+ * Open a recording for appending and start the writer thread.
+ *
+ * @param path File path. Created if missing.
+ * @param bufsize Buffer size in bytes (zero for the default, 64 KiB). The
+ *                writer thread wakes up when it's half full, or every 100 ms.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at_record *at_record_alloc(const char *path, size_t bufsize);
+
+/**
+ * Append a record. Doesn't block on I/O. Safe to call from any thread.
+ *
+ * @param record Recorder instance.
+ * @param type Record type.
+ * @param data Payload.
+ * @param len Payload length.
+ */
+void at_record_write(struct at_record *record, enum at_record_type type,
+                     const void *data, size_t len);
+
+/**
+ * Append an AT_RECORD_RESPONSE record.
+ *
+ * @param record Recorder instance.
+ * @param status errno value the command failed with, or zero.
+ * @param failed The final response was an error (see at_parser_failed).
+ */
+void at_record_response(struct at_record *record, int status, bool failed);
+
+/**
+ * Write out everything buffered so far.
+ *
+ * @param record Recorder instance.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_record_flush(struct at_record *record);
+
+/**
+ * Bytes lost to a full buffer or failed writes so far.
+ *
+ * @param record Recorder instance.
+ */
+uint64_t at_record_dropped(struct at_record *record);
+
+/**
+ * Flush, stop the writer thread and close a recording. Free all channels
+ * using it first.
+ *
+ * @param record Recorder instance.
+ */
+void at_record_free(struct at_record *record);
+
+/**
+ * One record read back from a recording.
+ */
+struct at_record_entry {
+    enum at_record_type type;
+    uint64_t time_us;       /**< Wall clock time, us since the epoch. */
+    const void *data;       /**< Payload, pointing into the mapped file. */
+    size_t len;
+};
+
+/**
+ * Reader: a recording mapped into memory.
+ */
+struct at_replay;
+
+/**
+ * Map a recording.
+ *
+ * @param path File path.
+ * @returns Instance pointer on success, NULL and sets errno on failure
+ *          (EPROTO if the file isn't a recording).
+ */
+struct at_replay *at_replay_alloc(const char *path);
+
+/**
+ * Read the next record.
+ *
+ * @param replay Reader instance.
+ * @param entry Filled in with the record.
+ * @returns 1 if a record was read, 0 at the end of the file, -1 and sets
+ *          errno to EPROTO if the file is damaged (e.g. cut off mid-record).
+ */
+int at_replay_next(struct at_replay *replay, struct at_record_entry *entry);
+
+/**
+ * Go back to the first record.
+ *
+ * @param replay Reader instance.
+ */
+void at_replay_rewind(struct at_replay *replay);
+
+/**
+ * Feed the received bytes to a parser, the way the channel did: a command
+ * record makes it await a response and a timed out command resets it.
+ * The parser's callbacks see the original session.
+ *
+ * @param replay Reader instance. Read from the current record to the end.
+ * @param parser Parser instance.
+ * @param speed Time scale: 1 replays at the original pace, 10 ten times as
+ *              fast; zero feeds everything right away.
+ * @returns Bytes fed on success, -1 and sets errno on failure.
+ */
+ssize_t at_replay_feed(struct at_replay *replay, struct at_parser *parser, double speed);
+
+/**
+ * Export to a pcap file with link type DLT_USER0 (147), one packet per
+ * record. Every packet starts with the record type byte, followed by the
+ * payload. In Wireshark, decode DLT_USER0 as "data" or with a dissector
+ * keyed on the first byte.
+ *
+ * @param replay Reader instance. Exported from the current record to the end.
+ * @param path Output file path.
+ * @returns Number of packets on success, -1 and sets errno on failure.
+ */
+ssize_t at_replay_export_pcap(struct at_replay *replay, const char *path);
+
+/**
+ * Unmap and free a recording.
+ *
+ * @param replay Reader instance.
+ */
+void at_replay_free(struct at_replay *replay);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
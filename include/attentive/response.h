@@ -0,0 +1,92 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_RESPONSE_H
+#define ATTENTIVE_RESPONSE_H
+
+#include <stddef.h>
+
+#include <attentive/storage.h>
+
+/**
+ * Retained response.
+ *
+ * Lives in a slab taken from a fixed-size pool and stays valid until its last
+ * reference is released, regardless of further commands. Handles can be
+ * passed to, referenced and released from any thread.
+ */
+struct at_response {
+    const char *text;   /**< Response text (NULL-terminated). */
+    size_t len;         /**< Response length. */
+};
+
+/**
+ * Allocate a response pool.
+ *
+ * @param count Number of slabs, i.e. responses retained at once.
+ * @param size Maximum response length in bytes.
+ * @returns Pool instance pointer on success, NULL and sets errno on failure.
+ */
+struct at_response_pool *at_response_pool_alloc(size_t count, size_t size);
+
+/**
+ * Storage size needed by at_response_pool_init.
+ *
+ * @param count Number of slabs.
+ * @param size Maximum response length in bytes.
+ * @returns Size in bytes.
+ */
+size_t at_response_pool_sizeof(size_t count, size_t size);
+
+/**
+ * Set up a response pool in caller-provided storage (see attentive/storage.h).
+ *
+ * @param storage At least at_response_pool_sizeof(count, size) bytes.
+ * @param count Number of slabs.
+ * @param size Maximum response length in bytes.
+ * @returns Pool instance pointer (equal to storage).
+ */
+struct at_response_pool *at_response_pool_init(void *storage, size_t count, size_t size);
+
+/**
+ * Free a response pool. All responses must have been released.
+ *
+ * @param pool Pool from at_response_pool_alloc or at_response_pool_init.
+ */
+void at_response_pool_free(struct at_response_pool *pool);
+
+/**
+ * Copy a response into a free slab. Doesn't block or allocate.
+ *
+ * @param pool Response pool.
+ * @param text Response text.
+ * @param len Response length.
+ * @returns Response with one reference on success, NULL and sets errno on
+ *          failure (ENOBUFS: all slabs in use, EMSGSIZE: response too long).
+ */
+struct at_response *at_response_pool_get(struct at_response_pool *pool, const char *text, size_t len);
+
+/**
+ * Take another reference to a response.
+ *
+ * @param response Retained response.
+ * @returns The response.
+ */
+struct at_response *at_response_ref(struct at_response *response);
+
+/**
+ * Drop a reference to a response. The slab returns to the pool when the
+ * last reference is dropped.
+ *
+ * @param response Retained response (NULL is ignored).
+ */
+void at_response_release(struct at_response *response);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
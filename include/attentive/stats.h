@@ -0,0 +1,195 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_STATS_H
+#define ATTENTIVE_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <attentive/storage.h>
+
+/** Longest command or URC prefix tracked, including the terminator. */
+#define AT_STATS_PREFIX 16
+
+/**
+ * Latency histogram buckets. Values below 4 us get a bucket each; above that
+ * every power of two is split into 4 linear sub-buckets (HDR-style, 25%
+ * relative precision). The last bucket ends at 2^33 us, about 2.4 hours.
+ */
+#define AT_STATS_BUCKETS 128
+
+/**
+ * Latency histogram in microseconds.
+ */
+struct at_stats_histogram {
+    uint32_t buckets[AT_STATS_BUCKETS];
+};
+
+/**
+ * Statistics of one command prefix, e.g. "AT+CIPRXGET" for
+ * "AT+CIPRXGET=2,0,1460". Data that doesn't start with "AT" is filed
+ * under "(data)".
+ */
+struct at_stats_command {
+    char prefix[AT_STATS_PREFIX];
+    uint32_t count;         /**< Commands sent. */
+    uint32_t timeouts;      /**< Commands that got no final response in time. */
+    uint32_t errors;        /**< Error finals (see at_parser_failed). */
+    uint32_t overflows;     /**< Responses that didn't fit in the buffer. */
+    struct at_stats_histogram first_byte;   /**< Time to the first byte received. */
+    struct at_stats_histogram final;        /**< Time to the final response. */
+};
+
+/**
+ * URC count of one prefix: the line up to the first ':', ' ' or ','.
+ */
+struct at_stats_urc {
+    char prefix[AT_STATS_PREFIX];
+    uint32_t count;
+};
+
+/*
+ * Publicly accessible fields. The implementation adds private fields at the
+ * end of this struct; the prefix tables follow in the same storage.
+ */
+struct at_stats {
+    uint64_t bytes_in;      /**< Bytes received. */
+    uint64_t bytes_out;     /**< Bytes sent. */
+    uint32_t overflows;     /**< Responses that didn't fit in the buffer. */
+    uint32_t untracked;     /**< Commands and URCs with no free table entry. */
+    size_t ncommands;       /**< Command prefix table size. */
+    size_t nurcs;           /**< URC prefix table size. */
+};
+
+/**
+ * Allocate a statistics instance.
+ *
+ * @param ncommands Number of command prefixes tracked.
+ * @param nurcs Number of URC prefixes tracked.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at_stats *at_stats_alloc(size_t ncommands, size_t nurcs);
+
+/**
+ * Storage size needed by at_stats_init.
+ *
+ * @param ncommands Number of command prefixes tracked.
+ * @param nurcs Number of URC prefixes tracked.
+ * @returns Size in bytes.
+ */
+size_t at_stats_sizeof(size_t ncommands, size_t nurcs);
+
+/**
+ * Set up a statistics instance in caller-provided storage (see
+ * attentive/storage.h).
+ *
+ * @param storage At least at_stats_sizeof(ncommands, nurcs) bytes.
+ * @param ncommands Number of command prefixes tracked.
+ * @param nurcs Number of URC prefixes tracked.
+ * @returns Instance pointer (equal to storage).
+ */
+struct at_stats *at_stats_init(void *storage, size_t ncommands, size_t nurcs);
+
+/**
+ * Free a statistics instance.
+ *
+ * @param stats Instance from at_stats_alloc or at_stats_init.
+ */
+void at_stats_free(struct at_stats *stats);
+
+/**
+ * Zero all counters and forget the tracked prefixes, including the command
+ * in flight.
+ *
+ * @param stats Statistics instance.
+ */
+void at_stats_reset(struct at_stats *stats);
+
+/**
+ * Copy counters between instances with the same table sizes.
+ *
+ * @param dst Destination instance.
+ * @param src Source instance.
+ */
+void at_stats_copy(struct at_stats *dst, const struct at_stats *src);
+
+/**
+ * Command table entry.
+ *
+ * @param stats Statistics instance.
+ * @param i Entry index.
+ * @returns Entry, or NULL if unused or out of range. Entries are filled in
+ *          order, so the first NULL ends the table.
+ */
+const struct at_stats_command *at_stats_command(const struct at_stats *stats, size_t i);
+
+/**
+ * URC table entry.
+ *
+ * @param stats Statistics instance.
+ * @param i Entry index.
+ * @returns Entry, or NULL if unused or out of range.
+ */
+const struct at_stats_urc *at_stats_urc(const struct at_stats *stats, size_t i);
+
+/**
+ * Latency below which a fraction of the histogram's samples fall.
+ *
+ * @param histogram Latency histogram.
+ * @param fraction Fraction of samples, 0.0 to 1.0 (e.g. 0.99).
+ * @returns Upper bound of the bucket holding that sample in microseconds,
+ *          or zero if the histogram is empty.
+ */
+uint64_t at_stats_percentile(const struct at_stats_histogram *histogram, double fraction);
+
+/**
+ * Write a human-readable report: the totals, one line per command prefix
+ * with its counters and median/p99 latencies, and one line per URC prefix.
+ *
+ * @param stats Statistics instance.
+ * @param buf Destination buffer.
+ * @param size Buffer size.
+ * @returns Report length, as snprintf: if it's size or more, the report
+ *          was truncated.
+ */
+size_t at_stats_format(const struct at_stats *stats, char *buf, size_t size);
+
+/*
+ * Recording, called by the AT channel implementation. Timestamps are in
+ * microseconds on any monotonic clock.
+ */
+
+/**
+ * Record a command being sent; the previous one, if any, is dropped.
+ */
+void at_stats_record_command(struct at_stats *stats, const void *data, size_t len, uint64_t now);
+
+/**
+ * Record bytes received.
+ */
+void at_stats_record_input(struct at_stats *stats, size_t len, uint64_t now);
+
+/**
+ * Record the end of the command in flight.
+ *
+ * @param status Zero for a response, ETIMEDOUT, ENOBUFS for an overflowed
+ *               response. Anything else just ends the command.
+ * @param failed The response ended with an error final.
+ */
+void at_stats_record_response(struct at_stats *stats, int status, bool failed, uint64_t now);
+
+/**
+ * Record a URC.
+ */
+void at_stats_record_urc(struct at_stats *stats, const char *line, size_t len);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
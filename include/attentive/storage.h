@@ -0,0 +1,33 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_STORAGE_H
+#define ATTENTIVE_STORAGE_H
+
+#include <stddef.h>
+
+/*
+ * Caller-provided storage.
+ *
+ * Every *_alloc function has an *_init counterpart which sets up the instance
+ * in caller-owned memory instead, sized with the matching *_sizeof function.
+ * Storage must be aligned to AT_STORAGE_ALIGN bytes. Sizes are multiples of
+ * AT_STORAGE_ALIGN, so instances can be packed back to back in one array.
+ * The *_free functions release such instances without freeing the storage.
+ */
+
+/** Alignment required of caller-provided storage. */
+#define AT_STORAGE_ALIGN 16
+
+/** Round a size up to a multiple of AT_STORAGE_ALIGN. */
+#define AT_STORAGE_ROUND(size) \
+    (((size) + AT_STORAGE_ALIGN - 1) & ~(size_t) (AT_STORAGE_ALIGN - 1))
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
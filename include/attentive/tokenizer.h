@@ -0,0 +1,125 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_TOKENIZER_H
+#define ATTENTIVE_TOKENIZER_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Response line tokenizer.
+ *
+ * Walks a V.250 / 3GPP TS 27.007 style response ("+CREG: 0,1,\"00C3\"")
+ * field by field. Field readers skip leading spaces, parse one field and
+ * consume the comma following it, if any. The first failure sets a sticky
+ * error flag; all later calls then do nothing and return zero, so a whole
+ * response can be parsed with a single check at the end:
+ *
+ *     struct at_tok tok;
+ *     at_tok_init(&tok, response);
+ *     at_tok_expect(&tok, "+CREG: ");
+ *     at_tok_skip(&tok);
+ *     int creg = at_tok_int(&tok);
+ *     at_tok_simple_check(&tok);
+ *
+ * Parsing never allocates and doesn't depend on the locale.
+ */
+struct at_tok {
+    const char *pos;    /**< Current position; NULL if initialized with NULL. */
+    bool error;         /**< Set by the first failed call. */
+};
+
+/**
+ * Start tokenizing a response.
+ *
+ * @param tok Tokenizer state.
+ * @param line NULL-terminated response (NULL sets the error flag).
+ */
+void at_tok_init(struct at_tok *tok, const char *line);
+
+/**
+ * Match a literal string, e.g. a response prefix or a separator.
+ *
+ * @param tok Tokenizer state.
+ * @param literal String expected at the current position.
+ * @returns True if matched, false otherwise.
+ */
+bool at_tok_expect(struct at_tok *tok, const char *literal);
+
+/**
+ * Parse a signed decimal integer field.
+ *
+ * @param tok Tokenizer state.
+ * @returns Field value; zero on failure (no digits or out of int range).
+ */
+int at_tok_int(struct at_tok *tok);
+
+/**
+ * Parse a hexadecimal field, optionally quoted (e.g. "00C3").
+ *
+ * @param tok Tokenizer state.
+ * @returns Field value; zero on failure.
+ */
+unsigned int at_tok_hex(struct at_tok *tok);
+
+/**
+ * Parse a decimal fraction field ("-12.345"), independently of the locale.
+ *
+ * @param tok Tokenizer state.
+ * @returns Field value; zero on failure.
+ */
+float at_tok_float(struct at_tok *tok);
+
+/**
+ * Copy a string field, quoted or not, to a buffer.
+ *
+ * @param tok Tokenizer state.
+ * @param buf Destination buffer; always NULL-terminated if size is non-zero.
+ * @param size Destination buffer size in bytes.
+ * @returns String length; zero on failure (unterminated quote or the
+ *          string doesn't fit).
+ */
+size_t at_tok_string(struct at_tok *tok, char *buf, size_t size);
+
+/**
+ * Copy a run of decimal digits, e.g. an IMEI or ICCID, to a buffer. Stops at
+ * the first non-digit; digits that don't fit are dropped.
+ *
+ * @param tok Tokenizer state.
+ * @param buf Destination buffer; always NULL-terminated if size is non-zero.
+ * @param size Destination buffer size in bytes.
+ * @returns Number of digits copied; zero on failure (no digits).
+ */
+size_t at_tok_digits(struct at_tok *tok, char *buf, size_t size);
+
+/**
+ * Skip a field.
+ *
+ * @param tok Tokenizer state.
+ * @returns True if a field was skipped, false at the end of the line.
+ */
+bool at_tok_skip(struct at_tok *tok);
+
+/**
+ * Return -1 if a response couldn't be tokenized. errno is set to EINVAL,
+ * except for NULL responses, where it's left as set by at_command.
+ */
+#define at_tok_simple_check(tok)                                            \
+    do {                                                                    \
+        if ((tok)->error) {                                                 \
+            if ((tok)->pos)                                                 \
+                errno = EINVAL;                                             \
+            return -1;                                                      \
+        }                                                                   \
+    } while (0)
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,86 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_TRANSPORT_H
+#define ATTENTIVE_TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Byte stream an AT channel talks to the modem over: a serial port, a TCP
+ * connection to a terminal server, an in-memory pair... Every transport is
+ * backed by a pollable descriptor, so a channel can watch it together with
+ * its own wakeups from a reader thread or a reactor.
+ */
+struct at_transport {
+    const struct at_transport_ops *ops;
+    const char *name;       /**< Shown in log messages, e.g. the device path. */
+    int fd;                 /**< Pollable descriptor while open, -1 otherwise. */
+};
+
+struct at_transport_ops {
+    /**
+     * Open or connect and set fd. Transports can be reopened after close.
+     *
+     * @param nonblocking Reads and writes return EAGAIN instead of blocking.
+     * @returns Zero on success, -1 and sets errno on failure.
+     */
+    int (*open)(struct at_transport *transport, bool nonblocking);
+    /** Read what's available, as read(). Returns zero on EOF. */
+    ssize_t (*read)(struct at_transport *transport, void *buf, size_t size);
+    /** Write some of the data, as write(). */
+    ssize_t (*write)(struct at_transport *transport, const void *buf, size_t size);
+    /** Wait for poll() events (POLLIN, POLLOUT) on fd. Returns as poll(). */
+    int (*wait)(struct at_transport *transport, short events, int timeout_ms);
+    /**
+     * Enable or disable RTS/CTS hardware flow control, now if open and on
+     * every open. NULL if the transport has no flow control lines.
+     * Enabling fails with ENOTSUP where the platform has no RTS/CTS.
+     *
+     * @returns Zero on success, -1 and sets errno on failure.
+     */
+    int (*set_flow_control)(struct at_transport *transport, bool enable);
+    /**
+     * Change the line speed, now if open and on every open. Output still
+     * queued goes out at the old speed; input still queued is discarded.
+     * NULL if the transport has no line speed.
+     *
+     * @param bps Bits per second.
+     * @returns Zero on success, -1 and sets errno on failure (EINVAL if the
+     *          speed isn't supported).
+     */
+    int (*set_baudrate)(struct at_transport *transport, unsigned long bps);
+    /** Line speed in bits per second, or zero if unknown. NULL as above. */
+    unsigned long (*get_baudrate)(struct at_transport *transport);
+    /**
+     * Have the driver pass input on as soon as it arrives instead of
+     * batching it, now if open and on every open. Disabling puts the
+     * driver setting back as it was found: it's only cleared if enabling
+     * set it. NULL if there's no such setting.
+     *
+     * @returns Zero on success, -1 and sets errno on failure.
+     */
+    int (*set_low_latency)(struct at_transport *transport, bool enable);
+    /** Close fd. */
+    void (*close)(struct at_transport *transport);
+    /** Release the transport. It's closed already. */
+    void (*free)(struct at_transport *transport);
+};
+
+/**
+ * Close and release a transport.
+ *
+ * @param transport Transport instance.
+ */
+void at_transport_free(struct at_transport *transport);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
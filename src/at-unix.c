@@ -6,13 +6,19 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
-#include <attentive/at.h>
+/* For CPU affinity (cpu_set_t, pthread_setaffinity_np). */
+#define _GNU_SOURCE
+
+#include <attentive/at-unix.h>
+#include <attentive/coro.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
-#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <termios.h>
@@ -24,34 +30,303 @@
 #include <sys/time.h>
 #endif
 
+/* Time command waits on the monotonic clock, so setting the system time
+ * doesn't stretch or cut them short. */
+#if _POSIX_TIMERS > 0 && defined(_POSIX_MONOTONIC_CLOCK) && _POSIX_CLOCK_SELECTION > 0
+#define AT_COND_MONOTONIC 1
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
 // Remove once you refactor this out.
 #define AT_COMMAND_LENGTH 80
 
+/* Maximum number of bytes fetched by a single read() in the reader thread. */
+#define AT_READ_CHUNK 4096
+
+/* Maximum number of events collected by one epoll_wait() in a reactor loop. */
+#define AT_REACTOR_EVENTS 64
+
+/* Default response buffer size. */
+#define AT_BUFSIZE 256
+
+/* Default log ring capacity. */
+#define AT_LOG_SIZE 256
+
+/* Default number of retained responses. */
+#define AT_RESPONSE_SLABS 4
+
+/* Default command queue length. */
+#define AT_QUEUE_LENGTH 8
+
+/* Command queued by at_command_async. */
+struct at_unix_command {
+    at_command_handler_t handler;
+    void *arg;
+    size_t len;
+    char line[AT_COMMAND_LENGTH];
+};
+
 struct at_unix {
     struct at at;
 
-    const char *devpath;    /**< Serial port device path. */
-    speed_t baudrate;       /**< Serial port baudate. */
+    struct at_transport *transport; /**< Connection to the modem. */
 
-    int timeout;            /**< Command timeout in seconds. */
+    int timeout_ms;         /**< Command timeout in milliseconds. */
     const char *response;
 
+    struct at_response_pool *responses;     /**< Slabs for at_command_retain. */
+    struct at_response *retained;           /**< Retained copy of the response. */
+
+    struct at_reactor_loop *loop;   /**< NULL: served by the reader thread. */
+    struct at_unix *detach_next;    /**< Next in the loop's detach queue. */
+    bool attached;          /**< Watched by the loop. Protected by the loop mutex. */
+
     pthread_t thread;       /**< Reader thread. */
+    int wake[2];            /**< Self-pipe waking the reader thread from poll(). */
     pthread_mutex_t mutex;  /**< Protects variables below and the parser. */
-    pthread_cond_t cond;    /**< For signalling open/busy release. */
+    pthread_cond_t cond;    /**< For signalling open/busy release, responses and drained queue. */
+    struct at_coro_waitq waiters;   /**< Coroutines waiting like on cond. */
+
+    struct at_unix_command *queue;  /**< Ring of commands from at_command_async. */
+    size_t queue_length;
+    size_t queue_head;      /**< Oldest command; in flight if async is set. */
+    size_t queue_count;
+    int64_t deadline;       /**< Monotonic ms deadline of the queued command in flight, or 0. */
+    int timerfd;            /**< Reactor mode: fires at the deadline. */
+
+    struct at_stats *stats; /**< NULL: statistics disabled. */
+    struct at_record *record;       /**< NULL: not recording. */
+
+    const struct at_urc_handler *urcs;      /**< URC table compiled below. */
+    struct at_prefix_matcher *urc_matcher;  /**< NULL: scan the table linearly. */
+    int urc;                /**< URC table entry matched by the last scan_line. */
+
+    /* Settings for the next synchronous command. Held back until the queue
+     * has drained, so they can't apply to a queued command's response. */
+    struct {
+        at_line_scanner_t scanner;
+        void *data_buf;
+        size_t data_size;
+        at_response_handler_t line_handler;
+        void *line_arg;
+        bool dataprompt;
+    } next;
 
-    int fd;                 /**< Serial port file descriptor. */
     bool running : 1;       /**< Reader thread should be running. */
     bool open : 1;          /**< FD is valid. Set/cleared by open()/close(). */
     bool busy : 1;          /**< FD is in use. Set/cleared by reader thread. */
     bool waiting : 1;       /**< Waiting for response callback to arrive. */
+    bool retain : 1;        /**< Retain the response of the current command. */
+    bool async : 1;         /**< The head of the queue has been sent. */
+    bool completing : 1;    /**< In a completion handler; hold back the next command. */
+    bool flow_control : 1;  /**< RTS/CTS enabled on the transport. */
+
+    /* Set after the reader thread starts, so it can't share the bits above. */
+    bool allocated;         /**< Storage came from at_alloc_unix_config. */
 };
 
 void *at_reader_thread(void *arg);
 
-static void handle_sigusr1(int signal)
+static int at_reactor_join(struct at_unix *priv, struct at_reactor *reactor);
+static void at_reactor_leave(struct at_unix *priv);
+static int at_reactor_attach(struct at_unix *priv);
+static void at_reactor_detach(struct at_unix *priv);
+
+/**
+ * Create the reader thread wakeup pipe. Both ends are non-blocking, so
+ * wakeups never stall at_close() and draining never stalls the reader.
+ *
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+static int wake_pipe_open(int fds[2])
+{
+    if (pipe(fds))
+        return -1;
+
+    for (int i=0; i<2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    return 0;
+}
+
+/* Interrupt poll() in the reader thread. A full pipe has a wakeup pending. */
+static void wake_reader(struct at_unix *priv)
+{
+    char byte = 0;
+    ssize_t result = write(priv->wake[1], &byte, 1);
+    (void) result;
+}
+
+/* Monotonic clock in milliseconds, for command deadlines. */
+static int64_t at_clock_ms(void)
+{
+#if _POSIX_TIMERS > 0
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (int64_t) 1000 + ts.tv_nsec / 1000000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * (int64_t) 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+/* Monotonic clock in microseconds, for statistics. */
+static uint64_t at_clock_us(void)
+{
+#if _POSIX_TIMERS > 0
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t) 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * (uint64_t) 1000000 + tv.tv_usec;
+#endif
+}
+
+/**
+ * Absolute pthread_cond_timedwait() time, ms milliseconds from now, on the
+ * clock of the channel condvar.
+ */
+static void at_cond_deadline(struct timespec *ts, int ms)
+{
+#if AT_COND_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#elif _POSIX_TIMERS > 0
+    clock_gettime(CLOCK_REALTIME, ts);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    ts->tv_sec = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000;
+#endif
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long) (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ * Wait for a response or a drained queue: on the condvar, or in a coroutine
+ * (see attentive/coro.h) by yielding to its scheduler. Called with the
+ * mutex held.
+ *
+ * @param deadline at_clock_ms() time to give up at, or zero.
+ * @returns False on timeout.
+ */
+static bool at_wait(struct at_unix *priv, int64_t deadline)
+{
+    int ms = 0;
+    if (deadline) {
+        int64_t left = deadline - at_clock_ms();
+        if (left <= 0)
+            return false;
+        ms = (int) left;
+    }
+
+    if (at_coro_self())
+        return at_coro_wait(&priv->waiters, &priv->mutex, ms);
+
+    if (!deadline) {
+        pthread_cond_wait(&priv->cond, &priv->mutex);
+        return true;
+    }
+    struct timespec ts;
+    at_cond_deadline(&ts, ms);
+    return pthread_cond_timedwait(&priv->cond, &priv->mutex, &ts) != ETIMEDOUT;
+}
+
+/* Wake up everyone in at_wait(). Called with the mutex held. */
+static void at_notify(struct at_unix *priv)
+{
+    pthread_cond_broadcast(&priv->cond);
+    at_coro_wake_all(&priv->waiters);
+}
+
+/**
+ * Set the deadline of the queued command being sent and make sure whoever
+ * reads the channel notices it.
+ */
+static void at_deadline_arm(struct at_unix *priv)
+{
+    priv->deadline = (priv->timeout_ms ? at_clock_ms() + priv->timeout_ms : 0);
+
+#ifdef __linux__
+    if (priv->loop) {
+        struct itimerspec its = {
+            .it_value.tv_sec = priv->deadline / 1000,
+            .it_value.tv_nsec = priv->deadline % 1000 * 1000000,
+        };
+        timerfd_settime(priv->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+        return;
+    }
+#endif
+
+    /* The reader thread picks up a new poll() timeout on its next pass. */
+    if (priv->deadline && !pthread_equal(pthread_self(), priv->thread))
+        wake_reader(priv);
+}
+
+static void at_deadline_disarm(struct at_unix *priv)
+{
+    priv->deadline = 0;
+
+#ifdef __linux__
+    if (priv->loop) {
+        struct itimerspec its = { .it_value.tv_sec = 0 };
+        timerfd_settime(priv->timerfd, 0, &its, NULL);
+    }
+#endif
+}
+
+/**
+ * Take the oldest command off the queue and pass it its response or error.
+ * Called with the mutex held.
+ */
+static void at_queue_complete(struct at_unix *priv, const char *response, int status)
+{
+    /* The handler may reuse the slot by queueing another command. */
+    struct at_unix_command *command = &priv->queue[priv->queue_head];
+    at_command_handler_t handler = command->handler;
+    void *arg = command->arg;
+
+    priv->queue_head = (priv->queue_head + 1) % priv->queue_length;
+    priv->queue_count--;
+    priv->async = false;
+    at_deadline_disarm(priv);
+
+    if (handler) {
+        priv->completing = true;
+        handler(response, status, arg);
+        priv->completing = false;
+    }
+
+    /* Notify at_command() and at_command_drain(). */
+    if (!priv->queue_count)
+        at_notify(priv);
+}
+
+/* Fail the queued command in flight once its deadline passes. */
+static void at_queue_expire(struct at_unix *priv)
 {
-    (void)signal;
+    if (priv->async && priv->deadline && at_clock_ms() >= priv->deadline) {
+        if (priv->stats)
+            at_stats_record_response(priv->stats, ETIMEDOUT, false, at_clock_us());
+        if (priv->record)
+            at_record_response(priv->record, ETIMEDOUT, false);
+        at_parser_reset(priv->at.parser);
+        at_queue_complete(priv, NULL, ETIMEDOUT);
+    }
 }
 
 static void handle_response(const char *buf, size_t len, void *arg)
@@ -59,28 +334,83 @@ static void handle_response(const char *buf, size_t len, void *arg)
     struct at_unix *priv = (struct at_unix *) arg;
 
     /* The mutex is held by the reader thread; don't reacquire. */
+    int status = (at_parser_overflowed(priv->at.parser) ? ENOBUFS : 0);
+    if (priv->stats)
+        at_stats_record_response(priv->stats, status, at_parser_failed(priv->at.parser), at_clock_us());
+    if (priv->record)
+        at_record_response(priv->record, status, at_parser_failed(priv->at.parser));
+
+    if (priv->async) {
+        /* Response to a queued command. The next one goes out once the
+         * parser is done with this one; see at_queue_send(). */
+        at_queue_complete(priv, status ? NULL : buf, status);
+        return;
+    }
+
     priv->response = buf;
-    (void) len;
     priv->waiting = false;
-    pthread_cond_signal(&priv->cond);
+
+    /* Copy the response out before later URCs can overwrite the buffer. */
+    if (priv->retain)
+        priv->retained = at_response_pool_get(priv->responses, buf, len);
+
+    at_notify(priv);
 }
 
 static void handle_urc(const char *buf, size_t len, void *arg)
 {
-    struct at *at = (struct at *) arg;
+    struct at_unix *priv = (struct at_unix *) arg;
+    struct at *at = &priv->at;
+
+    if (priv->stats)
+        at_stats_record_urc(priv->stats, buf, len);
+
+    if (!at->cbs)
+        return;
+
+    /* Dispatch URCs classified by the table in scan_line. */
+    if (priv->urc != -1) {
+        const struct at_urc_handler *urc = &priv->urcs[priv->urc];
+        if (urc->handler)
+            urc->handler(buf, len, strlen(urc->prefix), at->arg);
+        return;
+    }
 
     /* Forward to caller's URC callback, if any. */
     if (at->cbs->handle_urc)
         at->cbs->handle_urc(buf, len, at->arg);
 }
 
+/**
+ * Find the URC table entry a line starts with.
+ *
+ * @returns Entry index or -1 if none matches.
+ */
+static int urc_find(struct at_unix *priv, const char *line)
+{
+    if (!priv->urcs)
+        return -1;
+
+    if (priv->urc_matcher)
+        return at_prefix_matcher_find(priv->urc_matcher, line);
+
+    for (int i=0; priv->urcs[i].prefix; i++)
+        if (!strncmp(line, priv->urcs[i].prefix, strlen(priv->urcs[i].prefix)))
+            return i;
+    return -1;
+}
+
 enum at_response_type scan_line(const char *line, size_t len, void *arg)
 {
-    struct at *at = (struct at *) arg;
+    struct at_unix *priv = (struct at_unix *) arg;
+    struct at *at = &priv->at;
 
     enum at_response_type type = AT_RESPONSE_UNKNOWN;
+    priv->urc = -1;
     if (at->command_scanner)
         type = at->command_scanner(line, len, at->arg);
+    if (!type && (priv->urc = urc_find(priv, line)) != -1)
+        type = AT_RESPONSE_URC;
     if (!type && at->cbs && at->cbs->scan_line)
         type = at->cbs->scan_line(line, len, at->arg);
     return type;
@@ -92,38 +422,228 @@ static const struct at_parser_callbacks parser_callbacks = {
     .scan_line = scan_line,
 };
 
+/**
+ * Apply the reader thread priority and CPU affinity settings. Failures
+ * (usually EPERM without CAP_SYS_NICE) are only logged; the channel works
+ * either way, just with more jitter.
+ */
+static void at_reader_schedule(struct at_unix *priv, const struct at_unix_config *config)
+{
+    if (config->reader_priority > 0) {
+        struct sched_param param = { .sched_priority = config->reader_priority };
+        int result = pthread_setschedparam(priv->thread, SCHED_FIFO, &param);
+        if (result)
+            at_log(priv->at.log, AT_LOG_WARNING, "at_init_unix[%s]: SCHED_FIFO priority %d: %s",
+                   priv->transport->name, config->reader_priority, strerror(result));
+    }
+
+#ifdef __linux__
+    if (config->reader_cpus) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (unsigned i=0; i<sizeof(config->reader_cpus) * CHAR_BIT; i++)
+            if (config->reader_cpus & (1UL << i))
+                CPU_SET(i, &cpus);
+        int result = pthread_setaffinity_np(priv->thread, sizeof(cpus), &cpus);
+        if (result)
+            at_log(priv->at.log, AT_LOG_WARNING, "at_init_unix[%s]: CPU affinity %#lx: %s",
+                   priv->transport->name, config->reader_cpus, strerror(result));
+    }
+#endif
+}
+
 struct at *at_alloc_unix(const char *devpath, speed_t baudrate)
 {
-    /* allocate instance */
-    struct at_unix *priv = malloc(sizeof(struct at_unix));
-    if (!priv) {
+    return at_alloc_unix_config(devpath, baudrate, NULL);
+}
+
+struct at *at_alloc_unix_config(const char *devpath, speed_t baudrate,
+                                const struct at_unix_config *config)
+{
+    /* allocate instance, log and parser in one block */
+    void *storage = malloc(at_sizeof_unix(config));
+    if (!storage) {
         errno = ENOMEM;
         return NULL;
     }
+
+    struct at_unix *priv = (struct at_unix *) at_init_unix(storage, devpath, baudrate, config);
+    if (!priv) {
+        free(storage);
+        return NULL;
+    }
+    priv->allocated = true;
+
+    return &priv->at;
+}
+
+/* Retained responses can be as long as the response buffer can grow. */
+static size_t config_response_size(const struct at_unix_config *config, size_t bufsize)
+{
+    return (config && config->bufsize_max > bufsize ? config->bufsize_max : bufsize);
+}
+
+/*
+ * Instance storage layout: the channel struct, the log, the parser, the
+ * response pool, the command queue, then the statistics and the serial port
+ * transport if needed.
+ */
+size_t at_sizeof_unix(const struct at_unix_config *config)
+{
+    size_t bufsize = (config && config->bufsize ? config->bufsize : AT_BUFSIZE);
+    size_t log_size = (config && config->log_size ? config->log_size : AT_LOG_SIZE);
+    size_t slabs = (config && config->response_slabs ? config->response_slabs : AT_RESPONSE_SLABS);
+    size_t queue_length = (config && config->queue_length ? config->queue_length : AT_QUEUE_LENGTH);
+    size_t stats_commands = (config ? config->stats_commands : 0);
+    size_t stats_urcs = (config ? config->stats_urcs : 0);
+    bool serial = !(config && config->transport);
+
+    return AT_STORAGE_ROUND(sizeof(struct at_unix)) +
+           at_log_sizeof(log_size) +
+           at_parser_sizeof(bufsize) +
+           at_response_pool_sizeof(slabs, config_response_size(config, bufsize)) +
+           AT_STORAGE_ROUND(queue_length * sizeof(struct at_unix_command)) +
+           (stats_commands || stats_urcs ? at_stats_sizeof(stats_commands, stats_urcs) : 0) +
+           (serial ? at_transport_serial_sizeof() : 0);
+}
+
+/**
+ * Undo a failed at_init_unix: release what it set up so far, in reverse
+ * order. Keeps errno.
+ *
+ * @param locks The mutex and condition variable have been initialized.
+ */
+static void at_init_unwind(struct at_unix *priv, bool locks)
+{
+    int why = errno;
+    if (locks) {
+        pthread_cond_destroy(&priv->cond);
+        pthread_mutex_destroy(&priv->mutex);
+    }
+    if (priv->responses)
+        at_response_pool_free(priv->responses);
+    if (priv->at.parser)
+        at_parser_free(priv->at.parser);
+    at_log_free(priv->at.log);
+    errno = why;
+}
+
+struct at *at_init_unix(void *storage, const char *devpath, speed_t baudrate,
+                        const struct at_unix_config *config)
+{
+    size_t bufsize = (config && config->bufsize ? config->bufsize : AT_BUFSIZE);
+    size_t log_size = (config && config->log_size ? config->log_size : AT_LOG_SIZE);
+    size_t slabs = (config && config->response_slabs ? config->response_slabs : AT_RESPONSE_SLABS);
+    size_t queue_length = (config && config->queue_length ? config->queue_length : AT_QUEUE_LENGTH);
+    size_t stats_commands = (config ? config->stats_commands : 0);
+    size_t stats_urcs = (config ? config->stats_urcs : 0);
+
+    struct at_unix *priv = storage;
+    char *next = (char *) storage + AT_STORAGE_ROUND(sizeof(struct at_unix));
     memset(priv, 0, sizeof(struct at_unix));
 
-    /* allocate underlying parser */
-    priv->at.parser = at_parser_alloc(&parser_callbacks, 256, (void *) priv);
+    /* set up channel log */
+    priv->at.log = at_log_init(next, log_size);
+    next += at_log_sizeof(log_size);
+    if (config && config->log_drain_ms && at_log_start(priv->at.log, config->log_drain_ms)) {
+        at_init_unwind(priv, false);
+        return NULL;
+    }
+
+    /* set up underlying parser */
+    priv->at.parser = at_parser_init(next, &parser_callbacks, bufsize, (void *) priv);
     if (!priv->at.parser) {
-        free(priv);
+        at_init_unwind(priv, false);
         return NULL;
     }
+    next += at_parser_sizeof(bufsize);
+
+    /* set up retained response pool */
+    priv->responses = at_response_pool_init(next, slabs, config_response_size(config, bufsize));
+    next += at_response_pool_sizeof(slabs, config_response_size(config, bufsize));
+
+    /* set up command queue */
+    priv->queue = (struct at_unix_command *) next;
+    priv->queue_length = queue_length;
+    next += AT_STORAGE_ROUND(queue_length * sizeof(struct at_unix_command));
+
+    /* set up statistics, if enabled */
+    if (stats_commands || stats_urcs) {
+        priv->stats = at_stats_init(next, stats_commands, stats_urcs);
+        next += at_stats_sizeof(stats_commands, stats_urcs);
+    }
+
+    /* record traffic, if asked to */
+    if (config)
+        priv->record = config->record;
+
+    /* set up the serial port, unless given another transport */
+    if (config && config->transport)
+        priv->transport = config->transport;
+    else
+        priv->transport = at_transport_serial_init(next, devpath, baudrate);
+
+    /* hardware flow control, if the transport has it */
+    if (config && config->flow_control) {
+        if (!priv->transport->ops->set_flow_control) {
+            errno = ENOTSUP;
+            at_init_unwind(priv, false);
+            return NULL;
+        }
+        if (priv->transport->ops->set_flow_control(priv->transport, true)) {
+            at_init_unwind(priv, false);
+            return NULL;
+        }
+        priv->flow_control = true;
+    }
+
+    /* low latency input, if the transport can tell its driver */
+    if (config && config->low_latency && priv->transport->ops->set_low_latency)
+        priv->transport->ops->set_low_latency(priv->transport, true);
 
-    /* copy over device parameters */
-    priv->devpath = devpath;
-    priv->baudrate = baudrate;
+    at_parser_set_log(priv->at.parser, priv->at.log);
+    if (config && config->bufsize_max > bufsize) {
+        size_t step = (config->bufsize_step ? config->bufsize_step : bufsize);
+        at_parser_set_buffer_growth(priv->at.parser, step, config->bufsize_max);
+    }
 
-    /* install empty SIGUSR1 handler */
-    struct sigaction sa = {
-        .sa_handler = handle_sigusr1,
-    };
-    sigaction(SIGUSR1, &sa, NULL);
+    /* Recursive, so completion handlers can queue further commands. */
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&priv->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+#if AT_COND_MONOTONIC
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&priv->cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    /* a reactor does the reading; no thread of our own */
+    int result = (config && config->reactor ? at_reactor_join(priv, config->reactor)
+                                            : wake_pipe_open(priv->wake));
+    if (result) {
+        at_init_unwind(priv, true);
+        return NULL;
+    }
+    if (priv->loop)
+        return (struct at *) priv;
 
-    /* initialize and start reader thread */
+    /* start reader thread */
     priv->running = true;
-    pthread_mutex_init(&priv->mutex, NULL);
-    pthread_cond_init(&priv->cond, NULL);
-    pthread_create(&priv->thread, NULL, at_reader_thread, (void *) priv);
+    result = pthread_create(&priv->thread, NULL, at_reader_thread, (void *) priv);
+    if (result) {
+        priv->running = false;
+        close(priv->wake[0]);
+        close(priv->wake[1]);
+        errno = result;
+        at_init_unwind(priv, true);
+        return NULL;
+    }
+    if (config)
+        at_reader_schedule(priv, config);
 
     return (struct at *) priv;
 }
@@ -138,17 +658,18 @@ int at_open(struct at *at)
         return 0;
     }
 
-    priv->fd = open(priv->devpath, O_RDWR);
-    if (priv->fd == -1) {
+    /* The reactor reads only what's there; it must never block. */
+    if (priv->transport->ops->open(priv->transport, priv->loop != NULL)) {
         pthread_mutex_unlock(&priv->mutex);
         return -1;
     }
 
-    if (priv->baudrate) {
-        struct termios attr;
-        tcgetattr(priv->fd, &attr);
-        cfsetspeed(&attr, priv->baudrate);
-        tcsetattr(priv->fd, TCSANOW, &attr);
+    if (priv->loop && at_reactor_attach(priv)) {
+        int why = errno;
+        priv->transport->ops->close(priv->transport);
+        pthread_mutex_unlock(&priv->mutex);
+        errno = why;
+        return -1;
     }
 
     priv->open = true;
@@ -171,18 +692,35 @@ int at_close(struct at *at)
     /* Mark the port descriptor as invalid. */
     priv->open = false;
 
-    /* Interrupt read() in the reader thread. */
-    pthread_kill(priv->thread, SIGUSR1);
+    if (priv->loop) {
+        /* Have the reactor stop watching the descriptor. It may be
+         * waiting for the mutex to deliver one last event. */
+        pthread_mutex_unlock(&priv->mutex);
+        at_reactor_detach(priv);
+        pthread_mutex_lock(&priv->mutex);
+    } else {
+        /* Interrupt poll() in the reader thread. */
+        wake_reader(priv);
+        pthread_cond_broadcast(&priv->cond);
+        at_coro_wake_all(&priv->waiters);
 
-    /* Wait for the read operation to complete. */
-    while (priv->busy)
-        pthread_cond_wait(&priv->cond, &priv->mutex);
+        /* Wait for the read operation to complete. */
+        while (priv->busy)
+            pthread_cond_wait(&priv->cond, &priv->mutex);
+    }
+
+    /* Fail queued commands; nothing will answer them now. */
+    if (priv->async)
+        at_parser_reset(priv->at.parser);
+    while (priv->queue_count)
+        at_queue_complete(priv, NULL, ENODEV);
 
-    /* Close the file descriptor. */
-    close(priv->fd);
-    priv->fd = -1;
+    /* Close the connection. */
+    priv->transport->ops->close(priv->transport);
 
     pthread_mutex_unlock(&priv->mutex);
+
+    at_log_drain(priv->at.log);
     return 0;
 }
 
@@ -193,198 +731,912 @@ void at_free(struct at *at)
     /* make sure the channel is closed */
     at_close(at);
 
-    /* ask the reader thread to terminate */
-    pthread_mutex_lock(&priv->mutex);
-    priv->running = false;
-    pthread_mutex_unlock(&priv->mutex);
+    if (!priv->loop) {
+        /* ask the reader thread to terminate */
+        pthread_mutex_lock(&priv->mutex);
+        priv->running = false;
+        pthread_cond_broadcast(&priv->cond);
+        pthread_mutex_unlock(&priv->mutex);
 
-    /* wait for the reader thread to terminate */
-    pthread_kill(priv->thread, SIGUSR1);
-    pthread_join(priv->thread, NULL);
+        /* wait for the reader thread to terminate */
+        wake_reader(priv);
+        pthread_join(priv->thread, NULL);
+        close(priv->wake[0]);
+        close(priv->wake[1]);
+    } else {
+        at_reactor_leave(priv);
+    }
     pthread_cond_destroy(&priv->cond);
     pthread_mutex_destroy(&priv->mutex);
 
     /* free up resources */
-    free(priv->at.parser);
-    free(priv);
+    if (priv->urc_matcher)
+        at_prefix_matcher_free(priv->urc_matcher);
+    at_response_pool_free(priv->responses);
+    at_parser_free(priv->at.parser);
+    at_log_free(priv->at.log);
+    if (priv->allocated)
+        free(priv);
+}
+
+/**
+ * Compile a URC table into a prefix matcher.
+ *
+ * @returns Matcher instance pointer on success, NULL and sets errno on failure.
+ */
+static struct at_prefix_matcher *urc_compile(const struct at_urc_handler *urcs)
+{
+    size_t count = 0;
+    while (urcs[count].prefix)
+        count++;
+
+    const char **prefixes = malloc((count + 1) * sizeof(*prefixes));
+    if (!prefixes) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i=0; i<=count; i++)
+        prefixes[i] = urcs[i].prefix;
+
+    struct at_prefix_matcher *matcher = at_prefix_matcher_alloc(prefixes);
+    free(prefixes);
+    return matcher;
 }
 
 void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg)
 {
+    struct at_unix *priv = (struct at_unix *) at;
+    const struct at_urc_handler *urcs = cbs ? cbs->urcs : NULL;
+
+    /* Compile the URC table outside the lock; it stays the same on reattach. */
+    struct at_prefix_matcher *matcher = NULL;
+    if (urcs && urcs != priv->urcs)
+        matcher = urc_compile(urcs);
+
+    pthread_mutex_lock(&priv->mutex);
     at->cbs = cbs;
     at->arg = arg;
+    if (urcs != priv->urcs) {
+        /* A failed compile falls back to linear scanning in urc_find(). */
+        struct at_prefix_matcher *old = priv->urc_matcher;
+        priv->urcs = urcs;
+        priv->urc_matcher = matcher;
+        matcher = old;
+    }
+    pthread_mutex_unlock(&priv->mutex);
+
+    if (matcher)
+        at_prefix_matcher_free(matcher);
 }
 
-void at_set_command_scanner(struct at *at, at_line_scanner_t scanner)
+void at_set_log_handler(struct at *at, at_log_handler_t handler, void *arg)
 {
-    at->command_scanner = scanner;
+    at_log_set_handler(at->log, handler, arg);
 }
 
-void at_set_timeout(struct at *at, int timeout)
+void at_set_log_level(struct at *at, enum at_log_level level)
 {
-    struct at_unix *priv = (struct at_unix *) at;
-
-    priv->timeout = timeout;
+    at_log_set_level(at->log, level);
 }
 
-void at_expect_dataprompt(struct at *at)
+void at_log_flush(struct at *at)
 {
-    at_parser_expect_dataprompt(at->parser);
+    at_log_drain(at->log);
 }
 
-static const char *_at_command(struct at_unix *priv, const void *data, size_t size)
+struct at_stats *at_get_stats(struct at *at, bool reset)
 {
-    pthread_mutex_lock(&priv->mutex);
+    struct at_unix *priv = (struct at_unix *) at;
 
-    /* Bail out if the channel is closing or closed. */
-    if (!priv->open) {
-        pthread_mutex_unlock(&priv->mutex);
-        errno = ENODEV;
+    if (!priv->stats) {
+        errno = ENOTSUP;
         return NULL;
     }
 
-    /* Prepare parser. */
-    at_parser_await_response(priv->at.parser);
-
-    /* Send the command. */
-    // FIXME: handle interrupts, short writes, errors, etc.
-    write(priv->fd, data, size);
-
-    /* Wait for the parser thread to collect a response. */
-    priv->waiting = true;
-    if (priv->timeout) {
-        struct timespec ts;
-#if _POSIX_TIMERS > 0
-        clock_gettime(CLOCK_REALTIME, &ts);
-#else
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        ts.tv_sec = tv.tv_sec;
-        ts.tv_nsec = tv.tv_usec * 1000;
-#endif
-        ts.tv_sec += priv->timeout;
+    struct at_stats *snapshot = at_stats_alloc(priv->stats->ncommands, priv->stats->nurcs);
+    if (!snapshot)
+        return NULL;
 
-        while (priv->open && priv->waiting)
-            if (pthread_cond_timedwait(&priv->cond, &priv->mutex, &ts) == ETIMEDOUT)
-                break;
-    } else {
-        while (priv->open && priv->waiting)
-            pthread_cond_wait(&priv->cond, &priv->mutex);
-    }
+    pthread_mutex_lock(&priv->mutex);
+    at_stats_copy(snapshot, priv->stats);
+    if (reset)
+        at_stats_reset(priv->stats);
+    pthread_mutex_unlock(&priv->mutex);
 
-    const char *result;
-    if (!priv->open) {
-        /* The serial port was closed behind our back. */
-        errno = ENODEV;
-        result = NULL;
-    } else if (priv->waiting) {
-        /* Timed out waiting for a response. */
-        at_parser_reset(priv->at.parser);
-        errno = ETIMEDOUT;
-        result = NULL;
-    } else {
-        /* Response arrived. */
-        result = priv->response;
-    }
+    return snapshot;
+}
 
-    /* Reset per-command settings. */
-    priv->at.command_scanner = NULL;
+void at_set_command_scanner(struct at *at, at_line_scanner_t scanner)
+{
+    struct at_unix *priv = (struct at_unix *) at;
 
+    pthread_mutex_lock(&priv->mutex);
+    priv->next.scanner = scanner;
     pthread_mutex_unlock(&priv->mutex);
+}
 
-    return result;
+void at_set_timeout(struct at *at, int timeout)
+{
+    at_set_timeout_ms(at, timeout * 1000);
 }
 
-const char *at_command(struct at *at, const char *format, ...)
+void at_set_timeout_ms(struct at *at, int timeout_ms)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
-    /* Build command string. */
-    va_list ap;
-    va_start(ap, format);
-    char line[AT_COMMAND_LENGTH];
-    int len = vsnprintf(line, sizeof(line)-1, format, ap);
-    va_end(ap);
+    priv->timeout_ms = timeout_ms;
+}
 
-    /* Bail out if we run out of space. */
-    if (len >= (int)(sizeof(line)-1)) {
-        errno = ENOMEM;
-        return NULL;
+int at_set_flow_control(struct at *at, bool enable)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    if (!priv->transport->ops->set_flow_control) {
+        errno = ENOTSUP;
+        return -1;
     }
 
-    printf("> %s\n", line);
+    /* Don't change line settings in the middle of a command. */
+    pthread_mutex_lock(&priv->mutex);
+    int result = priv->transport->ops->set_flow_control(priv->transport, enable);
+    if (!result)
+        priv->flow_control = enable;
+    pthread_mutex_unlock(&priv->mutex);
 
-    /* Append modem-style newline. */
+    return result;
+}
+
+bool at_get_flow_control(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    return priv->flow_control;
+}
+
+int at_set_baudrate(struct at *at, unsigned long bps)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    if (!priv->transport->ops->set_baudrate) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    /* Between commands only: nothing may go out at the wrong speed. */
+    pthread_mutex_lock(&priv->mutex);
+    if (priv->waiting || priv->queue_count) {
+        pthread_mutex_unlock(&priv->mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    int result = priv->transport->ops->set_baudrate(priv->transport, bps);
+    if (!result)
+        at_parser_reset(priv->at.parser);
+    pthread_mutex_unlock(&priv->mutex);
+
+    return result;
+}
+
+unsigned long at_get_baudrate(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    if (!priv->transport->ops->get_baudrate)
+        return 0;
+
+    pthread_mutex_lock(&priv->mutex);
+    unsigned long bps = priv->transport->ops->get_baudrate(priv->transport);
+    pthread_mutex_unlock(&priv->mutex);
+
+    return bps;
+}
+
+void at_expect_dataprompt(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->next.dataprompt = true;
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+void at_set_data_buffer(struct at *at, void *buf, size_t size)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->next.data_buf = buf;
+    priv->next.data_size = size;
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+void at_set_line_handler(struct at *at, at_response_handler_t handler, void *arg)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->next.line_handler = handler;
+    priv->next.line_arg = arg;
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+/**
+ * Write a whole buffer. Waits for room on non-blocking descriptors.
+ */
+static void at_write(struct at_transport *transport, const void *data, size_t size)
+{
+    const char *pos = data;
+
+    while (size > 0) {
+        ssize_t result = transport->ops->write(transport, pos, size);
+        if (result > 0) {
+            pos += result;
+            size -= result;
+        } else if (result == -1 && errno == EAGAIN) {
+            transport->ops->wait(transport, POLLOUT, -1);
+        } else if (result == -1 && errno == EINTR) {
+            continue;
+        } else {
+            // FIXME: report write errors instead of waiting for the timeout.
+            return;
+        }
+    }
+}
+
+/**
+ * Send the oldest queued command, unless the channel is busy with another
+ * one. Called with the mutex held, after the parser is done with a response.
+ */
+static void at_queue_send(struct at_unix *priv)
+{
+    if (!priv->open || priv->waiting || priv->async || priv->completing || !priv->queue_count)
+        return;
+
+    struct at_unix_command *command = &priv->queue[priv->queue_head];
+    at_parser_await_response(priv->at.parser);
+    priv->async = true;
+    at_deadline_arm(priv);
+    if (priv->stats)
+        at_stats_record_command(priv->stats, command->line, command->len, at_clock_us());
+    if (priv->record)
+        at_record_write(priv->record, AT_RECORD_COMMAND, command->line, command->len);
+    at_write(priv->transport, command->line, command->len);
+}
+
+/**
+ * Hand the settings staged for the next command over to the parser. Called
+ * with the mutex held, once nothing else is in flight.
+ */
+static void at_command_settings_apply(struct at_unix *priv)
+{
+    priv->at.command_scanner = priv->next.scanner;
+    if (priv->next.dataprompt)
+        at_parser_expect_dataprompt(priv->at.parser);
+    at_parser_set_data_buffer(priv->at.parser, priv->next.data_buf, priv->next.data_size);
+    at_parser_set_line_handler(priv->at.parser, priv->next.line_handler, priv->next.line_arg);
+    memset(&priv->next, 0, sizeof(priv->next));
+}
+
+/**
+ * Drop the per-command settings (command scanner, data buffer, line handler),
+ * so neither the channel nor the parser keeps pointers to the caller's
+ * variables after the command returns. Called with the mutex held, on every
+ * exit from _at_command.
+ */
+static void at_command_settings_clear(struct at_unix *priv)
+{
+    memset(&priv->next, 0, sizeof(priv->next));
+    priv->at.command_scanner = NULL;
+    at_parser_set_data_buffer(priv->at.parser, NULL, 0);
+    at_parser_set_line_handler(priv->at.parser, NULL, NULL);
+}
+
+/**
+ * Send data and wait for the response.
+ *
+ * @param retained If not NULL, set to a retained copy of the response.
+ */
+static const char *_at_command(struct at_unix *priv, const void *data, size_t size,
+                               struct at_response **retained)
+{
+    pthread_mutex_lock(&priv->mutex);
+
+    /* Let queued commands go first. */
+    while (priv->open && priv->queue_count)
+        at_wait(priv, 0);
+
+    /* Bail out if the channel is closing or closed. */
+    if (!priv->open) {
+        at_command_settings_clear(priv);
+        pthread_mutex_unlock(&priv->mutex);
+        errno = ENODEV;
+        return NULL;
+    }
+
+    /* Prepare parser. */
+    at_command_settings_apply(priv);
+    at_parser_await_response(priv->at.parser);
+    priv->retain = (retained != NULL);
+    priv->retained = NULL;
+
+    /* Send the command. */
+    if (priv->stats)
+        at_stats_record_command(priv->stats, data, size, at_clock_us());
+    if (priv->record)
+        at_record_write(priv->record, AT_RECORD_COMMAND, data, size);
+    at_write(priv->transport, data, size);
+
+    /* Wait for the parser thread to collect a response. */
+    priv->waiting = true;
+    int64_t deadline = (priv->timeout_ms ? at_clock_ms() + priv->timeout_ms : 0);
+    while (priv->open && priv->waiting)
+        if (!at_wait(priv, deadline))
+            break;
+
+    const char *result;
+    if (!priv->open) {
+        /* The serial port was closed behind our back. */
+        errno = ENODEV;
+        result = NULL;
+    } else if (priv->waiting) {
+        /* Timed out waiting for a response. */
+        if (priv->stats)
+            at_stats_record_response(priv->stats, ETIMEDOUT, false, at_clock_us());
+        if (priv->record)
+            at_record_response(priv->record, ETIMEDOUT, false);
+        at_parser_reset(priv->at.parser);
+        errno = ETIMEDOUT;
+        result = NULL;
+    } else if (at_parser_overflowed(priv->at.parser)) {
+        /* Response didn't fit in the buffer; don't pass on a truncated one. */
+        errno = ENOBUFS;
+        result = NULL;
+    } else if (priv->retain && !priv->retained) {
+        /* No free slab. Slabs fit the largest possible response, so
+         * that's the only way at_response_pool_get can fail here. */
+        errno = ENOBUFS;
+        result = NULL;
+    } else {
+        /* Response arrived. */
+        result = priv->response;
+    }
+
+    /* Hand over the retained copy, if the command succeeded. */
+    if (retained)
+        *retained = (result ? priv->retained : NULL);
+    if (!result)
+        at_response_release(priv->retained);
+    priv->retained = NULL;
+
+    /* Reset per-command settings. */
+    priv->waiting = false;
+    priv->retain = false;
+    at_command_settings_clear(priv);
+
+    /* Send commands queued in the meantime. */
+    at_queue_send(priv);
+
+    pthread_mutex_unlock(&priv->mutex);
+
+    /* Hand the command's log messages over on the caller's thread, so
+     * a slow log consumer never holds up the reader. */
+    int why = errno;
+    at_log_drain(priv->at.log);
+    errno = why;
+
+    return result;
+}
+
+/**
+ * Build a command line, including the modem-style newline.
+ *
+ * @param line Destination buffer of AT_COMMAND_LENGTH bytes.
+ * @returns Line length on success, -1 and sets errno on failure.
+ */
+static int at_format_command(struct at *at, char *line, const char *format, va_list ap)
+{
+    int len = vsnprintf(line, AT_COMMAND_LENGTH-1, format, ap);
+
+    /* Bail out if we run out of space. */
+    if (len >= AT_COMMAND_LENGTH-1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    at_log(at->log, AT_LOG_DEBUG, "> %s", line);
+
+    /* Append modem-style newline. */
     line[len++] = '\r';
 
+    return len;
+}
+
+const char *at_command(struct at *at, const char *format, ...)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Build command string. */
+    va_list ap;
+    va_start(ap, format);
+    char line[AT_COMMAND_LENGTH];
+    int len = at_format_command(at, line, format, ap);
+    va_end(ap);
+    if (len == -1)
+        return NULL;
+
+    /* Send the command. */
+    return _at_command(priv, line, len, NULL);
+}
+
+struct at_response *at_command_retain(struct at *at, const char *format, ...)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Build command string. */
+    va_list ap;
+    va_start(ap, format);
+    char line[AT_COMMAND_LENGTH];
+    int len = at_format_command(at, line, format, ap);
+    va_end(ap);
+    if (len == -1)
+        return NULL;
+
     /* Send the command. */
-    return _at_command(priv, line, len);
+    struct at_response *response;
+    _at_command(priv, line, len, &response);
+    return response;
+}
+
+int at_command_async(struct at *at, at_command_handler_t handler, void *arg, const char *format, ...)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Build command string. */
+    va_list ap;
+    va_start(ap, format);
+    char line[AT_COMMAND_LENGTH];
+    int len = at_format_command(at, line, format, ap);
+    va_end(ap);
+    if (len == -1)
+        return -1;
+
+    pthread_mutex_lock(&priv->mutex);
+
+    if (!priv->open) {
+        pthread_mutex_unlock(&priv->mutex);
+        errno = ENODEV;
+        return -1;
+    }
+    if (priv->queue_count == priv->queue_length) {
+        pthread_mutex_unlock(&priv->mutex);
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    size_t tail = (priv->queue_head + priv->queue_count) % priv->queue_length;
+    struct at_unix_command *command = &priv->queue[tail];
+    command->handler = handler;
+    command->arg = arg;
+    command->len = len;
+    memcpy(command->line, line, len);
+    priv->queue_count++;
+
+    /* Goes out right away if the channel is idle. */
+    at_queue_send(priv);
+
+    pthread_mutex_unlock(&priv->mutex);
+
+    return 0;
+}
+
+void at_command_drain(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    while (priv->open && priv->queue_count)
+        at_wait(priv, 0);
+    pthread_mutex_unlock(&priv->mutex);
+
+    at_log_drain(priv->at.log);
 }
 
 const char *at_command_raw(struct at *at, const void *data, size_t size)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
-    printf("> [%zu bytes]\n", size);
+    at_log(at->log, AT_LOG_DEBUG, "> [%zu bytes]", size);
 
-    return _at_command(priv, data, size);
+    return _at_command(priv, data, size, NULL);
 }
 
 void *at_reader_thread(void *arg)
 {
     struct at_unix *priv = (struct at_unix *)arg;
+    char buf[AT_READ_CHUNK];
 
-    printf("at_reader_thread[%s]: starting\n", priv->devpath);
+    at_log(priv->at.log, AT_LOG_DEBUG, "at_reader_thread[%s]: starting", priv->transport->name);
 
-    while (true) {
-        pthread_mutex_lock(&priv->mutex);
+    pthread_mutex_lock(&priv->mutex);
 
+    while (true) {
         /* Wait for the port descriptor to be valid. */
         while (priv->running && !priv->open)
             pthread_cond_wait(&priv->cond, &priv->mutex);
 
         if (!priv->running) {
             /* Time to die. */
-            pthread_mutex_unlock(&priv->mutex);
             break;
         }
 
+        /* Wake up for the deadline of a queued command, if any. */
+        int wait = -1;
+        if (priv->async && priv->deadline) {
+            int64_t left = priv->deadline - at_clock_ms();
+            wait = (left > 0 ? (int) left : 0);
+        }
+
         /* Lock access to the port descriptor. */
         priv->busy = true;
         pthread_mutex_unlock(&priv->mutex);
 
-        /* Attempt to read some data. */
-        char ch;
-        int result = read(priv->fd, &ch, 1);
-        int why = errno;
+        /* Wait for data or a wakeup from at_close()/at_free(). */
+        struct pollfd fds[2] = {
+            { .fd = priv->transport->fd, .events = POLLIN },
+            { .fd = priv->wake[0], .events = POLLIN },
+        };
+        ssize_t result = -1;
+        int why = EINTR;
+        if (poll(fds, 2, wait) == -1) {
+            why = errno;
+        } else if (fds[1].revents) {
+            /* Woken up; recheck the flags. */
+            while (read(priv->wake[0], buf, sizeof(buf)) > 0)
+                continue;
+        } else if (fds[0].revents) {
+            /* Attempt to read some data. Returns whatever is available, so
+             * the parser gets fed whole chunks instead of single bytes. */
+            result = priv->transport->ops->read(priv->transport, buf, sizeof(buf));
+            why = errno;
+        }
 
         pthread_mutex_lock(&priv->mutex);
         /* Unlock access to the port descriptor. */
         priv->busy = false;
         /* Notify at_close() that the port is now free. */
-        pthread_cond_signal(&priv->cond);
-        pthread_mutex_unlock(&priv->mutex);
+        pthread_cond_broadcast(&priv->cond);
 
-        if (result == 1) {
+        if (result > 0) {
             /* Data received, feed the parser. */
-            pthread_mutex_lock(&priv->mutex);
-            at_parser_feed(priv->at.parser, &ch, 1);
-            pthread_mutex_unlock(&priv->mutex);
-        } else if (result == -1) {
-            printf("at_reader_thread[%s]: %s\n", priv->devpath, strerror(why));
-            if (why == EINTR)
-                continue;
-            else
-                break;
+            if (priv->stats)
+                at_stats_record_input(priv->stats, result, at_clock_us());
+            if (priv->record)
+                at_record_write(priv->record, AT_RECORD_INPUT, buf, result);
+            at_parser_feed(priv->at.parser, buf, result);
+        } else if (result == -1 && (why == EINTR || why == EAGAIN)) {
+            /* Woken up or timed out. */
         } else {
-            printf("at_reader_thread[%s]: received EOF\n", priv->devpath);
-            break;
+            if (result == -1)
+                at_log(priv->at.log, AT_LOG_ERROR, "at_reader_thread[%s]: %s", priv->transport->name, strerror(why));
+            else
+                at_log(priv->at.log, AT_LOG_WARNING, "at_reader_thread[%s]: received EOF", priv->transport->name);
+
+            /* The port is gone (e.g. USB unplug); wait until it's reopened. */
+            while (priv->running && priv->open)
+                pthread_cond_wait(&priv->cond, &priv->mutex);
+            continue;
         }
+
+        /* Time out the queued command in flight, send the next one. */
+        at_queue_expire(priv);
+        at_queue_send(priv);
     }
 
-    printf("at_reader_thread[%s]: finished\n", priv->devpath);
+    pthread_mutex_unlock(&priv->mutex);
+
+    at_log(priv->at.log, AT_LOG_DEBUG, "at_reader_thread[%s]: finished", priv->transport->name);
 
     return NULL;
 }
 
+#ifdef __linux__
+
+/*
+ * Reactor: a fixed set of event loops, each an epoll instance served by one
+ * thread. Channels are spread over the loops round robin when created and
+ * stay on their loop for life. Only the loop thread ever holds events of its
+ * epoll instance, so a channel can be dropped safely between two batches:
+ * at_close queues it and waits for the loop to detach it.
+ */
+struct at_reactor_loop {
+    int epfd;               /**< Watches channel descriptors, their timers and wakefd. */
+    int wakefd;             /**< Interrupts epoll_wait(). */
+    pthread_t thread;       /**< Loop thread. */
+    pthread_mutex_t mutex;  /**< Protects variables below. */
+    pthread_cond_t cond;    /**< For signalling detached channels. */
+    struct at_unix *detaching;      /**< Channels waiting to be detached. */
+    bool running;           /**< Loop thread should be running. */
+};
+
+struct at_reactor {
+    int nloops;
+    unsigned next;          /**< Loop index for the next channel. */
+    struct at_reactor_loop loops[];
+};
+
+static void at_reactor_wake(struct at_reactor_loop *loop)
+{
+    eventfd_write(loop->wakefd, 1);
+}
+
+/**
+ * Read whatever a channel has received and feed it to its parser.
+ */
+static void at_reactor_dispatch(struct at_reactor_loop *loop, struct at_unix *priv,
+                                char *buf, size_t size)
+{
+    pthread_mutex_lock(&priv->mutex);
+
+    /* Closed while the event was waiting for the mutex. */
+    if (!priv->open) {
+        pthread_mutex_unlock(&priv->mutex);
+        return;
+    }
+
+    ssize_t result = priv->transport->ops->read(priv->transport, buf, size);
+    if (result > 0) {
+        /* Data received, feed the parser. */
+        if (priv->stats)
+            at_stats_record_input(priv->stats, result, at_clock_us());
+        if (priv->record)
+            at_record_write(priv->record, AT_RECORD_INPUT, buf, result);
+        at_parser_feed(priv->at.parser, buf, result);
+    } else if (result == -1 && (errno == EAGAIN || errno == EINTR)) {
+        /* Nothing to read; the deadline timer fired or a spurious wakeup. */
+    } else {
+        if (result == -1)
+            at_log(priv->at.log, AT_LOG_ERROR, "at_reactor[%s]: %s", priv->transport->name, strerror(errno));
+        else
+            at_log(priv->at.log, AT_LOG_WARNING, "at_reactor[%s]: received EOF", priv->transport->name);
+
+        /* A dead descriptor stays readable; stop watching it. */
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, priv->transport->fd, NULL);
+    }
+
+    /* Time out the queued command in flight, send the next one. */
+    at_queue_expire(priv);
+    at_queue_send(priv);
+
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+static void *at_reactor_thread(void *arg)
+{
+    struct at_reactor_loop *loop = (struct at_reactor_loop *) arg;
+    struct epoll_event events[AT_REACTOR_EVENTS];
+    char buf[AT_READ_CHUNK];
+
+    pthread_mutex_lock(&loop->mutex);
+
+    while (loop->running) {
+        /* The previous batch is done, so no event refers to these. */
+        while (loop->detaching) {
+            struct at_unix *priv = loop->detaching;
+            loop->detaching = priv->detach_next;
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, priv->transport->fd, NULL);
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, priv->timerfd, NULL);
+            priv->attached = false;
+        }
+        pthread_cond_broadcast(&loop->cond);
+        pthread_mutex_unlock(&loop->mutex);
+
+        int count = epoll_wait(loop->epfd, events, AT_REACTOR_EVENTS, -1);
+        for (int i=0; i<count; i++) {
+            if (events[i].data.ptr == loop) {
+                eventfd_t value;
+                eventfd_read(loop->wakefd, &value);
+                continue;
+            }
+            at_reactor_dispatch(loop, events[i].data.ptr, buf, sizeof(buf));
+        }
+
+        pthread_mutex_lock(&loop->mutex);
+    }
+
+    pthread_mutex_unlock(&loop->mutex);
+
+    return NULL;
+}
+
+static int at_reactor_loop_start(struct at_reactor_loop *loop)
+{
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1)
+        return -1;
+
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = loop };
+    if (loop->wakefd == -1 || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &event)) {
+        int why = errno;
+        if (loop->wakefd != -1)
+            close(loop->wakefd);
+        close(loop->epfd);
+        errno = why;
+        return -1;
+    }
+
+    loop->detaching = NULL;
+    loop->running = true;
+    pthread_mutex_init(&loop->mutex, NULL);
+    pthread_cond_init(&loop->cond, NULL);
+
+    int result = pthread_create(&loop->thread, NULL, at_reactor_thread, (void *) loop);
+    if (result) {
+        pthread_cond_destroy(&loop->cond);
+        pthread_mutex_destroy(&loop->mutex);
+        close(loop->wakefd);
+        close(loop->epfd);
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void at_reactor_loop_stop(struct at_reactor_loop *loop)
+{
+    pthread_mutex_lock(&loop->mutex);
+    loop->running = false;
+    at_reactor_wake(loop);
+    pthread_mutex_unlock(&loop->mutex);
+
+    pthread_join(loop->thread, NULL);
+    pthread_cond_destroy(&loop->cond);
+    pthread_mutex_destroy(&loop->mutex);
+    close(loop->wakefd);
+    close(loop->epfd);
+}
+
+struct at_reactor *at_reactor_alloc(int nthreads)
+{
+    if (nthreads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (cpus > 0 ? cpus : 1);
+    }
+
+    struct at_reactor *reactor = malloc(sizeof(struct at_reactor) +
+                                        nthreads * sizeof(struct at_reactor_loop));
+    if (!reactor) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    reactor->nloops = 0;
+    reactor->next = 0;
+
+    for (int i=0; i<nthreads; i++) {
+        if (at_reactor_loop_start(&reactor->loops[i])) {
+            int why = errno;
+            at_reactor_free(reactor);
+            errno = why;
+            return NULL;
+        }
+        reactor->nloops++;
+    }
+
+    return reactor;
+}
+
+void at_reactor_free(struct at_reactor *reactor)
+{
+    for (int i=0; i<reactor->nloops; i++)
+        at_reactor_loop_stop(&reactor->loops[i]);
+    free(reactor);
+}
+
+/**
+ * Assign a new channel to a loop and set up its deadline timer.
+ *
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+static int at_reactor_join(struct at_unix *priv, struct at_reactor *reactor)
+{
+    priv->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (priv->timerfd == -1)
+        return -1;
+
+    unsigned next = __atomic_fetch_add(&reactor->next, 1, __ATOMIC_RELAXED);
+    priv->loop = &reactor->loops[next % reactor->nloops];
+
+    return 0;
+}
+
+static void at_reactor_leave(struct at_unix *priv)
+{
+    close(priv->timerfd);
+}
+
+/**
+ * Start watching an open channel. Called with the channel mutex held.
+ *
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+static int at_reactor_attach(struct at_unix *priv)
+{
+    struct at_reactor_loop *loop = priv->loop;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = priv };
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, priv->transport->fd, &event))
+        return -1;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, priv->timerfd, &event)) {
+        int why = errno;
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, priv->transport->fd, NULL);
+        errno = why;
+        return -1;
+    }
+
+    pthread_mutex_lock(&loop->mutex);
+    priv->attached = true;
+    pthread_mutex_unlock(&loop->mutex);
+
+    return 0;
+}
+
+/**
+ * Stop watching a channel and wait until the loop no longer refers to it.
+ * Must not be called from the loop thread, e.g. from a URC handler.
+ */
+static void at_reactor_detach(struct at_unix *priv)
+{
+    struct at_reactor_loop *loop = priv->loop;
+
+    pthread_mutex_lock(&loop->mutex);
+    priv->detach_next = loop->detaching;
+    loop->detaching = priv;
+    at_reactor_wake(loop);
+    while (priv->attached)
+        pthread_cond_wait(&loop->cond, &loop->mutex);
+    pthread_mutex_unlock(&loop->mutex);
+}
+
+#else
+
+struct at_reactor *at_reactor_alloc(int nthreads)
+{
+    (void) nthreads;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void at_reactor_free(struct at_reactor *reactor)
+{
+    (void) reactor;
+}
+
+static int at_reactor_join(struct at_unix *priv, struct at_reactor *reactor)
+{
+    (void) priv;
+    (void) reactor;
+    errno = ENOSYS;
+    return -1;
+}
+
+static void at_reactor_leave(struct at_unix *priv)
+{
+    (void) priv;
+}
+
+static int at_reactor_attach(struct at_unix *priv)
+{
+    (void) priv;
+    errno = ENOSYS;
+    return -1;
+}
+
+static void at_reactor_detach(struct at_unix *priv)
+{
+    (void) priv;
+}
+
+#endif
+
 /* vim: set ts=4 sw=4 et: */
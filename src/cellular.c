@@ -26,6 +26,16 @@ int cellular_attach(struct cellular *modem, struct at *at, const char *apn)
     return modem->ops->attach ? modem->ops->attach(modem) : 0;
 }
 
+void cellular_set_flow_control(struct cellular *modem, bool enable)
+{
+    modem->flow_control = enable;
+}
+
+void cellular_set_baudrates(struct cellular *modem, const unsigned long *baudrates)
+{
+    modem->baudrates = baudrates;
+}
+
 int cellular_detach(struct cellular *modem)
 {
     /* Do nothing if we're not attached. */
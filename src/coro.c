@@ -0,0 +1,443 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/* For clock_gettime, pthread_condattr_setclock, MAP_ANONYMOUS and the
+ * ucontext calls. */
+#define _GNU_SOURCE
+
+#include <attentive/coro.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define AT_CORO_STACK_SIZE (64 * 1024)
+
+/* Not on the timer heap. */
+#define AT_CORO_NO_TIMER SIZE_MAX
+
+enum at_coro_state {
+    AT_CORO_READY,          /**< On the ready list. */
+    AT_CORO_RUNNING,
+    AT_CORO_PARKED,         /**< Waiting for a wakeup, maybe on the timer heap. */
+    AT_CORO_DONE,
+};
+
+struct at_coro {
+    struct at_coro_sched *sched;
+    ucontext_t context;
+    at_coro_func_t func;
+    void *arg;
+    char *stack;            /**< Mapping, guard page included. */
+    size_t stack_size;
+
+    /* Protected by the scheduler mutex. */
+    enum at_coro_state state;
+    bool woken;             /**< Woken up since it last parked. */
+    int64_t deadline;       /**< Monotonic ms, while on the timer heap. */
+    size_t timer;           /**< Timer heap index, or AT_CORO_NO_TIMER. */
+    struct at_coro *next;   /**< Next on the ready list. */
+    struct at_coro *all_prev, *all_next;
+
+    /* Protected by the wait queue's mutex. */
+    struct at_coro_waitq *waitq;
+    struct at_coro *wait_prev, *wait_next;
+};
+
+struct at_coro_sched {
+    size_t stack_size;
+    size_t page_size;
+    ucontext_t context;     /**< The scheduler loop, resumed when a coroutine yields. */
+
+    pthread_mutex_t mutex;  /**< Protects the variables below. */
+    pthread_cond_t cond;    /**< Signals ready coroutines to an idle scheduler. */
+    struct at_coro *ready_head, *ready_tail;
+    struct at_coro **timers;        /**< Min-heap of parked coroutines by deadline. */
+    size_t ntimers;
+    size_t timers_size;
+    struct at_coro *all;    /**< Every coroutine that hasn't returned. */
+    size_t count;
+};
+
+static __thread struct at_coro *at_coro_current;
+
+static int64_t coro_clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (int64_t) 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Timer heap. Called with the scheduler mutex held.
+ */
+
+static void timer_set(struct at_coro_sched *sched, size_t i, struct at_coro *coro)
+{
+    sched->timers[i] = coro;
+    coro->timer = i;
+}
+
+static void timer_sift_up(struct at_coro_sched *sched, size_t i)
+{
+    struct at_coro *coro = sched->timers[i];
+    while (i > 0 && sched->timers[(i - 1) / 2]->deadline > coro->deadline) {
+        timer_set(sched, i, sched->timers[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    timer_set(sched, i, coro);
+}
+
+static void timer_sift_down(struct at_coro_sched *sched, size_t i)
+{
+    struct at_coro *coro = sched->timers[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= sched->ntimers)
+            break;
+        if (child + 1 < sched->ntimers && sched->timers[child + 1]->deadline < sched->timers[child]->deadline)
+            child++;
+        if (sched->timers[child]->deadline >= coro->deadline)
+            break;
+        timer_set(sched, i, sched->timers[child]);
+        i = child;
+    }
+    timer_set(sched, i, coro);
+}
+
+/* Room for every coroutine is reserved by at_coro_spawn. */
+static void timer_add(struct at_coro_sched *sched, struct at_coro *coro)
+{
+    sched->timers[sched->ntimers] = coro;
+    timer_sift_up(sched, sched->ntimers++);
+}
+
+static void timer_remove(struct at_coro_sched *sched, struct at_coro *coro)
+{
+    size_t i = coro->timer;
+    struct at_coro *last = sched->timers[--sched->ntimers];
+    coro->timer = AT_CORO_NO_TIMER;
+    if (last == coro)
+        return;
+
+    timer_set(sched, i, last);
+    timer_sift_up(sched, i);
+    timer_sift_down(sched, last->timer);
+}
+
+/* Called with the scheduler mutex held. */
+static void ready_push(struct at_coro_sched *sched, struct at_coro *coro)
+{
+    coro->state = AT_CORO_READY;
+    coro->next = NULL;
+    if (sched->ready_tail)
+        sched->ready_tail->next = coro;
+    else
+        sched->ready_head = coro;
+    sched->ready_tail = coro;
+}
+
+static void coro_release(struct at_coro *coro)
+{
+    munmap(coro->stack, coro->stack_size);
+    free(coro);
+}
+
+struct at_coro_sched *at_coro_sched_alloc(size_t stack_size)
+{
+    struct at_coro_sched *sched = calloc(1, sizeof(struct at_coro_sched));
+    if (!sched) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    sched->page_size = sysconf(_SC_PAGESIZE);
+    stack_size = (stack_size ? stack_size : AT_CORO_STACK_SIZE);
+    sched->stack_size = (stack_size + sched->page_size - 1) / sched->page_size * sched->page_size;
+
+    pthread_mutex_init(&sched->mutex, NULL);
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched->cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    return sched;
+}
+
+static void coro_entry(void)
+{
+    struct at_coro *coro = at_coro_current;
+
+    coro->func(coro->arg);
+
+    /* Returns to the scheduler through uc_link. */
+    pthread_mutex_lock(&coro->sched->mutex);
+    coro->state = AT_CORO_DONE;
+    pthread_mutex_unlock(&coro->sched->mutex);
+}
+
+int at_coro_spawn(struct at_coro_sched *sched, at_coro_func_t func, void *arg)
+{
+    struct at_coro *coro = calloc(1, sizeof(struct at_coro));
+    if (!coro) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Only touched pages get memory; the lowest one catches overflows. */
+    coro->stack_size = sched->stack_size + sched->page_size;
+    coro->stack = mmap(NULL, coro->stack_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (coro->stack == MAP_FAILED) {
+        free(coro);
+        errno = ENOMEM;
+        return -1;
+    }
+    mprotect(coro->stack, sched->page_size, PROT_NONE);
+
+    coro->sched = sched;
+    coro->func = func;
+    coro->arg = arg;
+    coro->timer = AT_CORO_NO_TIMER;
+    getcontext(&coro->context);
+    coro->context.uc_stack.ss_sp = coro->stack + sched->page_size;
+    coro->context.uc_stack.ss_size = sched->stack_size;
+    coro->context.uc_link = &sched->context;
+    makecontext(&coro->context, coro_entry, 0);
+
+    pthread_mutex_lock(&sched->mutex);
+    if (sched->count == sched->timers_size) {
+        size_t size = (sched->timers_size ? 2 * sched->timers_size : 16);
+        struct at_coro **timers = realloc(sched->timers, size * sizeof(*timers));
+        if (!timers) {
+            pthread_mutex_unlock(&sched->mutex);
+            coro_release(coro);
+            errno = ENOMEM;
+            return -1;
+        }
+        sched->timers = timers;
+        sched->timers_size = size;
+    }
+    coro->all_next = sched->all;
+    if (sched->all)
+        sched->all->all_prev = coro;
+    sched->all = coro;
+    sched->count++;
+    ready_push(sched, coro);
+    pthread_cond_signal(&sched->cond);
+    pthread_mutex_unlock(&sched->mutex);
+
+    return 0;
+}
+
+void at_coro_sched_run(struct at_coro_sched *sched)
+{
+    pthread_mutex_lock(&sched->mutex);
+
+    while (sched->count) {
+        /* Wake up coroutines whose time has come. */
+        int64_t now = coro_clock_ms();
+        while (sched->ntimers && sched->timers[0]->deadline <= now) {
+            struct at_coro *coro = sched->timers[0];
+            timer_remove(sched, coro);
+            ready_push(sched, coro);
+        }
+
+        if (!sched->ready_head) {
+            if (sched->ntimers) {
+                int64_t deadline = sched->timers[0]->deadline;
+                struct timespec ts = {
+                    .tv_sec = deadline / 1000,
+                    .tv_nsec = deadline % 1000 * 1000000,
+                };
+                pthread_cond_timedwait(&sched->cond, &sched->mutex, &ts);
+            } else {
+                pthread_cond_wait(&sched->cond, &sched->mutex);
+            }
+            continue;
+        }
+
+        struct at_coro *coro = sched->ready_head;
+        sched->ready_head = coro->next;
+        if (!sched->ready_head)
+            sched->ready_tail = NULL;
+        coro->state = AT_CORO_RUNNING;
+        pthread_mutex_unlock(&sched->mutex);
+
+        at_coro_current = coro;
+        swapcontext(&sched->context, &coro->context);
+        at_coro_current = NULL;
+
+        pthread_mutex_lock(&sched->mutex);
+        if (coro->state == AT_CORO_DONE) {
+            if (coro->all_prev)
+                coro->all_prev->all_next = coro->all_next;
+            else
+                sched->all = coro->all_next;
+            if (coro->all_next)
+                coro->all_next->all_prev = coro->all_prev;
+            sched->count--;
+            coro_release(coro);
+        }
+    }
+
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+void at_coro_sched_free(struct at_coro_sched *sched)
+{
+    while (sched->all) {
+        struct at_coro *coro = sched->all;
+        sched->all = coro->all_next;
+        coro_release(coro);
+    }
+
+    pthread_cond_destroy(&sched->cond);
+    pthread_mutex_destroy(&sched->mutex);
+    free(sched->timers);
+    free(sched);
+}
+
+struct at_coro *at_coro_self(void)
+{
+    return at_coro_current;
+}
+
+/**
+ * Switch back to the scheduler until woken up or timed out.
+ *
+ * @param timeout_ms Zero: no timeout.
+ * @returns True if woken up, including before it got to park.
+ */
+static bool coro_park(struct at_coro *coro, int64_t timeout_ms)
+{
+    struct at_coro_sched *sched = coro->sched;
+
+    pthread_mutex_lock(&sched->mutex);
+    if (!coro->woken) {
+        coro->state = AT_CORO_PARKED;
+        if (timeout_ms > 0) {
+            coro->deadline = coro_clock_ms() + timeout_ms;
+            timer_add(sched, coro);
+        }
+        /* Only this thread resumes coroutines, so nothing can run this
+         * one before the switch even if it's woken up right away. */
+        pthread_mutex_unlock(&sched->mutex);
+        swapcontext(&coro->context, &sched->context);
+        pthread_mutex_lock(&sched->mutex);
+    }
+    bool woken = coro->woken;
+    coro->woken = false;
+    pthread_mutex_unlock(&sched->mutex);
+
+    return woken;
+}
+
+static void coro_wake(struct at_coro *coro)
+{
+    struct at_coro_sched *sched = coro->sched;
+
+    pthread_mutex_lock(&sched->mutex);
+    coro->woken = true;
+    if (coro->state == AT_CORO_PARKED) {
+        if (coro->timer != AT_CORO_NO_TIMER)
+            timer_remove(sched, coro);
+        ready_push(sched, coro);
+        pthread_cond_signal(&sched->cond);
+    }
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+/* Forget wakeups that arrived after the coroutine last waited. */
+static void coro_unwake(struct at_coro *coro)
+{
+    pthread_mutex_lock(&coro->sched->mutex);
+    coro->woken = false;
+    pthread_mutex_unlock(&coro->sched->mutex);
+}
+
+void at_coro_yield(void)
+{
+    struct at_coro *coro = at_coro_current;
+    if (!coro)
+        return;
+
+    struct at_coro_sched *sched = coro->sched;
+    pthread_mutex_lock(&sched->mutex);
+    ready_push(sched, coro);
+    pthread_mutex_unlock(&sched->mutex);
+    swapcontext(&coro->context, &sched->context);
+}
+
+void at_coro_sleep_ms(int ms)
+{
+    struct at_coro *coro = at_coro_current;
+
+    if (!coro) {
+        struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (long) (ms % 1000) * 1000000 };
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            continue;
+        return;
+    }
+
+    int64_t deadline = coro_clock_ms() + ms;
+    coro_unwake(coro);
+    for (int64_t left; (left = deadline - coro_clock_ms()) > 0; )
+        coro_park(coro, left);
+}
+
+bool at_coro_wait(struct at_coro_waitq *waitq, pthread_mutex_t *mutex, int timeout_ms)
+{
+    struct at_coro *coro = at_coro_current;
+
+    coro_unwake(coro);
+    coro->waitq = waitq;
+    coro->wait_prev = NULL;
+    coro->wait_next = waitq->head;
+    if (waitq->head)
+        waitq->head->wait_prev = coro;
+    waitq->head = coro;
+
+    pthread_mutex_unlock(mutex);
+    bool woken = coro_park(coro, timeout_ms);
+    pthread_mutex_lock(mutex);
+
+    /* Timed out: still queued. */
+    if (coro->waitq) {
+        if (coro->wait_prev)
+            coro->wait_prev->wait_next = coro->wait_next;
+        else
+            waitq->head = coro->wait_next;
+        if (coro->wait_next)
+            coro->wait_next->wait_prev = coro->wait_prev;
+        coro->waitq = NULL;
+    }
+
+    return woken;
+}
+
+void at_coro_wake_all(struct at_coro_waitq *waitq)
+{
+    struct at_coro *coro = waitq->head;
+    waitq->head = NULL;
+
+    while (coro) {
+        struct at_coro *next = coro->wait_next;
+        coro->waitq = NULL;
+        coro_wake(coro);
+        coro = next;
+    }
+}
+
+/* vim: set ts=4 sw=4 et: */
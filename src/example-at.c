@@ -30,6 +30,7 @@ int main(int argc, char *argv[])
 
     printf("allocating channel...\n");
     struct at *at = at_alloc_unix(devpath, B115200);
+    at_set_log_level(at, AT_LOG_DEBUG);
 
     printf("opening port...\n");
     assert(at_open(at) == 0);
@@ -23,8 +23,13 @@ int main(int argc, char *argv[])
     const char *apn = argv[2];
 
     struct at *at = at_alloc_unix(devpath, B115200);
+    at_set_log_level(at, AT_LOG_DEBUG);
     struct cellular *modem = cellular_sim800_alloc();
 
+    /* Start at 115200, go as fast as the modem does after attach. */
+    static const unsigned long baudrates[] = { 460800, 230400, 0 };
+    cellular_set_baudrates(modem, baudrates);
+
     assert(at_open(at) == 0);
     assert(cellular_attach(modem, at, apn) == 0);
 
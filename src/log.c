@@ -0,0 +1,325 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/* For clock_gettime and pthread_condattr_setclock. */
+#define _GNU_SOURCE
+
+#include <attentive/log.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Maximum message length; longer messages are truncated. */
+#define AT_LOG_MESSAGE_SIZE 120
+
+/*
+ * The ring is a bounded multi-producer, multi-consumer queue with per-slot
+ * sequence numbers (after Dmitry Vyukov). A slot whose sequence equals the
+ * enqueue position is free; one whose sequence is position+1 holds a message.
+ * Producers and consumers claim positions with a CAS and never wait for each
+ * other, so logging from the reader thread can't be stalled by a slow handler.
+ */
+struct at_log_slot {
+    size_t seq;
+    enum at_log_level level;
+    unsigned short len;
+    char msg[AT_LOG_MESSAGE_SIZE];
+};
+
+struct at_log_priv {
+    struct at_log log;
+
+    at_log_handler_t handler;
+    void *arg;
+
+    struct at_log_slot *slots;
+    size_t mask;
+    size_t enqueue_pos;
+    size_t dequeue_pos;
+    size_t dropped;         /**< Messages lost to a full ring. */
+
+    pthread_t thread;       /**< Background drain thread. */
+    pthread_mutex_t mutex;  /**< Protects the variables below. */
+    pthread_cond_t cond;    /**< For waking up the drain thread. */
+    int interval_ms;
+    bool running : 1;
+    bool started : 1;
+    bool allocated : 1;     /**< Storage came from at_log_alloc. */
+};
+
+/* Ring capacity for a requested number of slots. */
+static size_t at_log_capacity(size_t slots)
+{
+    size_t size = 1;
+    while (size < slots)
+        size <<= 1;
+    return size;
+}
+
+size_t at_log_sizeof(size_t slots)
+{
+    return AT_STORAGE_ROUND(sizeof(struct at_log_priv)) +
+           AT_STORAGE_ROUND(at_log_capacity(slots) * sizeof(struct at_log_slot));
+}
+
+struct at_log *at_log_alloc(size_t slots)
+{
+    void *storage = malloc(at_log_sizeof(slots));
+    if (!storage) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct at_log_priv *priv = (struct at_log_priv *) at_log_init(storage, slots);
+    priv->allocated = true;
+
+    return &priv->log;
+}
+
+struct at_log *at_log_init(void *storage, size_t slots)
+{
+    size_t size = at_log_capacity(slots);
+
+    struct at_log_priv *priv = storage;
+    memset(priv, 0, sizeof(struct at_log_priv));
+
+    /* The ring follows the instance. */
+    priv->slots = (struct at_log_slot *) ((char *) storage + AT_STORAGE_ROUND(sizeof(struct at_log_priv)));
+    for (size_t i=0; i<size; i++)
+        priv->slots[i].seq = i;
+    priv->mask = size - 1;
+
+    priv->log.level = AT_LOG_INFO;
+    priv->handler = at_log_stream_handler;
+    priv->arg = stdout;
+
+    /* Time the drain thread's waits on the monotonic clock, so setting the
+     * system time doesn't stall it or make it spin. */
+    pthread_mutex_init(&priv->mutex, NULL);
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&priv->cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    return (struct at_log *) priv;
+}
+
+void at_log_set_handler(struct at_log *log, at_log_handler_t handler, void *arg)
+{
+    struct at_log_priv *priv = (struct at_log_priv *) log;
+
+    /* Flush messages meant for the previous handler. */
+    at_log_drain(log);
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->handler = handler;
+    priv->arg = arg;
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+void at_log_set_level(struct at_log *log, enum at_log_level level)
+{
+    log->level = level;
+}
+
+void at_log_write(struct at_log *log, enum at_log_level level, const char *format, ...)
+{
+    struct at_log_priv *priv = (struct at_log_priv *) log;
+
+    /* Claim a free slot. */
+    struct at_log_slot *slot;
+    size_t pos = __atomic_load_n(&priv->enqueue_pos, __ATOMIC_RELAXED);
+    while (true) {
+        slot = &priv->slots[pos & priv->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&priv->enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /* Ring full; never block the caller. */
+            __atomic_fetch_add(&priv->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&priv->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Format the message in place. */
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(slot->msg, sizeof(slot->msg), format, ap);
+    va_end(ap);
+    if (len < 0)
+        len = 0;
+    if (len >= (int) sizeof(slot->msg))
+        len = sizeof(slot->msg) - 1;
+    slot->len = len;
+    slot->level = level;
+
+    /* Publish. */
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take the oldest message off the ring.
+ *
+ * @returns True if a message was copied to the slot, false if the ring is empty.
+ */
+static bool at_log_dequeue(struct at_log_priv *priv, struct at_log_slot *out)
+{
+    struct at_log_slot *slot;
+    size_t pos = __atomic_load_n(&priv->dequeue_pos, __ATOMIC_RELAXED);
+    while (true) {
+        slot = &priv->slots[pos & priv->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&priv->dequeue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&priv->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    out->level = slot->level;
+    out->len = slot->len;
+    memcpy(out->msg, slot->msg, slot->len + 1);
+
+    /* Hand the slot back to producers one lap ahead. */
+    __atomic_store_n(&slot->seq, pos + priv->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t at_log_drain(struct at_log *log)
+{
+    struct at_log_priv *priv = (struct at_log_priv *) log;
+    struct at_log_slot msg;
+    size_t count = 0;
+
+    /* Serialize handler calls; producers are never blocked by this. */
+    pthread_mutex_lock(&priv->mutex);
+
+    while (at_log_dequeue(priv, &msg)) {
+        if (priv->handler)
+            priv->handler(msg.level, msg.msg, msg.len, priv->arg);
+        count++;
+    }
+
+    size_t dropped = __atomic_exchange_n(&priv->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped && priv->handler) {
+        msg.len = snprintf(msg.msg, sizeof(msg.msg), "log: %zu messages dropped", dropped);
+        priv->handler(AT_LOG_WARNING, msg.msg, msg.len, priv->arg);
+    }
+
+    pthread_mutex_unlock(&priv->mutex);
+
+    return count;
+}
+
+static void *at_log_thread(void *arg)
+{
+    struct at_log_priv *priv = arg;
+
+    pthread_mutex_lock(&priv->mutex);
+    while (priv->running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += priv->interval_ms / 1000;
+        ts.tv_nsec += (priv->interval_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&priv->cond, &priv->mutex, &ts);
+
+        pthread_mutex_unlock(&priv->mutex);
+        at_log_drain(&priv->log);
+        pthread_mutex_lock(&priv->mutex);
+    }
+    pthread_mutex_unlock(&priv->mutex);
+
+    return NULL;
+}
+
+int at_log_start(struct at_log *log, int interval_ms)
+{
+    struct at_log_priv *priv = (struct at_log_priv *) log;
+
+    pthread_mutex_lock(&priv->mutex);
+    if (priv->started) {
+        pthread_mutex_unlock(&priv->mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    priv->interval_ms = (interval_ms > 0 ? interval_ms : 1);
+    priv->running = true;
+
+    int err = pthread_create(&priv->thread, NULL, at_log_thread, priv);
+    if (err) {
+        priv->running = false;
+        pthread_mutex_unlock(&priv->mutex);
+        errno = err;
+        return -1;
+    }
+    priv->started = true;
+    pthread_mutex_unlock(&priv->mutex);
+
+    return 0;
+}
+
+void at_log_free(struct at_log *log)
+{
+    struct at_log_priv *priv = (struct at_log_priv *) log;
+
+    /* stop the drain thread */
+    pthread_mutex_lock(&priv->mutex);
+    bool started = priv->started;
+    priv->running = false;
+    pthread_cond_signal(&priv->cond);
+    pthread_mutex_unlock(&priv->mutex);
+    if (started)
+        pthread_join(priv->thread, NULL);
+
+    /* deliver whatever is left */
+    at_log_drain(log);
+
+    pthread_cond_destroy(&priv->cond);
+    pthread_mutex_destroy(&priv->mutex);
+    if (priv->allocated)
+        free(priv);
+}
+
+void at_log_stream_handler(enum at_log_level level, const char *msg, size_t len, void *arg)
+{
+    static const char *const names[] = {
+        [AT_LOG_ERROR] = "error",
+        [AT_LOG_WARNING] = "warning",
+        [AT_LOG_INFO] = "info",
+        [AT_LOG_DEBUG] = "debug",
+    };
+    FILE *stream = arg;
+
+    const char *name = (level > AT_LOG_OFF && level <= AT_LOG_DEBUG ? names[level] : "?");
+    fprintf(stream, "[%s] %.*s\n", name, (int) len, msg);
+    fflush(stream);
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -8,15 +8,17 @@
 
 #include <attentive/cellular.h>
 
-#include <stdio.h>
+#include <errno.h>
 #include <string.h>
 
 #include "common.h"
 
-
 #define PDP_RETRY_THRESHOLD_INITIAL     3
 #define PDP_RETRY_THRESHOLD_MULTIPLIER  2
 
+/* AT round trips allowed to confirm a new line speed. */
+#define CELLULAR_BAUDRATE_CHECKS        3
+
 /*
  * PDP management logic.
  *
@@ -60,56 +62,139 @@ void cellular_pdp_failure(struct cellular *modem)
 }
 
 
-int cellular_op_imei(struct cellular *modem, char *buf, size_t len)
+bool cellular_flow_control(struct cellular *modem)
 {
-    char fmt[16];
-    if (snprintf(fmt, sizeof(fmt), "%%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
-        errno = ENOSPC;
+    return modem->flow_control || at_get_flow_control(modem->at);
+}
+
+int cellular_flow_control_apply(struct cellular *modem, bool enable)
+{
+    if (at_set_flow_control(modem->at, enable) == 0)
+        return 0;
+    if (errno != ENOTSUP)
         return -1;
+
+    if (enable)
+        at_log(modem->at->log, AT_LOG_WARNING, "cellular: no flow control lines; enabled on the modem only");
+    return 0;
+}
+
+/* Check that the modem answers, giving it a few tries to settle. */
+static bool cellular_baudrate_check(struct cellular *modem)
+{
+    for (int i=0; i<CELLULAR_BAUDRATE_CHECKS; i++) {
+        const char *response = at_command(modem->at, "AT");
+        if (response && !*response)
+            return true;
     }
+    return false;
+}
+
+/* The modem's line speed setting: zero for autobauding, or fallback if the
+ * modem won't say. */
+static unsigned long cellular_baudrate_setting(struct cellular *modem, unsigned long fallback)
+{
+    struct at_tok tok;
+
+    at_tok_init(&tok, at_command(modem->at, "AT+IPR?"));
+    at_tok_expect(&tok, "+IPR: ");
+    int ipr = at_tok_int(&tok);
+    return (tok.error || ipr < 0 ? fallback : (unsigned long) ipr);
+}
+
+int cellular_baudrate_negotiate(struct cellular *modem)
+{
+    unsigned long current = at_get_baudrate(modem->at);
+    if (!modem->baudrates || !current)
+        return 0;
+
+    /* What to go back to if a speed doesn't work; keeps autobauding on. */
+    unsigned long setting = 0;
+    bool queried = false;
+
+    for (const unsigned long *bps=modem->baudrates; *bps > current; bps++) {
+        /* Only offer speeds the port can do; it's idle between commands. */
+        if (at_set_baudrate(modem->at, *bps))
+            continue;
+        if (at_set_baudrate(modem->at, current))
+            return -1;
+
+        if (!queried) {
+            setting = cellular_baudrate_setting(modem, current);
+            queried = true;
+        }
+
+        /* The modem answers at the old speed, then switches. */
+        const char *response = at_command(modem->at, "AT+IPR=%lu", *bps);
+        if (!response || *response)
+            continue;
+
+        if (at_set_baudrate(modem->at, *bps) == 0 && cellular_baudrate_check(modem)) {
+            at_log(modem->at->log, AT_LOG_INFO, "cellular: line speed %lu bps", *bps);
+            return 0;
+        }
+
+        /* Doesn't get through; talk the modem back down if it listens. */
+        at_log(modem->at->log, AT_LOG_WARNING, "cellular: no answer at %lu bps", *bps);
+        at_command(modem->at, "AT+IPR=%lu", setting);
+        if (at_set_baudrate(modem->at, current))
+            return -1;
+        if (!cellular_baudrate_check(modem)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int cellular_op_imei(struct cellular *modem, char *buf, size_t len)
+{
+    struct at_tok tok;
 
     at_set_timeout(modem->at, 1);
-    const char *response = at_command(modem->at, "AT+CGSN");
-    at_simple_scanf(response, fmt, buf);
-    buf[len-1] = '\0';
+    at_tok_init(&tok, at_command(modem->at, "AT+CGSN"));
+    at_tok_digits(&tok, buf, len);
+    at_tok_simple_check(&tok);
 
     return 0;
 }
 
 int cellular_op_iccid(struct cellular *modem, char *buf, size_t len)
 {
-    char fmt[16];
-    if (snprintf(fmt, sizeof(fmt), "%%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
-        errno = ENOSPC;
-        return -1;
-    }
+    struct at_tok tok;
 
     at_set_timeout(modem->at, 5);
-    const char *response = at_command(modem->at, "AT+CCID");
-    at_simple_scanf(response, fmt, buf);
-    buf[len-1] = '\0';
+    at_tok_init(&tok, at_command(modem->at, "AT+CCID"));
+    at_tok_digits(&tok, buf, len);
+    at_tok_simple_check(&tok);
 
     return 0;
 }
 
 int cellular_op_creg(struct cellular *modem)
 {
-    int creg;
+    struct at_tok tok;
 
     at_set_timeout(modem->at, 1);
-    const char *response = at_command(modem->at, "AT+CREG?");
-    at_simple_scanf(response, "+CREG: %*d,%d", &creg);
+    at_tok_init(&tok, at_command(modem->at, "AT+CREG?"));
+    at_tok_expect(&tok, "+CREG: ");
+    at_tok_skip(&tok);
+    int creg = at_tok_int(&tok);
+    at_tok_simple_check(&tok);
 
     return creg;
 }
 
 int cellular_op_rssi(struct cellular *modem)
 {
-    int rssi;
+    struct at_tok tok;
 
     at_set_timeout(modem->at, 1);
-    const char *response = at_command(modem->at, "AT+CSQ");
-    at_simple_scanf(response, "+CSQ: %d,%*d", &rssi);
+    at_tok_init(&tok, at_command(modem->at, "AT+CSQ"));
+    at_tok_expect(&tok, "+CSQ: ");
+    int rssi = at_tok_int(&tok);
+    at_tok_simple_check(&tok);
 
     return rssi;
 }
@@ -117,13 +202,23 @@ int cellular_op_rssi(struct cellular *modem)
 int cellular_op_clock_gettime(struct cellular *modem, struct timespec *ts)
 {
     struct tm tm;
+    struct at_tok tok;
 
     at_set_timeout(modem->at, 1);
-    const char *response = at_command(modem->at, "AT+CCLK?");
+    at_tok_init(&tok, at_command(modem->at, "AT+CCLK?"));
     memset(&tm, 0, sizeof(struct tm));
-    at_simple_scanf(response, "+CCLK: \"%d/%d/%d,%d:%d:%d%*d\"",
-            &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
-            &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+    at_tok_expect(&tok, "+CCLK: \"");
+    tm.tm_year = at_tok_int(&tok);
+    at_tok_expect(&tok, "/");
+    tm.tm_mon = at_tok_int(&tok);
+    at_tok_expect(&tok, "/");
+    tm.tm_mday = at_tok_int(&tok);
+    tm.tm_hour = at_tok_int(&tok);
+    at_tok_expect(&tok, ":");
+    tm.tm_min = at_tok_int(&tok);
+    at_tok_expect(&tok, ":");
+    tm.tm_sec = at_tok_int(&tok);
+    at_tok_simple_check(&tok);
 
     /* Most modems report some starting date way in the past when they have
      * no date/time estimation. */
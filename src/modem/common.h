@@ -28,6 +28,33 @@ void cellular_pdp_success(struct cellular *modem);
  */
 void cellular_pdp_failure(struct cellular *modem);
 
+/**
+ * Check whether attach should use hardware flow control: asked for with
+ * cellular_set_flow_control, or already enabled on the channel.
+ */
+bool cellular_flow_control(struct cellular *modem);
+
+/**
+ * Switch the channel to the flow control just configured on the modem.
+ * Transports without flow control lines (e.g. a terminal server doing its
+ * own) are left alone.
+ *
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int cellular_flow_control_apply(struct cellular *modem, bool enable);
+
+/**
+ * Switch the modem and the channel to the fastest line speed from
+ * cellular_set_baudrates that works, going back to the current one if an
+ * AT doesn't get through. The modem's own setting is restored then, so an
+ * autobauding modem (AT+IPR=0) stays autobauding. Call at the end of
+ * attach, after saving the configuration.
+ *
+ * @returns Zero on success (at whatever speed), -1 and sets errno if the
+ *          modem can't be reached at all afterwards.
+ */
+int cellular_baudrate_negotiate(struct cellular *modem);
+
 /**
  * Perform a network command, requesting a PDP context and signalling success
  * or failure to the PDP machinery. Returns -1 on failure.
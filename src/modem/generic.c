@@ -16,6 +16,7 @@
 
 struct cellular_generic {
     struct cellular dev;
+    bool allocated;
 };
 
 static const struct cellular_ops generic_ops = {
@@ -30,12 +31,28 @@ static const struct cellular_ops generic_ops = {
 
 struct cellular *cellular_generic_alloc(void)
 {
-    struct cellular_generic *modem = malloc(sizeof(struct cellular_generic));
-    if (modem == NULL) {
+    void *storage = malloc(cellular_generic_sizeof());
+    if (storage == NULL) {
         errno = ENOMEM;
         return NULL;
     }
 
+    struct cellular_generic *modem = (struct cellular_generic *) cellular_generic_init(storage);
+    modem->allocated = true;
+
+    return (struct cellular *) modem;
+}
+
+size_t cellular_generic_sizeof(void)
+{
+    return AT_STORAGE_ROUND(sizeof(struct cellular_generic));
+}
+
+struct cellular *cellular_generic_init(void *storage)
+{
+    struct cellular_generic *modem = storage;
+    memset(modem, 0, sizeof(*modem));
+
     modem->dev.ops = &generic_ops;
 
     return (struct cellular *) modem;
@@ -43,7 +60,10 @@ struct cellular *cellular_generic_alloc(void)
 
 void cellular_generic_free(struct cellular *modem)
 {
-    free(modem);
+    struct cellular_generic *priv = (struct cellular_generic *) modem;
+
+    if (priv->allocated)
+        free(modem);
 }
 
 /* vim: set ts=4 sw=4 et: */
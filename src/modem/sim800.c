@@ -7,10 +7,10 @@
  */
 
 #include <attentive/cellular.h>
+#include <attentive/coro.h>
 
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
 
 #include "common.h"
 
@@ -44,32 +44,30 @@ enum sim800_socket_status {
 #define SIM800_NSOCKETS                 6
 #define SIM800_CONNECT_TIMEOUT          20
 #define SIM800_CIPCFG_RETRIES           10
-
-static const char *const sim800_urc_responses[] = {
-    "+CIPRXGET: 1,",    /* incoming socket data notification */
-    "+FTPGET: 1,",      /* FTP state change notification */
-    "+PDP: DEACT",      /* PDP disconnected */
-    "+SAPBR 1: DEACT",  /* PDP disconnected (for SAPBR apps) */
-    "*PSNWID: ",        /* AT+CLTS network name */
-    "*PSUTTZ: ",        /* AT+CLTS time */
-    "+CTZV: ",          /* AT+CLTS timezone */
-    "DST: ",            /* AT+CLTS dst information */
-    "+CIEV: ",          /* AT+CLTS undocumented indicator */
-    "RDY",              /* Assorted crap on newer firmware releases. */
-    "+CPIN: READY",
-    "Call Ready",
-    "SMS Ready",
-    "NORMAL POWER DOWN",
-    "UNDER-VOLTAGE POWER DOWN",
-    "UNDER-VOLTAGE WARNNING",
-    "OVER-VOLTAGE POWER DOWN",
-    "OVER-VOLTAGE WARNNING",
+#define SIM800_CIPRXGET_MAX             1460
+
+/* Socket status notifications in form of "%d, <status>". */
+static const char *const sim800_socket_statuses[] = {
+    "CONNECT OK",
+    "CONNECT FAIL",
+    "ALREADY CONNECT",
+    "CLOSED",
     NULL
 };
 
+static const enum sim800_socket_status sim800_socket_status_values[] = {
+    SIM800_SOCKET_STATUS_CONNECTED,
+    SIM800_SOCKET_STATUS_ERROR,
+    SIM800_SOCKET_STATUS_ERROR,
+    SIM800_SOCKET_STATUS_ERROR,
+};
+
 struct cellular_sim800 {
     struct cellular dev;
 
+    struct at_prefix_matcher *status_matcher;
+    bool allocated;
+
     int ftpget1_status;
     enum sim800_socket_status socket_status[SIM800_NSOCKETS];
 };
@@ -79,26 +77,17 @@ static enum at_response_type scan_line(const char *line, size_t len, void *arg)
     (void) len;
     struct cellular_sim800 *priv = arg;
 
-    if (at_prefix_in_table(line, sim800_urc_responses))
-        return AT_RESPONSE_URC;
-
     /* Socket status notifications in form of "%d, <status>". */
-    if (line[0] >= '0' && line[0] <= '0'+SIM800_NSOCKETS &&
+    if (line[0] >= '0' && line[0] < '0'+SIM800_NSOCKETS &&
         !strncmp(line+1, ", ", 2))
     {
         int socket = line[0] - '0';
 
-        if (!strcmp(line+3, "CONNECT OK"))
-        {
-            priv->socket_status[socket] = SIM800_SOCKET_STATUS_CONNECTED;
-            return AT_RESPONSE_URC;
-        }
-
-        if (!strcmp(line+3, "CONNECT FAIL") ||
-            !strcmp(line+3, "ALREADY CONNECT") ||
-            !strcmp(line+3, "CLOSED"))
+        /* Statuses are matched exactly, not as prefixes. */
+        int status = at_prefix_matcher_find(priv->status_matcher, line+3);
+        if (status != -1 && line[3+strlen(sim800_socket_statuses[status])] == '\0')
         {
-            priv->socket_status[socket] = SIM800_SOCKET_STATUS_ERROR;
+            priv->socket_status[socket] = sim800_socket_status_values[status];
             return AT_RESPONSE_URC;
         }
     }
@@ -110,15 +99,54 @@ static void handle_urc(const char *line, size_t len, void *arg)
 {
     struct cellular_sim800 *priv = arg;
 
-    printf("[sim800@%p] urc: %.*s\n", priv, (int) len, line);
+    at_log(priv->dev.at->log, AT_LOG_INFO, "[sim800@%p] urc: %.*s", priv, (int) len, line);
+}
 
-    if (sscanf(line, "+FTPGET: 1,%d", &priv->ftpget1_status) == 1)
-        return;
+/* Power supply events are rare and worth keeping in the log. */
+static void log_urc(const char *line, size_t len, size_t offset, void *arg)
+{
+    (void) offset;
+    handle_urc(line, len, arg);
+}
+
+static void handle_ftpget1(const char *line, size_t len, size_t offset, void *arg)
+{
+    (void) len;
+    struct cellular_sim800 *priv = arg;
+
+    struct at_tok tok;
+    at_tok_init(&tok, line + offset);
+    int status = at_tok_int(&tok);
+    if (!tok.error)
+        priv->ftpget1_status = status;
 }
 
+static const struct at_urc_handler sim800_urcs[] = {
+    { "+CIPRXGET: 1,", NULL },          /* incoming socket data notification */
+    { "+FTPGET: 1,", handle_ftpget1 },  /* FTP state change notification */
+    { "+PDP: DEACT", NULL },            /* PDP disconnected */
+    { "+SAPBR 1: DEACT", NULL },        /* PDP disconnected (for SAPBR apps) */
+    { "*PSNWID: ", NULL },              /* AT+CLTS network name */
+    { "*PSUTTZ: ", NULL },              /* AT+CLTS time */
+    { "+CTZV: ", NULL },                /* AT+CLTS timezone */
+    { "DST: ", NULL },                  /* AT+CLTS dst information */
+    { "+CIEV: ", NULL },                /* AT+CLTS undocumented indicator */
+    { "RDY", NULL },                    /* Assorted crap on newer firmware releases. */
+    { "+CPIN: READY", NULL },
+    { "Call Ready", NULL },
+    { "SMS Ready", NULL },
+    { "NORMAL POWER DOWN", log_urc },
+    { "UNDER-VOLTAGE POWER DOWN", log_urc },
+    { "UNDER-VOLTAGE WARNNING", log_urc },
+    { "OVER-VOLTAGE POWER DOWN", log_urc },
+    { "OVER-VOLTAGE WARNNING", log_urc },
+    { NULL, NULL }
+};
+
 static const struct at_callbacks sim800_callbacks = {
     .scan_line = scan_line,
     .handle_urc = handle_urc,
+    .urcs = sim800_urcs,
 };
 
 
@@ -150,7 +178,7 @@ static int sim800_config(struct cellular *modem, const char *option, const char
         if (!strcmp(response, expected))
             return 0;
 
-        sleep(1);
+        at_coro_sleep_ms(1000);
     }
 
     errno = ETIMEDOUT;
@@ -158,6 +186,20 @@ static int sim800_config(struct cellular *modem, const char *option, const char
 }
 
 
+/**
+ * Completion handler for queued init commands: keeps the first failure.
+ */
+static void sim800_init_done(const char *response, int status, void *arg)
+{
+    int *first = arg;
+
+    /* Same check as at_command_simple. */
+    if (!status && strcmp(response, ""))
+        status = EINVAL;
+    if (!*first)
+        *first = status;
+}
+
 static int sim800_attach(struct cellular *modem)
 {
     at_set_callbacks(modem->at, &sim800_callbacks, (void *) modem);
@@ -178,18 +220,41 @@ static int sim800_attach(struct cellular *modem)
     /* Disable local echo again; make sure it was disabled successfully. */
     at_command_simple(modem->at, "ATE0");
 
-    /* Initialize modem. */
-    static const char *const init_strings[] = {
+    /* Initialize modem. Queued, so they go out back to back. */
+    bool flow_control = cellular_flow_control(modem);
+    const char *const init_strings[] = {
         "AT+IPR=0",                     /* Enable autobauding if not already enabled. */
-        "AT+IFC=0,0",                   /* Disable hardware flow control. */
+        flow_control ? "AT+IFC=2,2"     /* RTS/CTS hardware flow control... */
+                     : "AT+IFC=0,0",    /* ...or none. */
         "AT+CMEE=2",                    /* Enable extended error reporting. */
         "AT+CLTS=0",                    /* Don't sync RTC with network time, it's broken. */
         "AT+CIURC=0",                   /* Disable "Call Ready" URC. */
-        "AT&W0",                        /* Save configuration. */
         NULL
     };
-    for (const char *const *command=init_strings; *command; command++)
-        at_command_simple(modem->at, "%s", *command);
+    int status = 0;
+    for (const char *const *command=init_strings; *command; command++) {
+        while (at_command_async(modem->at, sim800_init_done, &status, "%s", *command)) {
+            if (errno != ENOBUFS)
+                return -1;
+            at_command_drain(modem->at);
+        }
+    }
+    at_command_drain(modem->at);
+    if (status) {
+        errno = status;
+        return -1;
+    }
+
+    /* The modem is switched over; now the port. */
+    if (cellular_flow_control_apply(modem, flow_control))
+        return -1;
+
+    /* Save configuration, once all of it went through. */
+    at_command_simple(modem->at, "AT&W0");
+
+    /* Speed up the line; after saving, so autobauding stays the default. */
+    if (cellular_baudrate_negotiate(modem))
+        return -1;
 
     /* Configure IP application. */
 
@@ -232,9 +297,9 @@ static int sim800_clock_ntptime(struct cellular *modem, struct timespec *ts)
     int socket = 2;
 
     if (modem->ops->socket_connect(modem, socket, "time-nw.nist.gov", 37) == 0) {
-        printf("sim800: connect successful\n");
+        at_log(modem->at->log, AT_LOG_DEBUG, "sim800: connect successful");
     } else {
-        perror("sim800: connect failed");
+        at_log(modem->at->log, AT_LOG_ERROR, "sim800: connect failed: %s", strerror(errno));
         goto close_conn;
     }
 
@@ -244,12 +309,12 @@ static int sim800_clock_ntptime(struct cellular *modem, struct timespec *ts)
     {
         if (len > 0)
         {
-            printf("Received: >\x1b[1m");
+            char hex[2*NTP_BUF_SIZE+1];
             for (int i = 0; i<len; i++)
             {
-                printf("%02x", buf[i]);
+                snprintf(hex + 2*i, 3, "%02x", (unsigned char) buf[i]);
             }
-            printf("\x1b[0m<\n");
+            at_log(modem->at->log, AT_LOG_DEBUG, "sim800: received %s", hex);
 
             if (len == 4)
             {
@@ -258,16 +323,16 @@ static int sim800_clock_ntptime(struct cellular *modem, struct timespec *ts)
                 {
                     ts->tv_sec = (long int)buf[i] + ts->tv_sec*256;
                 }
-                printf("sim800: catched UTC timestamp -> %d\n", ts->tv_sec);
+                at_log(modem->at->log, AT_LOG_DEBUG, "sim800: catched UTC timestamp -> %ld", (long) ts->tv_sec);
                 ts->tv_sec -= 2208988800L;        //UTC to UNIX time conversion
-                printf("sim800: final UNIX timestamp -> %d\n", ts->tv_sec);
+                at_log(modem->at->log, AT_LOG_DEBUG, "sim800: final UNIX timestamp -> %ld", (long) ts->tv_sec);
                 goto close_conn;
             }
 
             len = 0;
         }
         else
-            sleep(1);
+            at_coro_sleep_ms(1000);
     }
 
 #if 0
@@ -279,9 +344,9 @@ static int sim800_clock_ntptime(struct cellular *modem, struct timespec *ts)
 close_conn:
     if (modem->ops->socket_close(modem, socket) == 0)
     {
-        printf("sim800: close successful\n");
+        at_log(modem->at->log, AT_LOG_DEBUG, "sim800: close successful");
     } else {
-        perror("sim800: close");
+        at_log(modem->at->log, AT_LOG_ERROR, "sim800: close: %s", strerror(errno));
     }
 
     return 0;
@@ -301,6 +366,22 @@ static enum at_response_type scanner_cipstatus(const char *line, size_t len, voi
     return AT_RESPONSE_UNKNOWN;
 }
 
+/* Pick the connection state out of the streamed AT+CIPSTATUS lines. */
+static void handle_cipstatus_line(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    int *status = arg;
+
+    if (strncmp(line, "STATE: ", strlen("STATE: ")))
+        return;
+    const char *state = line + strlen("STATE: ");
+    if (!strncmp(state, "IP STATUS", strlen("IP STATUS")) ||
+        !strncmp(state, "IP PROCESSING", strlen("IP PROCESSING")))
+        *status = 0;
+    else
+        *status = ENETDOWN;
+}
+
 /**
  * Retrieve AT+CIPSTATUS state.
  *
@@ -308,26 +389,22 @@ static enum at_response_type scanner_cipstatus(const char *line, size_t len, voi
  */
 static int sim800_ipstatus(struct cellular *modem)
 {
+    /* The per-connection "C:" lines aren't needed; don't buffer them. */
+    int status = EPROTO;
     at_set_timeout(modem->at, 10);
     at_set_command_scanner(modem->at, scanner_cipstatus);
+    at_set_line_handler(modem->at, handle_cipstatus_line, &status);
     const char *response = at_command(modem->at, "AT+CIPSTATUS");
 
     if (response == NULL)
         return -1;
 
-    const char *state = strstr(response, "STATE: ");
-    if (!state) {
-        errno = EPROTO;
+    if (status) {
+        errno = status;
         return -1;
     }
-    state += strlen("STATE: ");
-    if (!strncmp(state, "IP STATUS", strlen("IP STATUS")))
-        return 0;
-    if (!strncmp(state, "IP PROCESSING", strlen("IP PROCESSING")))
-        return 0;
 
-    errno = ENETDOWN;
-    return -1;
+    return 0;
 }
 
 static enum at_response_type scanner_cifsr(const char *line, size_t len, void *arg)
@@ -336,8 +413,14 @@ static enum at_response_type scanner_cifsr(const char *line, size_t len, void *a
     (void) arg;
 
     /* Accept an IP address as an OK response. */
-    int ip[4];
-    if (sscanf(line, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3]) == 4)
+    struct at_tok tok;
+    at_tok_init(&tok, line);
+    for (int i=0; i<4; i++) {
+        if (i > 0)
+            at_tok_expect(&tok, ".");
+        at_tok_int(&tok);
+    }
+    if (!tok.error)
         return AT_RESPONSE_FINAL_OK;
     return AT_RESPONSE_UNKNOWN;
 }
@@ -408,7 +491,7 @@ static int sim800_socket_connect(struct cellular *modem, int connid, const char
             errno = ECONNABORTED;
             return -1;
         }
-        sleep(1);
+        at_coro_sleep_ms(1000);
     }
 
     errno = ETIMEDOUT;
@@ -420,14 +503,23 @@ static enum at_response_type scanner_cipsend(const char *line, size_t len, void
     (void) len;
     (void) arg;
 
-    int connid, amount;
-    char last;
-    if (sscanf(line, "DATA ACCEPT:%d,%d", &connid, &amount) == 2)
-        return AT_RESPONSE_FINAL_OK;
-    if (sscanf(line, "%d, SEND O%c", &connid, &last) == 2 && last == 'K')
+    struct at_tok tok;
+    at_tok_init(&tok, line);
+    at_tok_expect(&tok, "DATA ACCEPT:");
+    at_tok_int(&tok);
+    at_tok_int(&tok);
+    if (!tok.error)
         return AT_RESPONSE_FINAL_OK;
-    if (sscanf(line, "%d, SEND FAI%c", &connid, &last) == 2 && last == 'L')
-        return AT_RESPONSE_FINAL;
+
+    /* "<connid>, SEND OK" or "<connid>, SEND FAIL" */
+    at_tok_init(&tok, line);
+    at_tok_int(&tok);
+    if (at_tok_expect(&tok, " SEND ")) {
+        if (!strcmp(tok.pos, "OK"))
+            return AT_RESPONSE_FINAL_OK;
+        if (!strcmp(tok.pos, "FAIL"))
+            return AT_RESPONSE_FINAL;
+    }
     if (!strcmp(line, "SEND OK"))
         return AT_RESPONSE_FINAL_OK;
     if (!strcmp(line, "SEND FAIL"))
@@ -456,10 +548,14 @@ static enum at_response_type scanner_ciprxget(const char *line, size_t len, void
     (void) len;
     (void) arg;
 
-    int requested, confirmed;
-    if (sscanf(line, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed) == 2)
-        if (requested > 0)
-            return AT_RESPONSE_RAWDATA_FOLLOWS(requested);
+    struct at_tok tok;
+    at_tok_init(&tok, line);
+    at_tok_expect(&tok, "+CIPRXGET: 2,");
+    at_tok_skip(&tok);
+    int requested = at_tok_int(&tok);
+    at_tok_int(&tok);
+    if (!tok.error && requested > 0)
+        return AT_RESPONSE_RAWDATA_FOLLOWS(requested);
 
     return AT_RESPONSE_UNKNOWN;
 }
@@ -474,44 +570,44 @@ static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buff
     char tries = 127;
     while ( (cnt < (int) length) && tries-- ){
         int chunk = (int) length - cnt;
-        /* Limit read size to avoid overflowing AT response buffer. */
-        if (chunk > 128)
-            chunk = 128;
+        /* Limit read size to the maximum the modem accepts. */
+        if (chunk > SIM800_CIPRXGET_MAX)
+            chunk = SIM800_CIPRXGET_MAX;
 
-        /* Perform the read. */
+        /* Perform the read. The payload lands directly in the buffer. */
         at_set_timeout(modem->at, SET_TIMEOUT);
         at_set_command_scanner(modem->at, scanner_ciprxget);
+        at_set_data_buffer(modem->at, (char *)buffer + cnt, chunk);
         const char *response = at_command(modem->at, "AT+CIPRXGET=2,%d,%d", connid, chunk);
         if (response == NULL)
             return -1;
 
         /* Find the header line. */
-        int requested, confirmed;
+        struct at_tok tok;
         // TODO: 
         // 1. connid is not checked
         // 2. there is possible a bug here. if not all data are ready (confirmed < requested)
         // then wierd things can happen. see memcpy 
         // requested should be equal to chunk
         // confirmed is that what can be read
-        at_simple_scanf(response, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed);
+        at_tok_init(&tok, response);
+        at_tok_expect(&tok, "+CIPRXGET: 2,");
+        at_tok_skip(&tok);
+        int requested = at_tok_int(&tok);
+        at_tok_int(&tok);
+        at_tok_simple_check(&tok);
 
         /* Bail out if we're out of data. */
         /* FIXME: We should maybe block until we receive something? */
         if (requested == 0)
             break;
 
-        /* Locate the payload. */
-        /* TODO: what if no \n is in input stream? 
-         * should use strnchr at least */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
+        /* Anything beyond the chunk size was discarded by the parser. */
+        if (requested > chunk) {
             errno = EPROTO;
             return -1;
         }
-        data += 1;
 
-        /* Copy payload to result buffer. */
-        memcpy((char *)buffer + cnt, data, requested);
         cnt += requested;
     }
 
@@ -520,20 +616,23 @@ static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buff
 
 static int sim800_socket_waitack(struct cellular *modem, int connid)
 {
-    const char *response;
+    struct at_tok tok;
 
     at_set_timeout(modem->at, 5);
     for (int i=0; i<SIM800_WAITACK_TIMEOUT; i++) {
         /* Read number of bytes waiting. */
-        int nacklen;
-        response = at_command(modem->at, "AT+CIPACK=%d", connid);
-        at_simple_scanf(response, "+CIPACK: %*d,%*d,%d", &nacklen);
+        at_tok_init(&tok, at_command(modem->at, "AT+CIPACK=%d", connid));
+        at_tok_expect(&tok, "+CIPACK: ");
+        at_tok_skip(&tok);
+        at_tok_skip(&tok);
+        int nacklen = at_tok_int(&tok);
+        at_tok_simple_check(&tok);
 
         /* Return if all bytes were acknowledged. */
         if (nacklen == 0)
             return 0;
 
-        sleep(1);
+        at_coro_sleep_ms(1000);
     }
 
     errno = ETIMEDOUT;
@@ -545,9 +644,11 @@ static enum at_response_type scanner_cipclose(const char *line, size_t len, void
     (void) len;
     (void) arg;
 
-    int connid;
-    char last;
-    if (sscanf(line, "%d, CLOSE O%c", &connid, &last) == 2 && last == 'K')
+    struct at_tok tok;
+    at_tok_init(&tok, line);
+    at_tok_int(&tok);
+    at_tok_expect(&tok, " CLOSE OK");
+    if (!tok.error)
         return AT_RESPONSE_FINAL_OK;
     return AT_RESPONSE_UNKNOWN;
 }
@@ -597,7 +698,7 @@ static int sim800_ftp_get(struct cellular *modem, const char *filename)
             return -1;
         }
 
-        sleep(1);
+        at_coro_sleep_ms(1000);
     }
 
     errno = ETIMEDOUT;
@@ -609,9 +710,12 @@ static enum at_response_type scanner_ftpget2(const char *line, size_t len, void
     (void) len;
     (void) arg;
 
-    int cnflength;
     /* TODO: Verify if cnflength is indeed the size of raw payload. */
-    if (sscanf(line, "+FTPGET: 2,%d", &cnflength) == 1)
+    struct at_tok tok;
+    at_tok_init(&tok, line);
+    at_tok_expect(&tok, "+FTPGET: 2,");
+    int cnflength = at_tok_int(&tok);
+    if (!tok.error)
         return AT_RESPONSE_RAWDATA_FOLLOWS(cnflength);
     return AT_RESPONSE_UNKNOWN;
 }
@@ -624,13 +728,17 @@ static int sim800_ftp_getdata(struct cellular *modem, char *buffer, size_t lengt
 retry:
     at_set_timeout(modem->at, SET_TIMEOUT);
     at_set_command_scanner(modem->at, scanner_ftpget2);
+    at_set_data_buffer(modem->at, buffer, length);
     const char *response = at_command(modem->at, "AT+FTPGET=2,%zu", length);
 
     if (response == NULL)
         return -1;
 
-    int cnflength;
-    if (sscanf(response, "+FTPGET: 2,%d", &cnflength) == 1) {
+    struct at_tok tok;
+    at_tok_init(&tok, response);
+    at_tok_expect(&tok, "+FTPGET: 2,");
+    int cnflength = at_tok_int(&tok);
+    if (!tok.error) {
         /* Zero means no data is available. Wait for it. */
         if (cnflength == 0) {
             /* Bail out on timeout. */
@@ -638,20 +746,15 @@ retry:
                 errno = ETIMEDOUT;
                 return -1;
             }
-            sleep(1);
+            at_coro_sleep_ms(1000);
             goto retry;
         }
 
-        /* Locate the payload. */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
+        /* Payload is already in the buffer. */
+        if (cnflength > (int) length) {
             errno = EPROTO;
             return -1;
         }
-        data += 1;
-
-        /* Copy payload to result buffer. */
-        memcpy((char *)buffer, data, cnflength);
         return cnflength;
     } else if (priv->ftpget1_status == 0) {
         /* Transfer finished. */
@@ -697,21 +800,51 @@ static const struct cellular_ops sim800_ops = {
 
 struct cellular *cellular_sim800_alloc(void)
 {
-    struct cellular_sim800 *modem = malloc(sizeof(struct cellular_sim800));
-    if (modem == NULL) {
+    void *storage = malloc(cellular_sim800_sizeof());
+    if (storage == NULL) {
         errno = ENOMEM;
         return NULL;
     }
+
+    struct cellular_sim800 *modem = (struct cellular_sim800 *) cellular_sim800_init(storage);
+    if (modem == NULL) {
+        free(storage);
+        return NULL;
+    }
+    modem->allocated = true;
+
+    return (struct cellular *) modem;
+}
+
+/* The compiled line tables follow the instance. */
+size_t cellular_sim800_sizeof(void)
+{
+    return AT_STORAGE_ROUND(sizeof(struct cellular_sim800)) +
+           at_prefix_matcher_sizeof(sim800_socket_statuses);
+}
+
+struct cellular *cellular_sim800_init(void *storage)
+{
+    struct cellular_sim800 *modem = storage;
     memset(modem, 0, sizeof(*modem));
 
     modem->dev.ops = &sim800_ops;
 
+    /* Compile line tables. */
+    char *next = (char *) storage + AT_STORAGE_ROUND(sizeof(struct cellular_sim800));
+    modem->status_matcher = at_prefix_matcher_init(next, sim800_socket_statuses);
+    if (modem->status_matcher == NULL)
+        return NULL;
+
     return (struct cellular *) modem;
 }
 
 void cellular_sim800_free(struct cellular *modem)
 {
-    free(modem);
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    if (priv->allocated)
+        free(modem);
 }
 
 /* vim: set ts=4 sw=4 et: */
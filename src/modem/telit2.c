@@ -7,10 +7,9 @@
  */
 
 #include <attentive/cellular.h>
+#include <attentive/coro.h>
 
-#include <stdio.h>
 #include <string.h>
-#include <unistd.h>
 
 #include "common.h"
 
@@ -18,51 +17,54 @@
 #define TELIT2_WAITACK_TIMEOUT 60
 #define TELIT2_FTP_TIMEOUT 60
 #define TELIT2_LOCATE_TIMEOUT 150
-
-static const char *const telit2_urc_responses[] = {
-    "SRING: ",
-    "#AGPSRING: ",
-    NULL
-};
+#define TELIT2_SRECV_MAX 1500
 
 struct cellular_telit2 {
     struct cellular dev;
+    bool allocated;
 
     int locate_status;
     float latitude, longitude, altitude;
 };
 
-static enum at_response_type scan_line(const char *line, size_t len, void *arg)
+static void handle_urc(const char *line, size_t len, void *arg)
 {
-    (void) line;
-    (void) len;
-
     struct cellular_telit2 *priv = arg;
-    (void) priv;
 
-    if (at_prefix_in_table(line, telit2_urc_responses))
-        return AT_RESPONSE_URC;
-
-    return AT_RESPONSE_UNKNOWN;
+    at_log(priv->dev.at->log, AT_LOG_INFO, "[telit2@%p] urc: %.*s", priv, (int) len, line);
 }
 
-static void handle_urc(const char *line, size_t len, void *arg)
+static void handle_agpsring(const char *line, size_t len, size_t offset, void *arg)
 {
+    (void) len;
     struct cellular_telit2 *priv = arg;
 
-    int status;
-    if (sscanf(line, "#AGPSRING: %d", &status) == 1) {
-        priv->locate_status = status;
-        sscanf(line, "#AGPSRING: %*d,%f,%f,%f", &priv->latitude, &priv->longitude, &priv->altitude);
+    /* #AGPSRING: <status>[,<latitude>,<longitude>,<altitude>,...] */
+    struct at_tok tok;
+    at_tok_init(&tok, line + offset);
+    int status = at_tok_int(&tok);
+    if (tok.error)
         return;
+    priv->locate_status = status;
+
+    float *coords[] = { &priv->latitude, &priv->longitude, &priv->altitude };
+    for (size_t i=0; i<sizeof(coords)/sizeof(*coords) && *tok.pos; i++) {
+        float value = at_tok_float(&tok);
+        if (tok.error)
+            return;
+        *coords[i] = value;
     }
-
-    printf("[telit2@%p] urc: %.*s\n", priv, (int) len, line);
 }
 
+static const struct at_urc_handler telit2_urcs[] = {
+    { "SRING: ", NULL },                    /* incoming socket data notification */
+    { "#AGPSRING: ", handle_agpsring },     /* AGPS locate result */
+    { NULL, NULL }
+};
+
 static const struct at_callbacks telit2_callbacks = {
-    .scan_line = scan_line,
     .handle_urc = handle_urc,
+    .urcs = telit2_urcs,
 };
 
 static int telit2_attach(struct cellular *modem)
@@ -74,8 +76,10 @@ static int telit2_attach(struct cellular *modem)
     at_command(modem->at, "ATE0");      /* Disable local echo. */
 
     /* Initialize modem. */
-    static const char *const init_strings[] = {
-        "AT&K0",                        /* Disable hardware flow control. */
+    bool flow_control = cellular_flow_control(modem);
+    const char *const init_strings[] = {
+        flow_control ? "AT&K3"          /* RTS/CTS hardware flow control... */
+                     : "AT&K0",         /* ...or none. */
         "AT#SELINT=2",                  /* Set Telit module compatibility level. */
         "AT+CMEE=2",                    /* Enable extended error reporting. */
         NULL
@@ -83,6 +87,14 @@ static int telit2_attach(struct cellular *modem)
     for (const char *const *command=init_strings; *command; command++)
         at_command_simple(modem->at, "%s", *command);
 
+    /* The modem is switched over; now the port. */
+    if (cellular_flow_control_apply(modem, flow_control))
+        return -1;
+
+    /* Speed up the line. */
+    if (cellular_baudrate_negotiate(modem))
+        return -1;
+
     return 0;
 }
 
@@ -106,8 +118,15 @@ static int telit2_pdp_open(struct cellular *modem, const char *apn)
     if (!strcmp(response, "+CME ERROR: context already activated"))
         return 0;
 
-    int ip[4];
-    at_simple_scanf(response, "#SGACT: %d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3]);
+    struct at_tok tok;
+    at_tok_init(&tok, response);
+    at_tok_expect(&tok, "#SGACT: ");
+    for (int i=0; i<4; i++) {
+        if (i > 0)
+            at_tok_expect(&tok, ".");
+        at_tok_int(&tok);
+    }
+    at_tok_simple_check(&tok);
 
     return 0;
 }
@@ -122,16 +141,13 @@ static int telit2_pdp_close(struct cellular *modem)
 
 static int telit2_op_iccid(struct cellular *modem, char *buf, size_t len)
 {
-    char fmt[24];
-    if (snprintf(fmt, sizeof(fmt), "#CCID: %%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
-        errno = ENOSPC;
-        return -1;
-    }
+    struct at_tok tok;
 
     at_set_timeout(modem->at, 5);
-    const char *response = at_command(modem->at, "AT#CCID");
-    at_simple_scanf(response, fmt, buf);
-    buf[len-1] = '\0';
+    at_tok_init(&tok, at_command(modem->at, "AT#CCID"));
+    at_tok_expect(&tok, "#CCID: ");
+    at_tok_digits(&tok, buf, len);
+    at_tok_simple_check(&tok);
 
     return 0;
 }
@@ -139,15 +155,24 @@ static int telit2_op_iccid(struct cellular *modem, char *buf, size_t len)
 static int telit2_op_clock_gettime(struct cellular *modem, struct timespec *ts)
 {
     struct tm tm;
-    int offset;
+    struct at_tok tok;
 
     at_set_timeout(modem->at, 1);
-    const char *response = at_command(modem->at, "AT+CCLK?");
+    at_tok_init(&tok, at_command(modem->at, "AT+CCLK?"));
     memset(&tm, 0, sizeof(struct tm));
-    at_simple_scanf(response, "+CCLK: \"%d/%d/%d,%d:%d:%d%d\"",
-            &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
-            &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
-            &offset);
+    at_tok_expect(&tok, "+CCLK: \"");
+    tm.tm_year = at_tok_int(&tok);
+    at_tok_expect(&tok, "/");
+    tm.tm_mon = at_tok_int(&tok);
+    at_tok_expect(&tok, "/");
+    tm.tm_mday = at_tok_int(&tok);
+    tm.tm_hour = at_tok_int(&tok);
+    at_tok_expect(&tok, ":");
+    tm.tm_min = at_tok_int(&tok);
+    at_tok_expect(&tok, ":");
+    tm.tm_sec = at_tok_int(&tok);
+    int offset = at_tok_int(&tok);
+    at_tok_simple_check(&tok);
 
     /* Most modems report some starting date way in the past when they have
      * no date/time estimation. */
@@ -208,8 +233,12 @@ static enum at_response_type scanner_srecv(const char *line, size_t len, void *a
     (void) len;
     (void) arg;
 
-    int chunk;
-    if (sscanf(line, "#SRECV: %*d,%d", &chunk) == 1)
+    struct at_tok tok;
+    at_tok_init(&tok, line);
+    at_tok_expect(&tok, "#SRECV: ");
+    at_tok_skip(&tok);
+    int chunk = at_tok_int(&tok);
+    if (!tok.error)
         return AT_RESPONSE_RAWDATA_FOLLOWS(chunk);
 
     return AT_RESPONSE_UNKNOWN;
@@ -222,36 +251,37 @@ static ssize_t telit2_socket_recv(struct cellular *modem, int connid, void *buff
     int cnt = 0;
     while (cnt < (int) length) {
         int chunk = (int) length - cnt;
-        /* Limit read size to avoid overflowing AT response buffer. */
-        if (chunk > 128)
-            chunk = 128;
+        /* Limit read size to the maximum the modem accepts. */
+        if (chunk > TELIT2_SRECV_MAX)
+            chunk = TELIT2_SRECV_MAX;
 
-        /* Perform the read. */
+        /* Perform the read. The payload lands directly in the buffer. */
         at_set_timeout(modem->at, 150);
         at_set_command_scanner(modem->at, scanner_srecv);
+        at_set_data_buffer(modem->at, (char *)buffer + cnt, chunk);
         const char *response = at_command(modem->at, "AT#SRECV=%d,%d", connid, chunk);
         if (response == NULL)
             return -1;
 
-        /* Find the header line. */
-        int bytes;
-        at_simple_scanf(response, "#SRECV: %*d,%d", &bytes);
-
         /* Bail out if we're out of data. Message is misleading. */
         /* FIXME: We should maybe block until we receive something? */
         if (!strcmp(response, "+CME ERROR: activation failed"))
             break;
 
-        /* Locate the payload. */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
+        /* Find the header line. */
+        struct at_tok tok;
+        at_tok_init(&tok, response);
+        at_tok_expect(&tok, "#SRECV: ");
+        at_tok_skip(&tok);
+        int bytes = at_tok_int(&tok);
+        at_tok_simple_check(&tok);
+
+        /* Anything beyond the chunk size was discarded by the parser. */
+        if (bytes > chunk) {
             errno = EPROTO;
             return -1;
         }
-        data += 1;
 
-        /* Copy payload to result buffer. */
-        memcpy((char *)buffer + cnt, data, bytes);
         cnt += bytes;
     }
 
@@ -260,19 +290,24 @@ static ssize_t telit2_socket_recv(struct cellular *modem, int connid, void *buff
 
 static int telit2_socket_waitack(struct cellular *modem, int connid)
 {
-    const char *response;
+    struct at_tok tok;
 
     at_set_timeout(modem->at, 5);
     for (int i=0; i<TELIT2_WAITACK_TIMEOUT; i++) {
         /* Read number of bytes waiting. */
-        int ack_waiting;
-        response = at_command(modem->at, "AT#SI=%d", connid);
-        at_simple_scanf(response, "#SI: %*d,%*d,%*d,%*d,%d", &ack_waiting);
+        at_tok_init(&tok, at_command(modem->at, "AT#SI=%d", connid));
+        at_tok_expect(&tok, "#SI: ");
+        for (int j=0; j<4; j++)
+            at_tok_skip(&tok);
+        int ack_waiting = at_tok_int(&tok);
+        at_tok_simple_check(&tok);
 
         /* ack_waiting is meaningless if socket is not connected. Check this. */
-        int socket_status;
-        response = at_command(modem->at, "AT#SS=%d", connid);
-        at_simple_scanf(response, "#SS: %*d,%d", &socket_status);
+        at_tok_init(&tok, at_command(modem->at, "AT#SS=%d", connid));
+        at_tok_expect(&tok, "#SS: ");
+        at_tok_skip(&tok);
+        int socket_status = at_tok_int(&tok);
+        at_tok_simple_check(&tok);
         if (socket_status == 0) {
             errno = ECONNRESET;
             return -1;
@@ -282,7 +317,7 @@ static int telit2_socket_waitack(struct cellular *modem, int connid)
         if (ack_waiting == 0)
             return 0;
 
-        sleep(1);
+        at_coro_sleep_ms(1000);
     }
 
     errno = ETIMEDOUT;
@@ -317,8 +352,11 @@ static enum at_response_type scanner_ftprecv(const char *line, size_t len, void
     (void) len;
     (void) arg;
 
-    int bytes;
-    if (sscanf(line, "#FTPRECV: %d", &bytes) == 1)
+    struct at_tok tok;
+    at_tok_init(&tok, line);
+    at_tok_expect(&tok, "#FTPRECV: ");
+    int bytes = at_tok_int(&tok);
+    if (!tok.error)
         return AT_RESPONSE_RAWDATA_FOLLOWS(bytes);
     return AT_RESPONSE_UNKNOWN;
 }
@@ -330,13 +368,17 @@ static int telit2_ftp_getdata(struct cellular *modem, char *buffer, size_t lengt
 retry:
     at_set_timeout(modem->at, 150);
     at_set_command_scanner(modem->at, scanner_ftprecv);
+    at_set_data_buffer(modem->at, buffer, length);
     const char *response = at_command(modem->at, "AT#FTPRECV=%zu", length);
 
     if (response == NULL)
         return -1;
 
-    int bytes;
-    if (sscanf(response, "#FTPRECV: %d", &bytes) == 1) {
+    struct at_tok tok;
+    at_tok_init(&tok, response);
+    at_tok_expect(&tok, "#FTPRECV: ");
+    int bytes = at_tok_int(&tok);
+    if (!tok.error) {
         /* Zero means no data is available. Wait for it. */
         if (bytes == 0) {
             /* Bail out on timeout. */
@@ -344,45 +386,26 @@ retry:
                 errno = ETIMEDOUT;
                 return -1;
             }
-            sleep(1);
+            at_coro_sleep_ms(1000);
             goto retry;
         }
 
-        /* Locate the payload. */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
+        /* Payload is already in the buffer. */
+        if (bytes > (int) length) {
             errno = EPROTO;
             return -1;
         }
-        data += 1;
-
-        /* Copy payload to result buffer. */
-        memcpy(buffer, data, bytes);
         return bytes;
     }
 
     /* Error or EOF? */
-    int eof;
-    response = at_command(modem->at, "AT#FTPGETPKT?");
     /* Expected response: #FTPGETPKT: <remotefile>,<viewMode>,<eof> */
-#if 0
-    /* The %[] specifier is not supported on some embedded systems. */
-    at_simple_scanf(response, "#FTPGETPKT: %*[^,],%*d,%d", &eof);
-#else
-    /* Parse manually. */
-    if (response == NULL)
-        return -1;
-    errno = EPROTO;
-    /* Check the initial part of the response. */
-    if (strncmp(response, "#FTPGETPKT: ", 12))
-        return -1;
-    /* Skip the filename. */
-    response = strchr(response, ',');
-    if (response == NULL)
-        return -1;
-    response++;
-    at_simple_scanf(response, "%*d,%d", &eof);
-#endif
+    at_tok_init(&tok, at_command(modem->at, "AT#FTPGETPKT?"));
+    at_tok_expect(&tok, "#FTPGETPKT: ");
+    at_tok_skip(&tok);
+    at_tok_skip(&tok);
+    int eof = at_tok_int(&tok);
+    at_tok_simple_check(&tok);
 
     if (eof == 1)
         return 0;
@@ -399,7 +422,7 @@ static int telit2_locate(struct cellular *modem, float *latitude, float *longitu
     cellular_command_simple_pdp(modem, "AT#AGPSSND");
 
     for (int i=0; i<TELIT2_LOCATE_TIMEOUT; i++) {
-        sleep(1);
+        at_coro_sleep_ms(1000);
         if (priv->locate_status == 200) {
             *latitude = priv->latitude;
             *longitude = priv->longitude;
@@ -451,11 +474,26 @@ static const struct cellular_ops telit2_ops = {
 
 struct cellular *cellular_telit2_alloc(void)
 {
-    struct cellular_telit2 *modem = malloc(sizeof(struct cellular_telit2));
-    if (modem == NULL) {
+    void *storage = malloc(cellular_telit2_sizeof());
+    if (storage == NULL) {
         errno = ENOMEM;
         return NULL;
     }
+
+    struct cellular_telit2 *modem = (struct cellular_telit2 *) cellular_telit2_init(storage);
+    modem->allocated = true;
+
+    return (struct cellular *) modem;
+}
+
+size_t cellular_telit2_sizeof(void)
+{
+    return AT_STORAGE_ROUND(sizeof(struct cellular_telit2));
+}
+
+struct cellular *cellular_telit2_init(void *storage)
+{
+    struct cellular_telit2 *modem = storage;
     memset(modem, 0, sizeof(*modem));
 
     modem->dev.ops = &telit2_ops;
@@ -465,7 +503,10 @@ struct cellular *cellular_telit2_alloc(void)
 
 void cellular_telit2_free(struct cellular *modem)
 {
-    free(modem);
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
+
+    if (priv->allocated)
+        free(modem);
 }
 
 /* vim: set ts=4 sw=4 et: */
@@ -8,9 +8,22 @@
 
 #include <attentive/parser.h>
 
-#include <stdio.h>
 #include <string.h>
 
+/*
+ * Line scanning uses SIMD where available. Define AT_PARSER_NO_SIMD to force
+ * the portable scalar code, e.g. on embedded targets.
+ */
+#if !defined(AT_PARSER_NO_SIMD)
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define AT_PARSER_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define AT_PARSER_NEON
+#endif
+#endif
+
 enum at_parser_state {
     STATE_IDLE,
     STATE_READLINE,
@@ -28,18 +41,31 @@ struct at_parser {
     size_t data_left;
     int nibble;
 
+    uint8_t *data_buf;
+    size_t data_size;
+    size_t data_used;
+
+    at_response_handler_t line_handler;
+    void *line_arg;
+
+    struct at_prefix_matcher *generic;
+    struct at_log *log;
+
     char *buf;
     size_t buf_used;
     size_t buf_size;
     size_t buf_current;
+    size_t buf_step;
+    size_t buf_max;
+    bool buf_grown;         /**< Buffer was moved out of the instance storage. */
+    bool overflow;
+    bool failed;            /**< Last response ended with a generic error final. */
+    bool allocated;         /**< Storage came from at_parser_alloc. */
 };
 
-static const char *const final_ok_responses[] = {
-    "OK",
-    NULL
-};
-
-static const char *const final_responses[] = {
+/* Generic response prefixes; first match wins. Keep in sync with the types below. */
+static const char *const generic_responses[] = {
+    "RING",
     "OK",
     "ERROR",
     "NO CARRIER",
@@ -48,29 +74,67 @@ static const char *const final_responses[] = {
     NULL
 };
 
-static const char *const urc_responses[] = {
-    "RING",
-    NULL
+static const enum at_response_type generic_response_types[] = {
+    AT_RESPONSE_URC,
+    AT_RESPONSE_FINAL_OK,
+    AT_RESPONSE_FINAL,
+    AT_RESPONSE_FINAL,
+    AT_RESPONSE_FINAL,
+    AT_RESPONSE_FINAL,
 };
 
+/*
+ * Instance storage layout: the parser struct, the compiled generic response
+ * table and the response buffer, each rounded up to AT_STORAGE_ALIGN.
+ */
+size_t at_parser_sizeof(size_t bufsize)
+{
+    return AT_STORAGE_ROUND(sizeof(struct at_parser)) +
+           at_prefix_matcher_sizeof(generic_responses) +
+           AT_STORAGE_ROUND(bufsize);
+}
+
 struct at_parser *at_parser_alloc(const struct at_parser_callbacks *cbs, size_t bufsize, void *priv)
 {
-    /* Allocate parser struct. */
-    struct at_parser *parser = (struct at_parser *) malloc(sizeof(struct at_parser));
-    if (parser == NULL) {
+    /* Allocate the parser, generic table and response buffer in one block. */
+    void *storage = malloc(at_parser_sizeof(bufsize));
+    if (storage == NULL) {
         errno = ENOMEM;
         return NULL;
     }
 
-    /* Allocate response buffer. */
-    parser->buf = malloc(bufsize);
-    if (parser->buf == NULL) {
-        free(parser);
-        errno = ENOMEM;
+    struct at_parser *parser = at_parser_init(storage, cbs, bufsize, priv);
+    if (parser == NULL) {
+        free(storage);
         return NULL;
     }
+    parser->allocated = true;
+
+    return parser;
+}
+
+struct at_parser *at_parser_init(void *storage, const struct at_parser_callbacks *cbs, size_t bufsize, void *priv)
+{
+    struct at_parser *parser = storage;
+    char *next = (char *) storage + AT_STORAGE_ROUND(sizeof(struct at_parser));
+
+    /* Compile generic response table. */
+    parser->generic = at_prefix_matcher_init(next, generic_responses);
+    if (parser->generic == NULL)
+        return NULL;
+    next += at_prefix_matcher_sizeof(generic_responses);
+
+    /* The response buffer comes last. */
+    parser->buf = next;
     parser->cbs = cbs;
     parser->buf_size = bufsize;
+    parser->buf_step = 0;
+    parser->buf_max = bufsize;
+    parser->buf_grown = false;
+    parser->overflow = false;
+    parser->failed = false;
+    parser->allocated = false;
+    parser->log = NULL;
     parser->priv = priv;
 
     /* Prepare instance. */
@@ -86,6 +150,11 @@ void at_parser_reset(struct at_parser *parser)
     parser->buf_used = 0;
     parser->buf_current = 0;
     parser->data_left = 0;
+    parser->data_buf = NULL;
+    parser->data_size = 0;
+    parser->data_used = 0;
+    parser->line_handler = NULL;
+    parser->line_arg = NULL;
 }
 
 void at_parser_expect_dataprompt(struct at_parser *parser)
@@ -93,9 +162,46 @@ void at_parser_expect_dataprompt(struct at_parser *parser)
     parser->expect_dataprompt = true;
 }
 
+void at_parser_set_data_buffer(struct at_parser *parser, void *buf, size_t size)
+{
+    parser->data_buf = buf;
+    parser->data_size = size;
+    parser->data_used = 0;
+}
+
+void at_parser_set_line_handler(struct at_parser *parser, at_response_handler_t handler, void *arg)
+{
+    parser->line_handler = handler;
+    parser->line_arg = arg;
+}
+
+void at_parser_set_buffer_growth(struct at_parser *parser, size_t step, size_t max)
+{
+    parser->buf_step = step;
+    parser->buf_max = (step && max > parser->buf_size ? max : parser->buf_size);
+}
+
+void at_parser_set_log(struct at_parser *parser, struct at_log *log)
+{
+    parser->log = log;
+}
+
 void at_parser_await_response(struct at_parser *parser)
 {
     parser->state = (parser->expect_dataprompt ? STATE_DATAPROMPT : STATE_READLINE);
+    parser->expect_dataprompt = false;
+    parser->overflow = false;
+    parser->failed = false;
+}
+
+bool at_parser_overflowed(const struct at_parser *parser)
+{
+    return parser->overflow;
+}
+
+bool at_parser_failed(const struct at_parser *parser)
+{
+    return parser->failed;
 }
 
 bool at_prefix_in_table(const char *line, const char *const table[])
@@ -107,6 +213,192 @@ bool at_prefix_in_table(const char *line, const char *const table[])
     return false;
 }
 
+/*
+ * Compiled prefix tables.
+ *
+ * Prefixes are stored as a trie. Nodes are laid out breadth-first so that the
+ * children of every node are contiguous and sorted, and are looked up with
+ * a binary search. The root's children are also indexed by character, so
+ * the first step is a single table lookup.
+ */
+
+#define AT_PREFIX_MAX_NODES UINT16_MAX
+#define AT_PREFIX_MAX_ENTRIES INT16_MAX
+
+struct at_prefix_node {
+    uint16_t children;      /**< Index of the first child. */
+    uint16_t nchildren;     /**< Number of children. */
+    int16_t match;          /**< Lowest index of a prefix ending here or -1. */
+    int16_t entry;          /**< Any entry passing through this node. */
+    uint8_t depth;          /**< Prefix length. */
+    uint8_t ch;             /**< Last character of the prefix. */
+};
+
+struct at_prefix_matcher {
+    uint16_t first[256];    /**< Root child index by character; 0 if none. */
+    bool allocated;         /**< Storage came from at_prefix_matcher_alloc. */
+    struct at_prefix_node nodes[];
+};
+
+static bool prefix_node_contains(const char *const table[], const struct at_prefix_node *node, int i)
+{
+    /* The root contains everything. */
+    if (node->depth == 0)
+        return true;
+    return !strncmp(table[i], table[node->entry], node->depth);
+}
+
+/**
+ * Count the entries of a prefix table; the trie can't have more nodes than
+ * characters.
+ *
+ * @returns True if the table fits in a matcher, false and sets errno otherwise.
+ */
+static bool prefix_table_count(const char *const table[], size_t *nentries, size_t *max_nodes)
+{
+    *nentries = 0;
+    *max_nodes = 1;
+    for (; table[*nentries] != NULL; (*nentries)++) {
+        size_t len = strlen(table[*nentries]);
+        if (len > UINT8_MAX) {
+            errno = EINVAL;
+            return false;
+        }
+        *max_nodes += len;
+    }
+    if (*nentries > AT_PREFIX_MAX_ENTRIES || *max_nodes > AT_PREFIX_MAX_NODES) {
+        errno = EINVAL;
+        return false;
+    }
+
+    return true;
+}
+
+size_t at_prefix_matcher_sizeof(const char *const table[])
+{
+    size_t nentries, max_nodes;
+    if (!prefix_table_count(table, &nentries, &max_nodes))
+        return 0;
+
+    return AT_STORAGE_ROUND(sizeof(struct at_prefix_matcher) +
+                            max_nodes * sizeof(struct at_prefix_node));
+}
+
+struct at_prefix_matcher *at_prefix_matcher_alloc(const char *const table[])
+{
+    size_t size = at_prefix_matcher_sizeof(table);
+    if (size == 0)
+        return NULL;
+
+    void *storage = malloc(size);
+    if (storage == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct at_prefix_matcher *matcher = at_prefix_matcher_init(storage, table);
+    matcher->allocated = true;
+
+    return matcher;
+}
+
+struct at_prefix_matcher *at_prefix_matcher_init(void *storage, const char *const table[])
+{
+    size_t nentries, max_nodes;
+    if (!prefix_table_count(table, &nentries, &max_nodes))
+        return NULL;
+
+    struct at_prefix_matcher *matcher = storage;
+    memset(matcher->first, 0, sizeof(matcher->first));
+    matcher->allocated = false;
+
+    /* Build the trie breadth-first, starting with the root. */
+    struct at_prefix_node *nodes = matcher->nodes;
+    nodes[0] = (struct at_prefix_node) { .match = -1 };
+    size_t nnodes = 1;
+
+    for (size_t n=0; n<nnodes; n++) {
+        struct at_prefix_node *node = &nodes[n];
+        node->children = nnodes;
+        node->nchildren = 0;
+
+        /* Find the first prefix that ends here. */
+        for (size_t i=0; i<nentries && node->match == -1; i++)
+            if (prefix_node_contains(table, node, i) && table[i][node->depth] == '\0')
+                node->match = i;
+
+        /* Append children, in ascending character order. */
+        int last = 0;
+        while (true) {
+            int next = 256, entry = -1;
+            for (size_t i=0; i<nentries; i++) {
+                /* Entries not under this node may be shorter than its depth. */
+                if (!prefix_node_contains(table, node, i))
+                    continue;
+                int ch = (uint8_t) table[i][node->depth];
+                if (ch > last && ch < next) {
+                    next = ch;
+                    entry = i;
+                }
+            }
+            if (entry == -1)
+                break;
+
+            nodes[nnodes++] = (struct at_prefix_node) {
+                .match = -1,
+                .entry = entry,
+                .depth = node->depth + 1,
+                .ch = next,
+            };
+            node->nchildren++;
+            last = next;
+        }
+    }
+
+    /* Index the root's children. */
+    for (size_t i=0; i<nodes[0].nchildren; i++)
+        matcher->first[nodes[nodes[0].children + i].ch] = nodes[0].children + i;
+
+    return matcher;
+}
+
+int at_prefix_matcher_find(const struct at_prefix_matcher *matcher, const char *line)
+{
+    const struct at_prefix_node *nodes = matcher->nodes;
+    int match = nodes[0].match;
+
+    size_t n = matcher->first[(uint8_t) *line];
+    while (n != 0) {
+        const struct at_prefix_node *node = &nodes[n];
+        if (node->match != -1 && (match == -1 || node->match < match))
+            match = node->match;
+
+        /* Descend to the child matching the next character. */
+        uint8_t ch = *++line;
+        size_t lo = node->children, hi = node->children + node->nchildren;
+        n = 0;
+        while (ch && lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (nodes[mid].ch < ch) {
+                lo = mid + 1;
+            } else if (nodes[mid].ch > ch) {
+                hi = mid;
+            } else {
+                n = mid;
+                break;
+            }
+        }
+    }
+
+    return match;
+}
+
+void at_prefix_matcher_free(struct at_prefix_matcher *matcher)
+{
+    if (matcher->allocated)
+        free(matcher);
+}
+
 static enum at_response_type generic_line_scanner(const char *line, size_t len, struct at_parser *parser)
 {
     (void) len;
@@ -115,22 +407,75 @@ static enum at_response_type generic_line_scanner(const char *line, size_t len,
         if (len == 2 && !memcmp(line, "> ", 2))
             return AT_RESPONSE_FINAL_OK;
 
-    if (at_prefix_in_table(line, urc_responses))
-        return AT_RESPONSE_URC;
-    else if (at_prefix_in_table(line, final_ok_responses))
-        return AT_RESPONSE_FINAL_OK;
-    else if (at_prefix_in_table(line, final_responses))
-        return AT_RESPONSE_FINAL;
+    int match = at_prefix_matcher_find(parser->generic, line);
+    if (match != -1)
+        return generic_response_types[match];
     else
         return AT_RESPONSE_INTERMEDIATE;
 }
 
+/**
+ * Make room for len more bytes in the response buffer.
+ *
+ * Grows the buffer in buf_step increments up to buf_max while a response is
+ * awaited (in idle state the buffer may still hold the previous response).
+ * If that's not enough, the response overflows: the lines accumulated so far
+ * are dropped and the current line is moved to the start of the buffer, so
+ * the final response line can still be recognized.
+ *
+ * @returns Number of bytes available, at most len.
+ */
+static size_t parser_reserve(struct at_parser *parser, size_t len)
+{
+    size_t space = parser->buf_size-1 - parser->buf_used;
+    if (len <= space)
+        return len;
+
+    if (parser->buf_size < parser->buf_max && parser->state != STATE_IDLE) {
+        size_t missing = len - space;
+        size_t size = parser->buf_size + (missing + parser->buf_step - 1) / parser->buf_step * parser->buf_step;
+        if (size > parser->buf_max)
+            size = parser->buf_max;
+
+        /* The initial buffer lives in the instance storage; move it out. */
+        char *buf = (parser->buf_grown ? realloc(parser->buf, size) : malloc(size));
+        if (buf) {
+            if (!parser->buf_grown)
+                memcpy(buf, parser->buf, parser->buf_used);
+            parser->buf_grown = true;
+            parser->buf = buf;
+            parser->buf_size = size;
+            space = parser->buf_size-1 - parser->buf_used;
+            if (len <= space)
+                return len;
+        }
+    }
+
+    parser->overflow = true;
+    if (parser->buf_current > 0) {
+        memmove(parser->buf, parser->buf + parser->buf_current, parser->buf_used - parser->buf_current);
+        parser->buf_used -= parser->buf_current;
+        parser->buf_current = 0;
+        space = parser->buf_size-1 - parser->buf_used;
+    }
+
+    return (len < space ? len : space);
+}
+
 static void parser_append(struct at_parser *parser, char ch)
 {
-    if (parser->buf_used < parser->buf_size-1)
+    if (parser_reserve(parser, 1))
         parser->buf[parser->buf_used++] = ch;
 }
 
+static void parser_append_run(struct at_parser *parser, const uint8_t *data, size_t len)
+{
+    len = parser_reserve(parser, len);
+
+    memcpy(parser->buf + parser->buf_used, data, len);
+    parser->buf_used += len;
+}
+
 static void parser_include_line(struct at_parser *parser)
 {
     /* Append a newline. */
@@ -146,6 +491,180 @@ static void parser_discard_line(struct at_parser *parser)
     parser->buf_used = parser->buf_current;
 }
 
+/** Hex digit values; -1 for non-hex characters. */
+static const int8_t hex_table[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+#if defined(AT_PARSER_SSE2)
+/**
+ * Convert 16 hex digits to their nibble values.
+ *
+ * @param mask Set to a bitmask of valid hex digit positions.
+ */
+static __m128i hex_nibbles_sse2(__m128i chars, int *mask)
+{
+    __m128i digit = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(chars, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+
+    *mask = _mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha));
+    return _mm_or_si128(_mm_and_si128(is_digit, digit),
+                        _mm_and_si128(is_alpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+}
+
+/**
+ * Decode 32 hex digits into 16 bytes.
+ *
+ * @returns False (and writes nothing) if any of the characters isn't a hex digit.
+ */
+static bool hex_decode_sse2(uint8_t *dst, const uint8_t *src)
+{
+    int mask_a, mask_b;
+    __m128i a = hex_nibbles_sse2(_mm_loadu_si128((const __m128i *) src), &mask_a);
+    __m128i b = hex_nibbles_sse2(_mm_loadu_si128((const __m128i *) (src+16)), &mask_b);
+    if ((mask_a & mask_b) != 0xffff)
+        return false;
+
+    /* Each 16-bit lane holds a high nibble in its low byte and vice versa. */
+    const __m128i low_byte = _mm_set1_epi16(0x00ff);
+    a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, low_byte), 4), _mm_srli_epi16(a, 8));
+    b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, low_byte), 4), _mm_srli_epi16(b, 8));
+    _mm_storeu_si128((__m128i *) dst, _mm_packus_epi16(a, b));
+
+    return true;
+}
+#endif
+
+/**
+ * Decode hex-escaped data. Characters other than hex digits are skipped.
+ *
+ * @param dst Destination buffer.
+ * @param count Maximum number of bytes to decode.
+ * @param src Hex characters.
+ * @param len Number of characters in src.
+ * @param nibble Pending high nibble (-1 if none); updated.
+ * @param decoded Set to the number of bytes written to dst.
+ * @returns Number of characters consumed.
+ */
+static size_t hex_decode(uint8_t *dst, size_t count, const uint8_t *src, size_t len,
+                         int *nibble, size_t *decoded)
+{
+    size_t i = 0, out = 0;
+
+    while (out < count && i < len) {
+#if defined(AT_PARSER_SSE2)
+        /* Fast path: whole blocks of hex digits, byte-aligned. */
+        if (*nibble == -1)
+            while (count-out >= 16 && len-i >= 32 && hex_decode_sse2(dst+out, src+i)) {
+                i += 32; out += 16;
+            }
+#endif
+
+        /* Slow path: a block's worth of characters, skipping separators. */
+        size_t stop = (len-i > 32 ? i+32 : len);
+        while (out < count && i < stop) {
+            int value = hex_table[src[i++]];
+            if (value == -1)
+                continue;
+
+            if (*nibble == -1) {
+                *nibble = value;
+            } else {
+                dst[out++] = (*nibble << 4) | value;
+                *nibble = -1;
+            }
+        }
+    }
+
+    *decoded = out;
+    return i;
+}
+
+/**
+ * Store a piece of a raw/hex data block; either in the caller-supplied data
+ * buffer (excess is discarded) or in the response buffer.
+ */
+static void parser_store_data(struct at_parser *parser, const uint8_t *data, size_t len)
+{
+    if (parser->data_buf) {
+        size_t space = parser->data_size - parser->data_used;
+        if (len > space)
+            len = space;
+
+        memcpy(parser->data_buf + parser->data_used, data, len);
+        parser->data_used += len;
+    } else {
+        parser_append_run(parser, data, len);
+    }
+}
+
+/**
+ * Decode a piece of a hex data block into its destination.
+ *
+ * @returns Number of characters consumed.
+ */
+static size_t parser_store_hex(struct at_parser *parser, const uint8_t *data, size_t len)
+{
+    uint8_t *dst;
+    size_t space;
+    if (parser->data_buf) {
+        dst = parser->data_buf + parser->data_used;
+        space = parser->data_size - parser->data_used;
+    } else {
+        /* Reserve room for the rest of the block at once. */
+        space = parser_reserve(parser, parser->data_left);
+        dst = (uint8_t *) parser->buf + parser->buf_used;
+    }
+
+    size_t decoded;
+    size_t used = hex_decode(dst, (parser->data_left < space ? parser->data_left : space),
+                             data, len, &parser->nibble, &decoded);
+    parser->data_left -= decoded;
+    if (parser->data_buf)
+        parser->data_used += decoded;
+    else
+        parser->buf_used += decoded;
+
+    /* Out of space; decode and discard the rest. */
+    while (used < len && parser->data_left > 0) {
+        uint8_t discard[64];
+        used += hex_decode(discard, (parser->data_left < sizeof(discard) ? parser->data_left : sizeof(discard)),
+                           data+used, len-used, &parser->nibble, &decoded);
+        parser->data_left -= decoded;
+    }
+
+    return used;
+}
+
+/**
+ * Helper, called when a raw/hex data block has been received.
+ */
+static void parser_finish_data(struct at_parser *parser)
+{
+    /* Data stored in the response buffer is terminated like a line. */
+    if (!parser->data_buf)
+        parser_include_line(parser);
+
+    parser->state = STATE_READLINE;
+}
+
 static void parser_finalize(struct at_parser *parser)
 {
     /* Remove the last newline, if any. */
@@ -173,7 +692,7 @@ static void parser_handle_line(struct at_parser *parser)
     size_t len = parser->buf_used - parser->buf_current;
 
     /* Log the received line. */
-    printf("< '%.*s'\n", (int) len, line);
+    at_log(parser->log, AT_LOG_DEBUG, "< '%.*s'", (int) len, line);
 
     /* Determine response type. */
     enum at_response_type type = AT_RESPONSE_UNKNOWN;
@@ -196,6 +715,19 @@ static void parser_handle_line(struct at_parser *parser)
         return;
     }
 
+    /* Stream intermediate lines instead of accumulating them. */
+    if (type == AT_RESPONSE_INTERMEDIATE && parser->line_handler) {
+        parser->line_handler(line, len, parser->line_arg);
+        parser_discard_line(parser);
+
+        return;
+    }
+
+    /* Driver-specific finals (e.g. SEND FAIL) don't count as errors;
+     * some of them report success. */
+    if ((type & _AT_RESPONSE_TYPE_MASK) == AT_RESPONSE_FINAL)
+        parser->failed = (generic_line_scanner(line, len, parser) == AT_RESPONSE_FINAL);
+
     /* Accumulate everything that's not a final OK. */
     if (type != AT_RESPONSE_FINAL_OK) {
         /* Include the line in the buffer. */
@@ -224,6 +756,8 @@ static void parser_handle_line(struct at_parser *parser)
             /* Switch parser state to rawdata mode. */
             parser->data_left = (int)type >> 8;
             parser->state = STATE_RAWDATA;
+            if (parser->data_left == 0)
+                parser_finish_data(parser);
         }
         break;
 
@@ -233,6 +767,8 @@ static void parser_handle_line(struct at_parser *parser)
             parser->data_left = (int)type >> 8;
             parser->nibble = -1;
             parser->state = STATE_HEXDATA;
+            if (parser->data_left == 0)
+                parser_finish_data(parser);
         }
         break;
 
@@ -244,15 +780,40 @@ static void parser_handle_line(struct at_parser *parser)
     }
 }
 
-static int hex2int(char c)
+/**
+ * Find the first line terminator ('\r' or '\n').
+ *
+ * @returns Offset of the terminator or len if there is none.
+ */
+static size_t scan_line_end(const uint8_t *data, size_t len)
 {
-    if (c >= '0' && c <= '9')
-        return c - '0';
-    if (c >= 'A' && c <= 'F')
-        return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f')
-        return c - 'a' + 10;
-    return -1;
+    size_t i = 0;
+
+#if defined(AT_PARSER_SSE2)
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i+16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data+i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, cr),
+                                                  _mm_cmpeq_epi8(chunk, lf)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(AT_PARSER_NEON)
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    for (; i+16 <= len; i += 16) {
+        uint8x16_t chunk = vld1q_u8(data+i);
+        if (vmaxvq_u8(vorrq_u8(vceqq_u8(chunk, cr), vceqq_u8(chunk, lf))))
+            break;
+    }
+#endif
+
+    for (; i < len; i++)
+        if (data[i] == '\r' || data[i] == '\n')
+            return i;
+
+    return len;
 }
 
 void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
@@ -261,22 +822,35 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
 
     while (len > 0)
     {
-        /* Fetch next character. */
-        uint8_t ch = *buf++; len--;
-
         switch (parser->state)
         {
             case STATE_IDLE:
             case STATE_READLINE:
             case STATE_DATAPROMPT:
             {
-                if ((ch != '\r') && (ch != '\n')) {
-                    /* Append the character if it's not a newline. */
-                    parser_append(parser, ch);
+                /* Find the run of characters up to the next newline. */
+                size_t run = scan_line_end(buf, len);
+
+                /* The dataprompt has no newline; stop when it might be complete. */
+                if (parser->state == STATE_DATAPROMPT &&
+                    parser->buf_used < 2 && run > 2 - parser->buf_used)
+                {
+                    run = 2 - parser->buf_used;
+                }
+
+                bool newline = false;
+                if (run > 0) {
+                    /* Append the whole run at once. */
+                    parser_append_run(parser, buf, run);
+                    buf += run; len -= run;
+                } else {
+                    /* Consume the newline character. */
+                    newline = (*buf == '\n');
+                    buf++; len--;
                 }
 
                 /* Handle full lines. */
-                if ((ch == '\n') ||
+                if (newline ||
                     (parser->state == STATE_DATAPROMPT &&
                      parser->buf_used == 2 &&
                      !memcmp(parser->buf, "> ", 2)))
@@ -287,36 +861,23 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
             break;
 
             case STATE_RAWDATA: {
-                if (parser->data_left > 0) {
-                    parser_append(parser, ch);
-                    parser->data_left--;
-                }
-
-                if (parser->data_left == 0) {
-                    parser_include_line(parser);
-                    parser->state = STATE_READLINE;
-                }
+                /* Take as much of the data block as is available. */
+                size_t run = (len < parser->data_left ? len : parser->data_left);
+                parser_store_data(parser, buf, run);
+                buf += run; len -= run;
+                parser->data_left -= run;
+
+                if (parser->data_left == 0)
+                    parser_finish_data(parser);
             } break;
 
             case STATE_HEXDATA: {
-                if (parser->data_left > 0) {
-                    int value = hex2int(ch);
-                    if (value != -1) {
-                        if (parser->nibble == -1) {
-                            parser->nibble = value;
-                        } else {
-                            value |= (parser->nibble << 4);
-                            parser->nibble = -1;
-                            parser_append(parser, value);
-                            parser->data_left--;
-                        }
-                    }
-                }
+                /* Decode as much of the data block as is available. */
+                size_t used = parser_store_hex(parser, buf, len);
+                buf += used; len -= used;
 
-                if (parser->data_left == 0) {
-                    parser_include_line(parser);
-                    parser->state = STATE_READLINE;
-                }
+                if (parser->data_left == 0)
+                    parser_finish_data(parser);
             } break;
         }
     }
@@ -324,8 +885,10 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
 
 void at_parser_free(struct at_parser *parser)
 {
-    free(parser->buf);
-    free(parser);
+    if (parser->buf_grown)
+        free(parser->buf);
+    if (parser->allocated)
+        free(parser);
 }
 
 /* vim: set ts=4 sw=4 et: */
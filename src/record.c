@@ -0,0 +1,511 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/* For clock_gettime, nanosleep and O_CLOEXEC. */
+#define _GNU_SOURCE
+
+#include <attentive/record.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define AT_RECORD_BUFSIZE (64 * 1024)
+#define AT_RECORD_INTERVAL_MS 100
+
+/* Type, delta and length. */
+#define AT_RECORD_HEADER_MAX (1 + 10 + 10)
+
+/* pcap link type for private use. */
+#define DLT_USER0 147
+
+/*
+ * Writers append to the active half of a double buffer under the mutex; the
+ * writer thread swaps the halves and writes the full one out without holding
+ * it. io_mutex serializes the swap-and-write between the writer thread and
+ * at_record_flush, so the inactive half is always empty when swapped in.
+ */
+struct at_record {
+    int fd;
+    char *buffers[2];
+    size_t size;            /**< Size of each half. */
+    size_t len;             /**< Bytes in the active half. */
+    int active;
+
+    uint64_t last_us;       /**< Monotonic time of the last record. */
+    uint64_t lost;          /**< Bytes lost since the last gap record. */
+    uint64_t dropped;       /**< Bytes lost in total. */
+    int error;              /**< errno of the last failed write. */
+
+    pthread_t thread;
+    pthread_mutex_t mutex;  /**< Protects the variables above. */
+    pthread_mutex_t io_mutex;
+    pthread_cond_t cond;    /**< Wakes up the writer thread. */
+    bool running;
+};
+
+static uint64_t record_clock_us(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * (uint64_t) 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t varint_put(unsigned char *buf, uint64_t value)
+{
+    size_t len = 0;
+    while (value >= 0x80) {
+        buf[len++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = (unsigned char) value;
+    return len;
+}
+
+/**
+ * Append one record to the active buffer. Called with the mutex held.
+ *
+ * @returns False if it doesn't fit.
+ */
+static bool record_append(struct at_record *record, enum at_record_type type,
+                          const void *data, size_t len, uint64_t now)
+{
+    unsigned char header[AT_RECORD_HEADER_MAX];
+    size_t hlen = 0;
+    header[hlen++] = type;
+    hlen += varint_put(header + hlen, now - record->last_us);
+    hlen += varint_put(header + hlen, len);
+
+    if (record->len + hlen + len > record->size)
+        return false;
+
+    char *buf = record->buffers[record->active] + record->len;
+    memcpy(buf, header, hlen);
+    memcpy(buf + hlen, data, len);
+    record->len += hlen + len;
+    record->last_us = now;
+    return true;
+}
+
+/* Swap buffers and write out the full one. */
+static int record_drain(struct at_record *record)
+{
+    pthread_mutex_lock(&record->io_mutex);
+
+    pthread_mutex_lock(&record->mutex);
+    char *buf = record->buffers[record->active];
+    size_t len = record->len;
+    record->active ^= 1;
+    record->len = 0;
+    pthread_mutex_unlock(&record->mutex);
+
+    int why = 0;
+    while (len > 0) {
+        ssize_t result = write(record->fd, buf, len);
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            why = errno;
+            break;
+        }
+        buf += result;
+        len -= result;
+    }
+
+    pthread_mutex_unlock(&record->io_mutex);
+
+    if (why) {
+        /* What didn't make it to the file is lost like a full buffer. */
+        pthread_mutex_lock(&record->mutex);
+        record->error = why;
+        record->lost += len;
+        record->dropped += len;
+        pthread_mutex_unlock(&record->mutex);
+        errno = why;
+        return -1;
+    }
+    return 0;
+}
+
+static void *record_thread(void *arg)
+{
+    struct at_record *record = arg;
+
+    pthread_mutex_lock(&record->mutex);
+    while (record->running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec += AT_RECORD_INTERVAL_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+
+        while (record->running && record->len < record->size / 2)
+            if (pthread_cond_timedwait(&record->cond, &record->mutex, &ts) == ETIMEDOUT)
+                break;
+
+        if (record->len) {
+            pthread_mutex_unlock(&record->mutex);
+            record_drain(record);
+            pthread_mutex_lock(&record->mutex);
+        }
+    }
+    pthread_mutex_unlock(&record->mutex);
+
+    return NULL;
+}
+
+struct at_record *at_record_alloc(const char *path, size_t bufsize)
+{
+    size_t size = (bufsize ? bufsize : AT_RECORD_BUFSIZE);
+
+    struct at_record *record = calloc(1, sizeof(struct at_record) + 2 * size);
+    if (!record) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    record->buffers[0] = (char *) (record + 1);
+    record->buffers[1] = record->buffers[0] + size;
+    record->size = size;
+
+    record->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (record->fd == -1) {
+        int why = errno;
+        free(record);
+        errno = why;
+        return NULL;
+    }
+
+    pthread_mutex_init(&record->mutex, NULL);
+    pthread_mutex_init(&record->io_mutex, NULL);
+    /* Time the writer thread's waits on the monotonic clock, so setting
+     * the system time doesn't stall it or make it spin. */
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&record->cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    /* New files start with the magic; every session with a start record. */
+    struct stat st;
+    if (!fstat(record->fd, &st) && st.st_size == 0) {
+        memcpy(record->buffers[0], AT_RECORD_MAGIC, AT_RECORD_MAGIC_SIZE);
+        record->len = AT_RECORD_MAGIC_SIZE;
+    }
+    uint64_t wall = record_clock_us(CLOCK_REALTIME);
+    unsigned char payload[8];
+    for (int i=0; i<8; i++)
+        payload[i] = (unsigned char) (wall >> (8 * i));
+    record->last_us = record_clock_us(CLOCK_MONOTONIC);
+    record_append(record, AT_RECORD_START, payload, sizeof(payload), record->last_us);
+
+    record->running = true;
+    int result = pthread_create(&record->thread, NULL, record_thread, record);
+    if (result) {
+        pthread_cond_destroy(&record->cond);
+        pthread_mutex_destroy(&record->io_mutex);
+        pthread_mutex_destroy(&record->mutex);
+        close(record->fd);
+        free(record);
+        errno = result;
+        return NULL;
+    }
+
+    return record;
+}
+
+void at_record_write(struct at_record *record, enum at_record_type type,
+                     const void *data, size_t len)
+{
+    pthread_mutex_lock(&record->mutex);
+    uint64_t now = record_clock_us(CLOCK_MONOTONIC);
+
+    /* Report earlier losses first, if there's room now. */
+    if (record->lost) {
+        unsigned char payload[10];
+        size_t plen = varint_put(payload, record->lost);
+        if (record_append(record, AT_RECORD_GAP, payload, plen, now))
+            record->lost = 0;
+    }
+
+    if (record->lost || !record_append(record, type, data, len, now)) {
+        record->lost += len;
+        record->dropped += len;
+    }
+
+    if (record->len >= record->size / 2 || record->lost)
+        pthread_cond_signal(&record->cond);
+    pthread_mutex_unlock(&record->mutex);
+}
+
+void at_record_response(struct at_record *record, int status, bool failed)
+{
+    unsigned char payload[2] = { (unsigned char) status, failed };
+    at_record_write(record, AT_RECORD_RESPONSE, payload, sizeof(payload));
+}
+
+int at_record_flush(struct at_record *record)
+{
+    if (record_drain(record))
+        return -1;
+
+    pthread_mutex_lock(&record->mutex);
+    int why = record->error;
+    record->error = 0;
+    pthread_mutex_unlock(&record->mutex);
+
+    if (why) {
+        errno = why;
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t at_record_dropped(struct at_record *record)
+{
+    pthread_mutex_lock(&record->mutex);
+    uint64_t dropped = record->dropped;
+    pthread_mutex_unlock(&record->mutex);
+    return dropped;
+}
+
+void at_record_free(struct at_record *record)
+{
+    pthread_mutex_lock(&record->mutex);
+    record->running = false;
+    pthread_cond_signal(&record->cond);
+    pthread_mutex_unlock(&record->mutex);
+    pthread_join(record->thread, NULL);
+
+    record_drain(record);
+    close(record->fd);
+
+    pthread_cond_destroy(&record->cond);
+    pthread_mutex_destroy(&record->io_mutex);
+    pthread_mutex_destroy(&record->mutex);
+    free(record);
+}
+
+/*
+ * Reading.
+ */
+
+struct at_replay {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    uint64_t time_us;       /**< Time of the last record read. */
+};
+
+struct at_replay *at_replay_alloc(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        int why = errno;
+        close(fd);
+        errno = why;
+        return NULL;
+    }
+    if ((size_t) st.st_size < AT_RECORD_MAGIC_SIZE) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int why = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+        errno = why;
+        return NULL;
+    }
+    if (memcmp(data, AT_RECORD_MAGIC, AT_RECORD_MAGIC_SIZE)) {
+        munmap(data, st.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    struct at_replay *replay = malloc(sizeof(struct at_replay));
+    if (!replay) {
+        munmap(data, st.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    replay->data = data;
+    replay->size = st.st_size;
+    at_replay_rewind(replay);
+
+    return replay;
+}
+
+static bool varint_get(struct at_replay *replay, uint64_t *value)
+{
+    *value = 0;
+    for (int shift=0; shift<64 && replay->pos < replay->size; shift+=7) {
+        unsigned char byte = replay->data[replay->pos++];
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+int at_replay_next(struct at_replay *replay, struct at_record_entry *entry)
+{
+    if (replay->pos == replay->size)
+        return 0;
+
+    entry->type = replay->data[replay->pos++];
+    uint64_t delta, len;
+    if (!varint_get(replay, &delta) || !varint_get(replay, &len) ||
+        len > replay->size - replay->pos)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    entry->data = replay->data + replay->pos;
+    entry->len = len;
+    replay->pos += len;
+
+    if (entry->type == AT_RECORD_START && len >= 8) {
+        /* Sessions start at the wall clock time they were recorded at. */
+        const unsigned char *payload = entry->data;
+        replay->time_us = 0;
+        for (int i=7; i>=0; i--)
+            replay->time_us = (replay->time_us << 8) | payload[i];
+    } else {
+        replay->time_us += delta;
+    }
+    entry->time_us = replay->time_us;
+
+    return 1;
+}
+
+void at_replay_rewind(struct at_replay *replay)
+{
+    replay->pos = AT_RECORD_MAGIC_SIZE;
+    replay->time_us = 0;
+}
+
+ssize_t at_replay_feed(struct at_replay *replay, struct at_parser *parser, double speed)
+{
+    struct at_record_entry entry;
+    uint64_t first = 0, start = 0;
+    bool started = false;
+    ssize_t fed = 0;
+    int result;
+
+    while ((result = at_replay_next(replay, &entry)) == 1) {
+        if (entry.type == AT_RECORD_START) {
+            /* Sessions are replayed back to back. */
+            started = false;
+            continue;
+        }
+
+        if (speed > 0) {
+            uint64_t now = record_clock_us(CLOCK_MONOTONIC);
+            if (!started) {
+                first = entry.time_us;
+                start = now;
+                started = true;
+            }
+            uint64_t due = start + (uint64_t) ((entry.time_us - first) / speed);
+            if (due > now) {
+                struct timespec ts = {
+                    .tv_sec = (due - now) / 1000000,
+                    .tv_nsec = (due - now) % 1000000 * 1000,
+                };
+                while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+                    continue;
+            }
+        }
+
+        switch (entry.type) {
+            case AT_RECORD_INPUT:
+                at_parser_feed(parser, entry.data, entry.len);
+                fed += entry.len;
+                break;
+            case AT_RECORD_COMMAND:
+                at_parser_await_response(parser);
+                break;
+            case AT_RECORD_RESPONSE:
+                /* The channel resets the parser when a command times out. */
+                if (entry.len >= 1 && ((const unsigned char *) entry.data)[0] == ETIMEDOUT)
+                    at_parser_reset(parser);
+                break;
+            default:
+                break;
+        }
+    }
+
+    return (result == -1 ? -1 : fed);
+}
+
+ssize_t at_replay_export_pcap(struct at_replay *replay, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -1;
+
+    /* Native byte order; readers tell by the magic. */
+    struct {
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t network;
+    } header = { 0xa1b2c3d4, 2, 4, 0, 0, 0x40000, DLT_USER0 };
+    fwrite(&header, sizeof(header), 1, f);
+
+    struct at_record_entry entry;
+    ssize_t packets = 0;
+    int result;
+    while ((result = at_replay_next(replay, &entry)) == 1) {
+        struct {
+            uint32_t ts_sec;
+            uint32_t ts_usec;
+            uint32_t incl_len;
+            uint32_t orig_len;
+        } packet = {
+            (uint32_t) (entry.time_us / 1000000),
+            (uint32_t) (entry.time_us % 1000000),
+            (uint32_t) (entry.len + 1),
+            (uint32_t) (entry.len + 1),
+        };
+        unsigned char type = entry.type;
+        fwrite(&packet, sizeof(packet), 1, f);
+        fwrite(&type, 1, 1, f);
+        fwrite(entry.data, 1, entry.len, f);
+        packets++;
+    }
+
+    if (fclose(f) || result == -1)
+        return -1;
+    return packets;
+}
+
+void at_replay_free(struct at_replay *replay)
+{
+    munmap((void *) replay->data, replay->size);
+    free(replay);
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,131 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/response.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Slabs are laid out back to back after the pool header. A slab with no
+ * references is free; it's claimed with a 0 -> 1 CAS on its reference count,
+ * so getting, referencing and releasing never take a lock. Pools are small,
+ * so a linear scan for a free slab is cheaper than maintaining a free list.
+ */
+struct at_response_slab {
+    struct at_response response;
+    unsigned refs;
+    char text[];
+};
+
+struct at_response_pool {
+    size_t count;
+    size_t size;            /**< Maximum response length. */
+    size_t stride;          /**< Distance between slabs. */
+    bool allocated;         /**< Storage came from at_response_pool_alloc. */
+};
+
+static size_t at_response_slab_stride(size_t size)
+{
+    return AT_STORAGE_ROUND(sizeof(struct at_response_slab) + size + 1);
+}
+
+static struct at_response_slab *at_response_slab(struct at_response_pool *pool, size_t i)
+{
+    char *slabs = (char *) pool + AT_STORAGE_ROUND(sizeof(struct at_response_pool));
+    return (struct at_response_slab *) (slabs + i * pool->stride);
+}
+
+size_t at_response_pool_sizeof(size_t count, size_t size)
+{
+    return AT_STORAGE_ROUND(sizeof(struct at_response_pool)) +
+           count * at_response_slab_stride(size);
+}
+
+struct at_response_pool *at_response_pool_alloc(size_t count, size_t size)
+{
+    void *storage = malloc(at_response_pool_sizeof(count, size));
+    if (!storage) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct at_response_pool *pool = at_response_pool_init(storage, count, size);
+    pool->allocated = true;
+
+    return pool;
+}
+
+struct at_response_pool *at_response_pool_init(void *storage, size_t count, size_t size)
+{
+    struct at_response_pool *pool = storage;
+    pool->count = count;
+    pool->size = size;
+    pool->stride = at_response_slab_stride(size);
+    pool->allocated = false;
+
+    for (size_t i=0; i<count; i++) {
+        struct at_response_slab *slab = at_response_slab(pool, i);
+        slab->response.text = slab->text;
+        slab->response.len = 0;
+        slab->refs = 0;
+    }
+
+    return pool;
+}
+
+void at_response_pool_free(struct at_response_pool *pool)
+{
+    if (pool->allocated)
+        free(pool);
+}
+
+struct at_response *at_response_pool_get(struct at_response_pool *pool, const char *text, size_t len)
+{
+    if (len > pool->size) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    for (size_t i=0; i<pool->count; i++) {
+        struct at_response_slab *slab = at_response_slab(pool, i);
+        unsigned refs = 0;
+        if (!__atomic_compare_exchange_n(&slab->refs, &refs, 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+
+        memcpy(slab->text, text, len);
+        slab->text[len] = '\0';
+        slab->response.len = len;
+        return &slab->response;
+    }
+
+    errno = ENOBUFS;
+    return NULL;
+}
+
+struct at_response *at_response_ref(struct at_response *response)
+{
+    struct at_response_slab *slab = (struct at_response_slab *) response;
+
+    __atomic_add_fetch(&slab->refs, 1, __ATOMIC_RELAXED);
+    return response;
+}
+
+void at_response_release(struct at_response *response)
+{
+    struct at_response_slab *slab = (struct at_response_slab *) response;
+
+    /* Release ordering: the slab's contents must be read before reuse. */
+    if (slab)
+        __atomic_sub_fetch(&slab->refs, 1, __ATOMIC_RELEASE);
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,355 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/stats.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The command and URC tables follow the instance. Prefixes are few (a driver
+ * uses a few dozen commands at most), so they're looked up with a linear scan
+ * and entries are claimed in order, never freed until a reset.
+ */
+struct at_stats_priv {
+    struct at_stats stats;
+
+    struct at_stats_command *commands;
+    struct at_stats_urc *urcs;
+
+    struct at_stats_command *current;   /**< Command in flight. */
+    uint64_t start;                     /**< When it was sent. */
+    bool first_byte;                    /**< Its first byte has arrived. */
+
+    bool allocated;         /**< Storage came from at_stats_alloc. */
+};
+
+static size_t at_stats_commands_offset(void)
+{
+    return AT_STORAGE_ROUND(sizeof(struct at_stats_priv));
+}
+
+static size_t at_stats_urcs_offset(size_t ncommands)
+{
+    return at_stats_commands_offset() +
+           AT_STORAGE_ROUND(ncommands * sizeof(struct at_stats_command));
+}
+
+size_t at_stats_sizeof(size_t ncommands, size_t nurcs)
+{
+    return at_stats_urcs_offset(ncommands) +
+           AT_STORAGE_ROUND(nurcs * sizeof(struct at_stats_urc));
+}
+
+struct at_stats *at_stats_alloc(size_t ncommands, size_t nurcs)
+{
+    void *storage = malloc(at_stats_sizeof(ncommands, nurcs));
+    if (!storage) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct at_stats_priv *priv = (struct at_stats_priv *) at_stats_init(storage, ncommands, nurcs);
+    priv->allocated = true;
+
+    return &priv->stats;
+}
+
+struct at_stats *at_stats_init(void *storage, size_t ncommands, size_t nurcs)
+{
+    struct at_stats_priv *priv = storage;
+    memset(priv, 0, sizeof(struct at_stats_priv));
+
+    priv->commands = (struct at_stats_command *) ((char *) storage + at_stats_commands_offset());
+    priv->urcs = (struct at_stats_urc *) ((char *) storage + at_stats_urcs_offset(ncommands));
+    priv->stats.ncommands = ncommands;
+    priv->stats.nurcs = nurcs;
+
+    at_stats_reset(&priv->stats);
+
+    return &priv->stats;
+}
+
+void at_stats_free(struct at_stats *stats)
+{
+    struct at_stats_priv *priv = (struct at_stats_priv *) stats;
+
+    if (priv->allocated)
+        free(priv);
+}
+
+void at_stats_reset(struct at_stats *stats)
+{
+    struct at_stats_priv *priv = (struct at_stats_priv *) stats;
+
+    stats->bytes_in = 0;
+    stats->bytes_out = 0;
+    stats->overflows = 0;
+    stats->untracked = 0;
+    memset(priv->commands, 0, stats->ncommands * sizeof(struct at_stats_command));
+    memset(priv->urcs, 0, stats->nurcs * sizeof(struct at_stats_urc));
+
+    priv->current = NULL;
+}
+
+void at_stats_copy(struct at_stats *dst, const struct at_stats *src)
+{
+    struct at_stats_priv *dpriv = (struct at_stats_priv *) dst;
+    const struct at_stats_priv *spriv = (const struct at_stats_priv *) src;
+
+    /* Tables of different sizes: copy what fits, clear the rest. */
+    at_stats_reset(dst);
+    dst->bytes_in = src->bytes_in;
+    dst->bytes_out = src->bytes_out;
+    dst->overflows = src->overflows;
+    dst->untracked = src->untracked;
+
+    size_t ncommands = (src->ncommands < dst->ncommands ? src->ncommands : dst->ncommands);
+    size_t nurcs = (src->nurcs < dst->nurcs ? src->nurcs : dst->nurcs);
+    memcpy(dpriv->commands, spriv->commands, ncommands * sizeof(struct at_stats_command));
+    memcpy(dpriv->urcs, spriv->urcs, nurcs * sizeof(struct at_stats_urc));
+}
+
+const struct at_stats_command *at_stats_command(const struct at_stats *stats, size_t i)
+{
+    const struct at_stats_priv *priv = (const struct at_stats_priv *) stats;
+
+    if (i >= stats->ncommands || !priv->commands[i].prefix[0])
+        return NULL;
+    return &priv->commands[i];
+}
+
+const struct at_stats_urc *at_stats_urc(const struct at_stats *stats, size_t i)
+{
+    const struct at_stats_priv *priv = (const struct at_stats_priv *) stats;
+
+    if (i >= stats->nurcs || !priv->urcs[i].prefix[0])
+        return NULL;
+    return &priv->urcs[i];
+}
+
+static int at_stats_bucket(uint64_t us)
+{
+    if (us < 4)
+        return us;
+
+    int exponent = 63 - __builtin_clzll(us);
+    int bucket = ((exponent - 1) << 2) | ((us >> (exponent - 2)) & 3);
+    return (bucket < AT_STATS_BUCKETS ? bucket : AT_STATS_BUCKETS - 1);
+}
+
+static uint64_t at_stats_bucket_limit(int bucket)
+{
+    if (bucket < 4)
+        return bucket + 1;
+
+    int exponent = (bucket >> 2) + 1;
+    return (uint64_t) (5 + (bucket & 3)) << (exponent - 2);
+}
+
+static void at_stats_histogram_add(struct at_stats_histogram *histogram, uint64_t us)
+{
+    histogram->buckets[at_stats_bucket(us)]++;
+}
+
+uint64_t at_stats_percentile(const struct at_stats_histogram *histogram, double fraction)
+{
+    uint64_t total = 0;
+    for (int i=0; i<AT_STATS_BUCKETS; i++)
+        total += histogram->buckets[i];
+    if (!total)
+        return 0;
+
+    /* Rank of the sample we're looking for, 1-based. */
+    uint64_t rank = (uint64_t) (fraction * total + 0.999999);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int i=0; i<AT_STATS_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            return at_stats_bucket_limit(i);
+    }
+    return at_stats_bucket_limit(AT_STATS_BUCKETS - 1);
+}
+
+/**
+ * Command prefix: "AT" followed by the command name, up to its parameters
+ * ('=', '?', digits) or the end of the line.
+ */
+static void at_stats_command_key(char *key, const char *data, size_t len)
+{
+    if (len < 2 || toupper((unsigned char) data[0]) != 'A' || toupper((unsigned char) data[1]) != 'T') {
+        strcpy(key, "(data)");
+        return;
+    }
+
+    size_t i;
+    for (i=0; i<len && i<AT_STATS_PREFIX-1; i++) {
+        char c = data[i];
+        if (!isalpha((unsigned char) c) && !strchr("+#$%&*^\\", c))
+            break;
+        key[i] = c;
+    }
+    key[i] = '\0';
+}
+
+/**
+ * URC prefix: everything up to the first ':', ' ' or ','.
+ */
+static void at_stats_urc_key(char *key, const char *line, size_t len)
+{
+    size_t i;
+    for (i=0; i<len && i<AT_STATS_PREFIX-1; i++) {
+        if (line[i] == ':' || line[i] == ' ' || line[i] == ',')
+            break;
+        key[i] = line[i];
+    }
+    key[i] = '\0';
+
+    if (!i)
+        strcpy(key, "(empty)");
+}
+
+void at_stats_record_command(struct at_stats *stats, const void *data, size_t len, uint64_t now)
+{
+    struct at_stats_priv *priv = (struct at_stats_priv *) stats;
+    char key[AT_STATS_PREFIX];
+
+    stats->bytes_out += len;
+    priv->current = NULL;
+
+    at_stats_command_key(key, data, len);
+    for (size_t i=0; i<stats->ncommands; i++) {
+        struct at_stats_command *command = &priv->commands[i];
+        if (!command->prefix[0])
+            strcpy(command->prefix, key);
+        else if (strcmp(command->prefix, key))
+            continue;
+
+        command->count++;
+        priv->current = command;
+        priv->start = now;
+        priv->first_byte = false;
+        return;
+    }
+
+    stats->untracked++;
+}
+
+void at_stats_record_input(struct at_stats *stats, size_t len, uint64_t now)
+{
+    struct at_stats_priv *priv = (struct at_stats_priv *) stats;
+
+    stats->bytes_in += len;
+    if (priv->current && !priv->first_byte && len) {
+        at_stats_histogram_add(&priv->current->first_byte, now - priv->start);
+        priv->first_byte = true;
+    }
+}
+
+void at_stats_record_response(struct at_stats *stats, int status, bool failed, uint64_t now)
+{
+    struct at_stats_priv *priv = (struct at_stats_priv *) stats;
+    struct at_stats_command *command = priv->current;
+
+    if (status == ENOBUFS)
+        stats->overflows++;
+
+    priv->current = NULL;
+    if (!command)
+        return;
+
+    switch (status) {
+        case 0:
+            at_stats_histogram_add(&command->final, now - priv->start);
+            if (failed)
+                command->errors++;
+            break;
+        case ENOBUFS:
+            at_stats_histogram_add(&command->final, now - priv->start);
+            command->overflows++;
+            break;
+        case ETIMEDOUT:
+            command->timeouts++;
+            break;
+    }
+}
+
+void at_stats_record_urc(struct at_stats *stats, const char *line, size_t len)
+{
+    struct at_stats_priv *priv = (struct at_stats_priv *) stats;
+    char key[AT_STATS_PREFIX];
+
+    at_stats_urc_key(key, line, len);
+    for (size_t i=0; i<stats->nurcs; i++) {
+        struct at_stats_urc *urc = &priv->urcs[i];
+        if (!urc->prefix[0])
+            strcpy(urc->prefix, key);
+        else if (strcmp(urc->prefix, key))
+            continue;
+
+        urc->count++;
+        return;
+    }
+
+    stats->untracked++;
+}
+
+/**
+ * snprintf onto the end of a report, keeping count past the buffer's end.
+ */
+static void at_stats_append(char *buf, size_t size, size_t *len, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    int ret = vsnprintf(*len < size ? buf + *len : NULL, *len < size ? size - *len : 0, format, ap);
+    va_end(ap);
+
+    if (ret > 0)
+        *len += ret;
+}
+
+size_t at_stats_format(const struct at_stats *stats, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    if (size)
+        buf[0] = '\0';
+
+    at_stats_append(buf, size, &len,
+                    "bytes in %" PRIu64 " out %" PRIu64 ", %" PRIu32 " overflows, %" PRIu32 " untracked\n",
+                    stats->bytes_in, stats->bytes_out, stats->overflows, stats->untracked);
+
+    const struct at_stats_command *command;
+    for (size_t i=0; (command = at_stats_command(stats, i)); i++) {
+        at_stats_append(buf, size, &len,
+                        "%-15s %8" PRIu32 " sent %6" PRIu32 " timeouts %6" PRIu32 " errors %6" PRIu32 " overflows"
+                        " | first byte p50 %" PRIu64 " p99 %" PRIu64 " us"
+                        " | final p50 %" PRIu64 " p99 %" PRIu64 " us\n",
+                        command->prefix, command->count, command->timeouts, command->errors, command->overflows,
+                        at_stats_percentile(&command->first_byte, 0.5),
+                        at_stats_percentile(&command->first_byte, 0.99),
+                        at_stats_percentile(&command->final, 0.5),
+                        at_stats_percentile(&command->final, 0.99));
+    }
+
+    const struct at_stats_urc *urc;
+    for (size_t i=0; (urc = at_stats_urc(stats, i)); i++)
+        at_stats_append(buf, size, &len, "%-15s %8" PRIu32 " urcs\n", urc->prefix, urc->count);
+
+    return len;
+}
+
+/* vim: set ts=4 sw=4 et: */
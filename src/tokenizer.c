@@ -0,0 +1,287 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/tokenizer.h>
+
+#include <limits.h>
+#include <string.h>
+
+/*
+ * Character classes are tested explicitly instead of with <ctype.h>, which
+ * depends on the locale.
+ */
+static inline bool tok_isdigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline int tok_hexval(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static inline void tok_fail(struct at_tok *tok)
+{
+    tok->error = true;
+}
+
+static inline void tok_skip_spaces(struct at_tok *tok)
+{
+    while (*tok->pos == ' ')
+        tok->pos++;
+}
+
+/* Consume the field separator, if any. */
+static inline void tok_next(struct at_tok *tok)
+{
+    if (*tok->pos == ',')
+        tok->pos++;
+}
+
+void at_tok_init(struct at_tok *tok, const char *line)
+{
+    tok->pos = line;
+    tok->error = (line == NULL);
+}
+
+bool at_tok_expect(struct at_tok *tok, const char *literal)
+{
+    if (tok->error)
+        return false;
+
+    const char *pos = tok->pos;
+    while (*literal) {
+        if (*pos++ != *literal++) {
+            tok_fail(tok);
+            return false;
+        }
+    }
+    tok->pos = pos;
+
+    return true;
+}
+
+int at_tok_int(struct at_tok *tok)
+{
+    if (tok->error)
+        return 0;
+
+    tok_skip_spaces(tok);
+    const char *pos = tok->pos;
+
+    bool negative = false;
+    if (*pos == '-' || *pos == '+')
+        negative = (*pos++ == '-');
+
+    if (!tok_isdigit(*pos)) {
+        tok_fail(tok);
+        return 0;
+    }
+
+    /* Accumulate as a negative number so that INT_MIN fits. */
+    int value = 0;
+    while (tok_isdigit(*pos)) {
+        int digit = *pos++ - '0';
+        if (value < (INT_MIN + digit) / 10) {
+            tok_fail(tok);
+            return 0;
+        }
+        value = value * 10 - digit;
+    }
+    if (!negative) {
+        if (value == INT_MIN) {
+            tok_fail(tok);
+            return 0;
+        }
+        value = -value;
+    }
+
+    tok->pos = pos;
+    tok_next(tok);
+
+    return value;
+}
+
+unsigned int at_tok_hex(struct at_tok *tok)
+{
+    if (tok->error)
+        return 0;
+
+    tok_skip_spaces(tok);
+    const char *pos = tok->pos;
+
+    bool quoted = (*pos == '"');
+    if (quoted)
+        pos++;
+
+    if (tok_hexval(*pos) < 0) {
+        tok_fail(tok);
+        return 0;
+    }
+
+    unsigned int value = 0;
+    int digit;
+    while ((digit = tok_hexval(*pos)) >= 0) {
+        if (value > (UINT_MAX >> 4)) {
+            tok_fail(tok);
+            return 0;
+        }
+        value = (value << 4) | digit;
+        pos++;
+    }
+
+    if (quoted && *pos++ != '"') {
+        tok_fail(tok);
+        return 0;
+    }
+
+    tok->pos = pos;
+    tok_next(tok);
+
+    return value;
+}
+
+float at_tok_float(struct at_tok *tok)
+{
+    if (tok->error)
+        return 0;
+
+    tok_skip_spaces(tok);
+    const char *pos = tok->pos;
+
+    bool negative = false;
+    if (*pos == '-' || *pos == '+')
+        negative = (*pos++ == '-');
+
+    double value = 0;
+    bool digits = false;
+    while (tok_isdigit(*pos)) {
+        value = value * 10 + (*pos++ - '0');
+        digits = true;
+    }
+    if (*pos == '.') {
+        double scale = 1;
+        pos++;
+        while (tok_isdigit(*pos)) {
+            value = value * 10 + (*pos++ - '0');
+            scale *= 10;
+            digits = true;
+        }
+        value /= scale;
+    }
+
+    if (!digits) {
+        tok_fail(tok);
+        return 0;
+    }
+
+    tok->pos = pos;
+    tok_next(tok);
+
+    return negative ? -value : value;
+}
+
+size_t at_tok_string(struct at_tok *tok, char *buf, size_t size)
+{
+    if (size)
+        buf[0] = '\0';
+    if (tok->error)
+        return 0;
+
+    tok_skip_spaces(tok);
+    const char *start = tok->pos;
+    const char *end;
+    const char *next;
+
+    if (*start == '"') {
+        start++;
+        end = strchr(start, '"');
+        if (!end) {
+            tok_fail(tok);
+            return 0;
+        }
+        next = end + 1;
+    } else {
+        end = start + strcspn(start, ",");
+        next = end;
+    }
+
+    size_t len = end - start;
+    if (len >= size) {
+        tok_fail(tok);
+        return 0;
+    }
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+
+    tok->pos = next;
+    tok_next(tok);
+
+    return len;
+}
+
+size_t at_tok_digits(struct at_tok *tok, char *buf, size_t size)
+{
+    if (size)
+        buf[0] = '\0';
+    if (tok->error)
+        return 0;
+
+    tok_skip_spaces(tok);
+    const char *start = tok->pos;
+    while (tok_isdigit(*tok->pos))
+        tok->pos++;
+
+    size_t len = tok->pos - start;
+    if (!len || !size) {
+        tok_fail(tok);
+        return 0;
+    }
+    if (len >= size)
+        len = size - 1;
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+
+    tok_next(tok);
+
+    return len;
+}
+
+bool at_tok_skip(struct at_tok *tok)
+{
+    if (tok->error)
+        return false;
+
+    tok_skip_spaces(tok);
+    if (!*tok->pos) {
+        tok_fail(tok);
+        return false;
+    }
+
+    if (*tok->pos == '"') {
+        const char *end = strchr(tok->pos + 1, '"');
+        if (!end) {
+            tok_fail(tok);
+            return false;
+        }
+        tok->pos = end + 1;
+    } else {
+        tok->pos += strcspn(tok->pos, ",");
+    }
+    tok_next(tok);
+
+    return true;
+}
+
+/* vim: set ts=4 sw=4 et: */
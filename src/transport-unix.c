@@ -0,0 +1,499 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/* For cfmakeraw, cfsetspeed, CRTSCTS and getaddrinfo. */
+#define _GNU_SOURCE
+
+#include <attentive/at-unix.h>
+#include <attentive/storage.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+#endif
+
+void at_transport_free(struct at_transport *transport)
+{
+    if (transport->fd != -1)
+        transport->ops->close(transport);
+    transport->ops->free(transport);
+}
+
+/*
+ * Descriptor operations shared by all transports.
+ */
+
+static ssize_t fd_read(struct at_transport *transport, void *buf, size_t size)
+{
+    return read(transport->fd, buf, size);
+}
+
+static ssize_t fd_write(struct at_transport *transport, const void *buf, size_t size)
+{
+    return write(transport->fd, buf, size);
+}
+
+static int fd_wait(struct at_transport *transport, short events, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = transport->fd, .events = events };
+    return poll(&pfd, 1, timeout_ms);
+}
+
+static void fd_close(struct at_transport *transport)
+{
+    close(transport->fd);
+    transport->fd = -1;
+}
+
+static void fd_set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * Serial port.
+ */
+
+struct at_transport_serial {
+    struct at_transport transport;
+    const char *devpath;
+    speed_t baudrate;
+    bool flow_control;      /**< RTS/CTS hardware flow control. */
+    bool low_latency;       /**< Driver passes input on right away. */
+    bool low_latency_set;   /**< ASYNC_LOW_LATENCY was off until we set it. */
+    bool allocated;         /**< Storage came from at_transport_serial_alloc. */
+};
+
+/*
+ * Full raw mode: no line editing, echo, signals or character translation,
+ * so every byte reaches the parser as sent. CLOCAL keeps the modem control
+ * lines other than RTS/CTS out of it.
+ */
+static int serial_configure(struct at_transport_serial *serial, int fd)
+{
+    struct termios attr;
+    if (tcgetattr(fd, &attr))
+        return -1;
+
+    cfmakeraw(&attr);
+    attr.c_cflag |= CLOCAL | CREAD;
+#ifdef CRTSCTS
+    if (serial->flow_control)
+        attr.c_cflag |= CRTSCTS;
+    else
+        attr.c_cflag &= ~CRTSCTS;
+#endif
+    if (serial->baudrate)
+        cfsetspeed(&attr, serial->baudrate);
+    /* read() returns what's there once a byte is; an inter-byte timer
+     * would only hold back responses that already arrived. */
+    attr.c_cc[VMIN] = 1;
+    attr.c_cc[VTIME] = 0;
+
+    if (tcsetattr(fd, TCSANOW, &attr))
+        return -1;
+
+#ifdef __linux__
+    /* Have the driver push input to the tty layer immediately instead of
+     * from a work queue; USB adapters (e.g. ftdi_sio) also drop their
+     * latency timer from 16 ms to 1 ms. Best effort: not every driver
+     * has it (ptys don't). Disabling only clears the flag if we set it. */
+    struct serial_struct info;
+    if ((serial->low_latency || serial->low_latency_set) && !ioctl(fd, TIOCGSERIAL, &info)) {
+        if (serial->low_latency && !(info.flags & ASYNC_LOW_LATENCY)) {
+            info.flags |= ASYNC_LOW_LATENCY;
+            if (!ioctl(fd, TIOCSSERIAL, &info))
+                serial->low_latency_set = true;
+        } else if (!serial->low_latency && serial->low_latency_set) {
+            info.flags &= ~ASYNC_LOW_LATENCY;
+            if (!ioctl(fd, TIOCSSERIAL, &info))
+                serial->low_latency_set = false;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+static const struct {
+    speed_t speed;
+    unsigned long bps;
+} serial_speeds[] = {
+    { B1200, 1200 },
+    { B2400, 2400 },
+    { B4800, 4800 },
+    { B9600, 9600 },
+    { B19200, 19200 },
+    { B38400, 38400 },
+#ifdef B57600
+    { B57600, 57600 },
+#endif
+#ifdef B115200
+    { B115200, 115200 },
+#endif
+#ifdef B230400
+    { B230400, 230400 },
+#endif
+#ifdef B460800
+    { B460800, 460800 },
+#endif
+#ifdef B921600
+    { B921600, 921600 },
+#endif
+#ifdef B1000000
+    { B1000000, 1000000 },
+#endif
+#ifdef B3000000
+    { B3000000, 3000000 },
+#endif
+#ifdef B4000000
+    { B4000000, 4000000 },
+#endif
+};
+
+#define SERIAL_SPEEDS (sizeof(serial_speeds) / sizeof(*serial_speeds))
+
+static int serial_open(struct at_transport *transport, bool nonblocking)
+{
+    struct at_transport_serial *serial = (struct at_transport_serial *) transport;
+
+    int fd = open(serial->devpath, O_RDWR | O_NOCTTY | (nonblocking ? O_NONBLOCK : 0));
+    if (fd == -1)
+        return -1;
+
+    /* Not a terminal (e.g. a FIFO in tests): nothing to configure. */
+    if (serial_configure(serial, fd) && errno != ENOTTY) {
+        int why = errno;
+        close(fd);
+        errno = why;
+        return -1;
+    }
+
+    transport->fd = fd;
+    return 0;
+}
+
+static int serial_set_flow_control(struct at_transport *transport, bool enable)
+{
+    struct at_transport_serial *serial = (struct at_transport_serial *) transport;
+
+#ifndef CRTSCTS
+    /* Not in POSIX; the platform has no way to ask for it. */
+    if (enable) {
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+
+    serial->flow_control = enable;
+    if (transport->fd == -1)
+        return 0;
+
+    /* Already open: switch over now. */
+    if (serial_configure(serial, transport->fd) && errno != ENOTTY)
+        return -1;
+    return 0;
+}
+
+static int serial_set_baudrate(struct at_transport *transport, unsigned long bps)
+{
+    struct at_transport_serial *serial = (struct at_transport_serial *) transport;
+
+    size_t i;
+    for (i=0; i<SERIAL_SPEEDS; i++)
+        if (serial_speeds[i].bps == bps)
+            break;
+    if (i == SERIAL_SPEEDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    speed_t old = serial->baudrate;
+    serial->baudrate = serial_speeds[i].speed;
+    if (transport->fd == -1)
+        return 0;
+
+    /* Let the last command out at the old speed; what came in meanwhile
+     * was sent at the new one and is garbage. */
+    tcdrain(transport->fd);
+    if (serial_configure(serial, transport->fd) && errno != ENOTTY) {
+        /* Keep reporting, and reopening at, the speed that's in effect. */
+        serial->baudrate = old;
+        return -1;
+    }
+    tcflush(transport->fd, TCIFLUSH);
+    return 0;
+}
+
+static unsigned long serial_get_baudrate(struct at_transport *transport)
+{
+    struct at_transport_serial *serial = (struct at_transport_serial *) transport;
+
+    speed_t speed = serial->baudrate;
+    struct termios attr;
+    if (!speed && transport->fd != -1 && !tcgetattr(transport->fd, &attr))
+        speed = cfgetospeed(&attr);
+
+    for (size_t i=0; i<SERIAL_SPEEDS; i++)
+        if (serial_speeds[i].speed == speed)
+            return serial_speeds[i].bps;
+    return 0;
+}
+
+static int serial_set_low_latency(struct at_transport *transport, bool enable)
+{
+    struct at_transport_serial *serial = (struct at_transport_serial *) transport;
+
+    serial->low_latency = enable;
+    if (transport->fd == -1)
+        return 0;
+
+    if (serial_configure(serial, transport->fd) && errno != ENOTTY)
+        return -1;
+    return 0;
+}
+
+static void serial_free(struct at_transport *transport)
+{
+    struct at_transport_serial *serial = (struct at_transport_serial *) transport;
+
+    if (serial->allocated)
+        free(serial);
+}
+
+static const struct at_transport_ops serial_ops = {
+    .open = serial_open,
+    .read = fd_read,
+    .write = fd_write,
+    .wait = fd_wait,
+    .set_flow_control = serial_set_flow_control,
+    .set_baudrate = serial_set_baudrate,
+    .get_baudrate = serial_get_baudrate,
+    .set_low_latency = serial_set_low_latency,
+    .close = fd_close,
+    .free = serial_free,
+};
+
+size_t at_transport_serial_sizeof(void)
+{
+    return AT_STORAGE_ROUND(sizeof(struct at_transport_serial));
+}
+
+struct at_transport *at_transport_serial_alloc(const char *devpath, speed_t baudrate)
+{
+    void *storage = malloc(at_transport_serial_sizeof());
+    if (!storage) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct at_transport_serial *serial =
+        (struct at_transport_serial *) at_transport_serial_init(storage, devpath, baudrate);
+    serial->allocated = true;
+
+    return &serial->transport;
+}
+
+struct at_transport *at_transport_serial_init(void *storage, const char *devpath, speed_t baudrate)
+{
+    struct at_transport_serial *serial = storage;
+
+    serial->transport.ops = &serial_ops;
+    serial->transport.name = devpath;
+    serial->transport.fd = -1;
+    serial->devpath = devpath;
+    serial->baudrate = baudrate;
+    serial->flow_control = false;
+    serial->low_latency = false;
+    serial->low_latency_set = false;
+    serial->allocated = false;
+
+    return &serial->transport;
+}
+
+/*
+ * TCP connection.
+ */
+
+struct at_transport_tcp {
+    struct at_transport transport;
+    char *host;
+    char port[6];
+    char name[];            /**< "host:port" */
+};
+
+static int tcp_open(struct at_transport *transport, bool nonblocking)
+{
+    struct at_transport_tcp *tcp = (struct at_transport_tcp *) transport;
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *addrs;
+    int result = getaddrinfo(tcp->host, tcp->port, &hints, &addrs);
+    if (result) {
+        errno = (result == EAI_SYSTEM ? errno : EHOSTUNREACH);
+        return -1;
+    }
+
+    /* Try every address until one connects. */
+    int fd = -1;
+    for (struct addrinfo *addr=addrs; addr; addr=addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (!connect(fd, addr->ai_addr, addr->ai_addrlen))
+            break;
+
+        int why = errno;
+        close(fd);
+        fd = -1;
+        errno = why;
+    }
+    freeaddrinfo(addrs);
+    if (fd == -1)
+        return -1;
+
+    /* Commands are short; don't hold them back waiting for more. */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (nonblocking)
+        fd_set_nonblocking(fd);
+
+    transport->fd = fd;
+    return 0;
+}
+
+static void tcp_free(struct at_transport *transport)
+{
+    free(transport);
+}
+
+static const struct at_transport_ops tcp_ops = {
+    .open = tcp_open,
+    .read = fd_read,
+    .write = fd_write,
+    .wait = fd_wait,
+    .close = fd_close,
+    .free = tcp_free,
+};
+
+struct at_transport *at_transport_tcp_alloc(const char *host, uint16_t port)
+{
+    /* The name is followed by a copy of the host. */
+    size_t name_size = strlen(host) + sizeof(":65535");
+    struct at_transport_tcp *tcp = malloc(sizeof(struct at_transport_tcp) + name_size + strlen(host) + 1);
+    if (!tcp) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    snprintf(tcp->name, name_size, "%s:%u", host, port);
+    tcp->host = tcp->name + name_size;
+    strcpy(tcp->host, host);
+    snprintf(tcp->port, sizeof(tcp->port), "%u", port);
+
+    tcp->transport.ops = &tcp_ops;
+    tcp->transport.name = tcp->name;
+    tcp->transport.fd = -1;
+
+    return &tcp->transport;
+}
+
+/*
+ * In-memory loopback. A socket pair rather than a user space buffer: it
+ * needs no locking of its own and stays pollable like the other transports.
+ * The channel gets a duplicate of its end on every open, so closing the
+ * channel doesn't disconnect the peer.
+ */
+
+struct at_transport_loopback {
+    struct at_transport transport;
+    int fds[2];             /**< Channel end, modem end. */
+};
+
+static int loopback_open(struct at_transport *transport, bool nonblocking)
+{
+    struct at_transport_loopback *loopback = (struct at_transport_loopback *) transport;
+
+    int fd = fcntl(loopback->fds[0], F_DUPFD_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    /* File status flags are shared between duplicates. */
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+
+    transport->fd = fd;
+    return 0;
+}
+
+static void loopback_free(struct at_transport *transport)
+{
+    struct at_transport_loopback *loopback = (struct at_transport_loopback *) transport;
+
+    close(loopback->fds[0]);
+    close(loopback->fds[1]);
+    free(loopback);
+}
+
+static const struct at_transport_ops loopback_ops = {
+    .open = loopback_open,
+    .read = fd_read,
+    .write = fd_write,
+    .wait = fd_wait,
+    .close = fd_close,
+    .free = loopback_free,
+};
+
+struct at_transport *at_transport_loopback_alloc(void)
+{
+    struct at_transport_loopback *loopback = malloc(sizeof(struct at_transport_loopback));
+    if (!loopback) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, loopback->fds)) {
+        int why = errno;
+        free(loopback);
+        errno = why;
+        return NULL;
+    }
+
+    loopback->transport.ops = &loopback_ops;
+    loopback->transport.name = "loopback";
+    loopback->transport.fd = -1;
+
+    return &loopback->transport;
+}
+
+int at_transport_loopback_peer(struct at_transport *transport)
+{
+    struct at_transport_loopback *loopback = (struct at_transport_loopback *) transport;
+
+    return loopback->fds[1];
+}
+
+/* vim: set ts=4 sw=4 et: */
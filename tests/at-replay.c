@@ -0,0 +1,317 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Works with AT traffic recordings (see attentive/record.h).
+ *
+ *   at-replay dump FILE            print the records
+ *   at-replay pcap FILE OUT        export to pcap (DLT_USER0) for Wireshark
+ *   at-replay parse [-s X] FILE    feed a parser X times as fast as recorded
+ *                                  (default: as fast as possible)
+ *   at-replay modem [-s X] [-l LINK] FILE
+ *                                  play the modem on a pty for a driver: wait
+ *                                  for each recorded command, then send what
+ *                                  the modem answered, X times as fast
+ *                                  (default: 1)
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <attentive/record.h>
+
+#define BUFSIZE (64 * 1024)
+#define COMMAND_TIMEOUT_MS 30000
+
+static const char *const types[] = {
+    [AT_RECORD_START] = "start",
+    [AT_RECORD_INPUT] = "in",
+    [AT_RECORD_COMMAND] = "command",
+    [AT_RECORD_RESPONSE] = "response",
+    [AT_RECORD_GAP] = "gap",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_escaped(const unsigned char *data, size_t len)
+{
+    for (size_t i=0; i<len; i++) {
+        if (data[i] == '\r')
+            fputs("\\r", stdout);
+        else if (data[i] == '\n')
+            fputs("\\n", stdout);
+        else if (isprint(data[i]))
+            putchar(data[i]);
+        else
+            printf("\\x%02x", data[i]);
+    }
+}
+
+static uint64_t varint(const unsigned char *data, size_t len)
+{
+    uint64_t value = 0;
+    for (size_t i=0; i<len && i<10; i++) {
+        value |= (uint64_t) (data[i] & 0x7f) << (7 * i);
+        if (!(data[i] & 0x80))
+            break;
+    }
+    return value;
+}
+
+static int dump(struct at_replay *replay)
+{
+    struct at_record_entry entry;
+    uint64_t start = 0;
+    int result;
+
+    while ((result = at_replay_next(replay, &entry)) == 1) {
+        const unsigned char *data = entry.data;
+        if (entry.type == AT_RECORD_START) {
+            time_t sec = entry.time_us / 1000000;
+            start = entry.time_us;
+            printf("--- session started %s", ctime(&sec));
+            continue;
+        }
+
+        printf("%12.6f %-8s ", (entry.time_us - start) / 1e6,
+               entry.type < sizeof(types)/sizeof(*types) ? types[entry.type] : "?");
+        if (entry.type == AT_RECORD_RESPONSE && entry.len >= 2)
+            printf("%s%s", data[0] ? strerror(data[0]) : "ok", data[1] ? ", error" : "");
+        else if (entry.type == AT_RECORD_GAP)
+            printf("%llu bytes of records lost", (unsigned long long) varint(data, entry.len));
+        else
+            print_escaped(data, entry.len);
+        putchar('\n');
+    }
+
+    return result;
+}
+
+static enum at_response_type scan_line(const char *line, size_t len, void *priv)
+{
+    (void) len;
+    (void) priv;
+
+    /* Quick-send and SIM800 data finals would otherwise look like URCs. */
+    if (!strncmp(line, "DATA ACCEPT:", 12))
+        return AT_RESPONSE_FINAL;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static size_t responses, urcs;
+
+static void handle_response(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+    responses++;
+}
+
+static void handle_urc(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+    urcs++;
+}
+
+static const struct at_parser_callbacks parser_callbacks = {
+    .scan_line = scan_line,
+    .handle_response = handle_response,
+    .handle_urc = handle_urc,
+};
+
+static int parse(struct at_replay *replay, double speed)
+{
+    struct at_parser *parser = at_parser_alloc(&parser_callbacks, BUFSIZE, NULL);
+    if (!parser)
+        return -1;
+
+    double start = now();
+    ssize_t fed = at_replay_feed(replay, parser, speed);
+    double elapsed = now() - start;
+    at_parser_free(parser);
+    if (fed == -1)
+        return -1;
+
+    printf("%zd bytes, %zu responses, %zu URCs in %.6f s (%.2f MB/s)\n",
+           fed, responses, urcs, elapsed, fed / elapsed / 1e6);
+    return 0;
+}
+
+/* Read and discard len bytes of a command. */
+static int await_command(int master, size_t len)
+{
+    char buf[BUFSIZE];
+
+    while (len > 0) {
+        struct pollfd pfd = { .fd = master, .events = POLLIN };
+        int result = poll(&pfd, 1, COMMAND_TIMEOUT_MS);
+        if (result == -1 && errno == EINTR)
+            continue;
+        if (result <= 0) {
+            if (!result)
+                errno = ETIMEDOUT;
+            return -1;
+        }
+
+        ssize_t got = read(master, buf, len < sizeof(buf) ? len : sizeof(buf));
+        if (got <= 0)
+            return -1;
+        len -= got;
+    }
+    return 0;
+}
+
+static int modem(struct at_replay *replay, double speed, const char *link)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) || unlockpt(master))
+        return -1;
+
+    /* Keep the slave open: raw mode sticks and there's no hangup between clients. */
+    const char *path = ptsname(master);
+    int slave = open(path, O_RDWR | O_NOCTTY);
+    if (slave == -1)
+        return -1;
+    struct termios attr;
+    tcgetattr(slave, &attr);
+    cfmakeraw(&attr);
+    tcsetattr(slave, TCSANOW, &attr);
+
+    if (link) {
+        unlink(link);
+        if (symlink(path, link))
+            return -1;
+    }
+    printf("%s\n", path);
+    fflush(stdout);
+
+    /* Replies are timed from the command they answer. */
+    struct at_record_entry entry;
+    double anchor = now();
+    uint64_t anchor_us = 0;
+    int result;
+    while ((result = at_replay_next(replay, &entry)) == 1) {
+        if (entry.type == AT_RECORD_COMMAND) {
+            if (await_command(master, entry.len)) {
+                perror("waiting for a command");
+                break;
+            }
+            anchor = now();
+            anchor_us = entry.time_us;
+        } else if (entry.type == AT_RECORD_INPUT) {
+            if (anchor_us) {
+                double delay = anchor + (entry.time_us - anchor_us) / 1e6 / speed - now();
+                if (delay > 0) {
+                    struct timespec ts = { (time_t) delay, (long) ((delay - (time_t) delay) * 1e9) };
+                    nanosleep(&ts, NULL);
+                }
+            }
+            if (write(master, entry.data, entry.len) != (ssize_t) entry.len) {
+                perror("write");
+                break;
+            }
+        }
+    }
+
+    /* Let the driver read the tail before hanging up. */
+    tcdrain(master);
+    sleep(1);
+
+    if (link)
+        unlink(link);
+    close(slave);
+    close(master);
+    return (result == -1 ? -1 : 0);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s dump FILE\n"
+            "       %s pcap FILE OUT\n"
+            "       %s parse [-s SPEED] FILE\n"
+            "       %s modem [-s SPEED] [-l LINK] FILE\n",
+            name, name, name, name);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *mode = argv[1];
+
+    double speed = (!strcmp(mode, "modem") ? 1 : 0);
+    const char *link = NULL;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "s:l:")) != -1) {
+        switch (opt) {
+            case 's': speed = atof(optarg); break;
+            case 'l': link = optarg; break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *path = argv[optind];
+    struct at_replay *replay = at_replay_alloc(path);
+    if (!replay) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    int result;
+    if (!strcmp(mode, "dump")) {
+        result = dump(replay);
+    } else if (!strcmp(mode, "pcap") && optind + 1 < argc) {
+        ssize_t packets = at_replay_export_pcap(replay, argv[optind + 1]);
+        if (packets != -1)
+            printf("%zd packets written to %s\n", packets, argv[optind + 1]);
+        result = (packets == -1 ? -1 : 0);
+    } else if (!strcmp(mode, "parse")) {
+        result = parse(replay, speed);
+    } else if (!strcmp(mode, "modem") && speed > 0) {
+        result = modem(replay, speed, link);
+    } else {
+        usage(argv[0]);
+        result = -1;
+        errno = EINVAL;
+    }
+    if (result == -1)
+        perror(mode);
+
+    at_replay_free(replay);
+    return (result == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,156 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Hex data decoding benchmark. Compares the historical nibble-by-nibble
+ * hex2int loop against at_parser_feed() decoding a HEXDATA block into a data
+ * buffer, both for contiguous hex and for hex with separators.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <attentive/parser.h>
+
+#define PAYLOAD_SIZE (64 * 1024)
+#define ITERATIONS 200
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reference implementation: the decoder as it used to be in at_parser_feed. */
+static int hex2int(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static size_t reference_decode(uint8_t *dst, size_t count, const char *src, size_t len)
+{
+    size_t out = 0;
+    int nibble = -1;
+
+    for (size_t i=0; i<len && out < count; i++) {
+        int value = hex2int(src[i]);
+        if (value != -1) {
+            if (nibble == -1) {
+                nibble = value;
+            } else {
+                dst[out++] = value | (nibble << 4);
+                nibble = -1;
+            }
+        }
+    }
+
+    return out;
+}
+
+static enum at_response_type scan_line(const char *line, size_t len, void *priv)
+{
+    (void) len;
+    (void) priv;
+
+    int bytes;
+    if (sscanf(line, "+HEXDATA: %d", &bytes) == 1)
+        return AT_RESPONSE_HEXDATA_FOLLOWS(bytes);
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static void handle_response(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+}
+
+static const struct at_parser_callbacks parser_callbacks = {
+    .scan_line = scan_line,
+    .handle_response = handle_response,
+    .handle_urc = handle_response,
+};
+
+/**
+ * Build a HEXDATA transcript.
+ *
+ * @param separator If non-zero, inserted after every byte.
+ */
+static char *make_transcript(size_t *len, char separator)
+{
+    char *buf = malloc(PAYLOAD_SIZE * 3 + 64);
+    size_t pos = sprintf(buf, "\r\n+HEXDATA: %d\r\n", PAYLOAD_SIZE);
+    for (int i=0; i<PAYLOAD_SIZE; i++) {
+        pos += sprintf(buf+pos, "%02x", (uint8_t) (i * 37));
+        if (separator)
+            buf[pos++] = separator;
+    }
+    pos += sprintf(buf+pos, "\r\nOK\r\n");
+    *len = pos;
+    return buf;
+}
+
+static void bench(const char *name, char separator)
+{
+    size_t len;
+    char *transcript = make_transcript(&len, separator);
+    const char *hex = strchr(transcript + 2, '\n') + 1;
+    size_t hex_len = len - (hex - transcript);
+    static uint8_t expected[PAYLOAD_SIZE], data[PAYLOAD_SIZE];
+
+    /* Reference loop. */
+    double start = now();
+    for (int i=0; i<ITERATIONS; i++)
+        reference_decode(expected, sizeof(expected), hex, hex_len);
+    double reference = now() - start;
+
+    /* Parser with a data buffer. */
+    struct at_parser *parser = at_parser_alloc(&parser_callbacks, 256, NULL);
+    start = now();
+    for (int i=0; i<ITERATIONS; i++) {
+        at_parser_set_data_buffer(parser, data, sizeof(data));
+        at_parser_await_response(parser);
+        at_parser_feed(parser, transcript, len);
+    }
+    double parser_time = now() - start;
+    at_parser_free(parser);
+
+    if (memcmp(expected, data, sizeof(data))) {
+        fprintf(stderr, "%s: decoded data mismatch\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    double mb = (double) hex_len * ITERATIONS / 1e6;
+    fprintf(stderr, "%-12s hex2int %8.1f MB/s   at_parser_feed %8.1f MB/s   (%.1fx)\n",
+            name, mb / reference, mb / parser_time, reference / parser_time);
+
+    free(transcript);
+}
+
+int main()
+{
+    fprintf(stderr, "hex decoding benchmark: %d byte payload, %d iterations\n",
+            PAYLOAD_SIZE, ITERATIONS);
+    bench("contiguous", 0);
+    bench("separated", ' ');
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */
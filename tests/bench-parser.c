@@ -0,0 +1,422 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Parser throughput benchmark. Drives at_parser_feed() with synthetic
+ * transcripts (URC floods, long multi-line responses, raw and hex data blocks,
+ * dataprompt sequences) and, optionally, with recorded transcripts given on
+ * the command line. Each transcript is fed in 1, 64 and 4096 byte chunks,
+ * both with warm caches and with caches evicted before every pass.
+ *
+ * Recorded transcripts are AT channel recordings (see attentive/record.h) or
+ * raw modem output. Raw output is split into command exchanges at final
+ * responses; data blocks are parsed as ordinary lines.
+ *
+ * Usage: bench-parser [transcript...]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <attentive/parser.h>
+#include <attentive/record.h>
+
+#define BUFSIZE (64 * 1024)
+#define DATA_BLOCK 1460
+#define WARM_BYTES (16 * 1024 * 1024)
+#define COLD_PASSES 20
+#define EVICT_SIZE (32 * 1024 * 1024)
+
+/** Bytes received in response to a single command (or unsolicited). */
+struct exchange {
+    size_t offset;          /**< Start of the exchange in the transcript. */
+    size_t len;             /**< Exchange length in bytes. */
+    bool command;           /**< Await a response (otherwise: URCs only). */
+    bool dataprompt;        /**< Expect a "> " dataprompt. */
+    bool data_buffer;       /**< Store the data block in a data buffer. */
+};
+
+struct transcript {
+    const char *name;
+    char *data;
+    size_t len;
+    size_t lines;
+    struct exchange *exchanges;
+    size_t count;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static void append(struct transcript *t, const void *data, size_t len)
+{
+    t->data = xrealloc(t->data, t->len + len);
+    memcpy(t->data + t->len, data, len);
+    t->len += len;
+}
+
+static void appendf(struct transcript *t, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+static void appendf(struct transcript *t, const char *format, ...)
+{
+    char buf[256];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    append(t, buf, len);
+}
+
+/** Start a new exchange; everything appended until the next one belongs to it. */
+static void begin(struct transcript *t, bool command, bool dataprompt, bool data_buffer)
+{
+    t->exchanges = xrealloc(t->exchanges, (t->count + 1) * sizeof(*t->exchanges));
+    t->exchanges[t->count++] = (struct exchange) {
+        .offset = t->len,
+        .command = command,
+        .dataprompt = dataprompt,
+        .data_buffer = data_buffer,
+    };
+}
+
+static void finish(struct transcript *t)
+{
+    for (size_t i=0; i<t->count; i++) {
+        size_t end = (i+1 < t->count ? t->exchanges[i+1].offset : t->len);
+        t->exchanges[i].len = end - t->exchanges[i].offset;
+    }
+
+    t->lines = 0;
+    for (size_t i=0; i<t->len; i++)
+        if (t->data[i] == '\n')
+            t->lines++;
+}
+
+static void build_urc_flood(struct transcript *t)
+{
+    static const char *const urcs[] = {
+        "+CIEV: 10,\"26201\",\"Telekom.de\",\"Telekom.de\", 0, 0",
+        "*PSNWID: \"262\",\"01\", \"Telekom.de\", 0, \"Telekom.de\", 0",
+        "*PSUTTZ: 2014,11,3,10,15,41,\"+4\",0",
+        "+CTZV: +4,0",
+        "DST: 0",
+        "+CIPRXGET: 1,0",
+        "RING",
+    };
+
+    t->name = "urc-flood";
+    begin(t, false, false, false);
+    for (int i=0; i<4096; i++)
+        appendf(t, "\r\n%s\r\n", urcs[i % (sizeof(urcs)/sizeof(*urcs))]);
+    finish(t);
+}
+
+static void build_multiline(struct transcript *t)
+{
+    t->name = "multiline";
+    for (int i=0; i<16; i++) {
+        begin(t, true, false, false);
+        appendf(t, "\r\nOK\r\n\r\nSTATE: IP PROCESSING\r\n");
+        for (int j=0; j<256; j++)
+            appendf(t, "\r\nC: %d,0,\"TCP\",\"192.168.%d.%d\",\"%d\",\"CONNECTED\"\r\n",
+                    j % 6, j / 256, j % 256, 1024 + j);
+        appendf(t, "\r\nOK\r\n");
+    }
+    finish(t);
+}
+
+static void build_rawdata(struct transcript *t)
+{
+    t->name = "rawdata";
+    for (int i=0; i<64; i++) {
+        begin(t, true, false, true);
+        appendf(t, "\r\n+RAWDATA: %d\r\n", DATA_BLOCK);
+        for (int j=0; j<DATA_BLOCK; j++) {
+            char c = (char) (i * 31 + j);
+            append(t, &c, 1);
+        }
+        appendf(t, "\r\nOK\r\n");
+    }
+    finish(t);
+}
+
+static void build_hexdata(struct transcript *t)
+{
+    t->name = "hexdata";
+    for (int i=0; i<64; i++) {
+        begin(t, true, false, true);
+        appendf(t, "\r\n+HEXDATA: %d\r\n", DATA_BLOCK);
+        for (int j=0; j<DATA_BLOCK; j++)
+            appendf(t, "%02X", (unsigned char) (i * 31 + j));
+        appendf(t, "\r\nOK\r\n");
+    }
+    finish(t);
+}
+
+static void build_dataprompt(struct transcript *t)
+{
+    t->name = "dataprompt";
+    for (int i=0; i<1024; i++) {
+        begin(t, true, true, false);
+        appendf(t, "\r\n> ");
+        begin(t, true, false, false);
+        appendf(t, "\r\nDATA ACCEPT:%d,%d\r\n", i % 6, DATA_BLOCK);
+    }
+    finish(t);
+}
+
+static bool is_final(const char *line, size_t len)
+{
+    static const char *const finals[] = {
+        "OK", "ERROR", "NO CARRIER", "+CME ERROR:", "+CMS ERROR:", "SEND OK", "SHUT OK", NULL
+    };
+
+    for (const char *const *final=finals; *final; final++) {
+        size_t flen = strlen(*final);
+        if (len >= flen && !memcmp(line, *final, flen))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Recordings (see attentive/record.h) need no guessing: exchanges start at
+ * the recorded commands.
+ */
+static int load_recording(struct transcript *t, const char *path)
+{
+    struct at_replay *replay = at_replay_alloc(path);
+    if (!replay)
+        return -1;
+
+    t->name = path;
+    begin(t, false, false, false);
+
+    struct at_record_entry entry;
+    int result;
+    while ((result = at_replay_next(replay, &entry)) == 1) {
+        if (entry.type == AT_RECORD_COMMAND)
+            begin(t, true, false, false);
+        else if (entry.type == AT_RECORD_INPUT)
+            append(t, entry.data, entry.len);
+    }
+    at_replay_free(replay);
+    finish(t);
+
+    return result;
+}
+
+static int load_transcript(struct transcript *t, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+
+    t->name = path;
+    begin(t, true, false, false);
+
+    char buf[4096];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+        append(t, buf, len);
+    fclose(f);
+
+    /* Split into exchanges at final responses. */
+    for (size_t start=0, i=0; i<t->len; i++) {
+        if (t->data[i] != '\n')
+            continue;
+
+        size_t end = i;
+        while (end > start && (t->data[end-1] == '\r' || t->data[end-1] == '\n'))
+            end--;
+        if (is_final(t->data + start, end - start) && i+1 < t->len) {
+            begin(t, true, false, false);
+            t->exchanges[t->count-1].offset = i+1;
+        }
+        start = i+1;
+    }
+    finish(t);
+
+    return 0;
+}
+
+static enum at_response_type scan_line(const char *line, size_t len, void *priv)
+{
+    (void) len;
+    (void) priv;
+
+    if (!strncmp(line, "+RAWDATA: ", 10))
+        return AT_RESPONSE_RAWDATA_FOLLOWS(atoi(line + 10));
+    if (!strncmp(line, "+HEXDATA: ", 10))
+        return AT_RESPONSE_HEXDATA_FOLLOWS(atoi(line + 10));
+    if (!strncmp(line, "DATA ACCEPT:", 12))
+        return AT_RESPONSE_FINAL;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static size_t responses, urcs;
+
+static void handle_response(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+    responses++;
+}
+
+static void handle_urc(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+    urcs++;
+}
+
+static const struct at_parser_callbacks parser_callbacks = {
+    .scan_line = scan_line,
+    .handle_response = handle_response,
+    .handle_urc = handle_urc,
+};
+
+/** Feed the whole transcript once, chunk bytes at a time. */
+static void feed(struct at_parser *parser, const struct transcript *t, size_t chunk)
+{
+    static uint8_t data[DATA_BLOCK];
+
+    for (size_t i=0; i<t->count; i++) {
+        const struct exchange *e = &t->exchanges[i];
+
+        if (e->command) {
+            if (e->dataprompt)
+                at_parser_expect_dataprompt(parser);
+            if (e->data_buffer)
+                at_parser_set_data_buffer(parser, data, sizeof(data));
+            at_parser_await_response(parser);
+        }
+
+        const char *p = t->data + e->offset;
+        for (size_t left=e->len; left > 0; ) {
+            size_t n = (left < chunk ? left : chunk);
+            at_parser_feed(parser, p, n);
+            p += n; left -= n;
+        }
+    }
+}
+
+static void evict(void)
+{
+    static volatile char *junk;
+    if (!junk)
+        junk = malloc(EVICT_SIZE);
+    for (size_t i=0; i<EVICT_SIZE; i+=64)
+        junk[i]++;
+}
+
+static void report(const struct transcript *t, size_t chunk, const char *mode,
+                   double elapsed, size_t passes)
+{
+    double bytes = (double) t->len * passes;
+    double lines = (double) t->lines * passes;
+    fprintf(stderr, "%-12s %5zu %-5s %9.2f MB/s %12.0f lines/s %9.1f ns/line\n",
+            t->name, chunk, mode, bytes / elapsed / 1e6, lines / elapsed, elapsed / lines * 1e9);
+}
+
+static void bench(const struct transcript *t, size_t chunk)
+{
+    struct at_parser *parser = at_parser_alloc(&parser_callbacks, BUFSIZE, NULL);
+    if (!parser) {
+        perror("at_parser_alloc");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Warm: repeat the transcript back to back. */
+    size_t passes = WARM_BYTES / t->len + 1;
+    feed(parser, t, chunk);
+    double start = now();
+    for (size_t i=0; i<passes; i++)
+        feed(parser, t, chunk);
+    report(t, chunk, "warm", now() - start, passes);
+
+    /* Cold: evict caches before every pass, time the passes only. */
+    double elapsed = 0;
+    for (size_t i=0; i<COLD_PASSES; i++) {
+        evict();
+        start = now();
+        feed(parser, t, chunk);
+        elapsed += now() - start;
+    }
+    report(t, chunk, "cold", elapsed, COLD_PASSES);
+
+    at_parser_free(parser);
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t chunks[] = { 1, 64, 4096 };
+    static void (*const builders[])(struct transcript *) = {
+        build_urc_flood,
+        build_multiline,
+        build_rawdata,
+        build_hexdata,
+        build_dataprompt,
+    };
+    size_t nbuilders = sizeof(builders)/sizeof(*builders);
+    size_t count = nbuilders + argc - 1;
+
+    struct transcript *transcripts = calloc(count, sizeof(*transcripts));
+    if (!transcripts)
+        return EXIT_FAILURE;
+    for (size_t i=0; i<nbuilders; i++)
+        builders[i](&transcripts[i]);
+    for (int i=1; i<argc; i++) {
+        struct transcript *t = &transcripts[nbuilders + i-1];
+        if (load_recording(t, argv[i]) && (errno != EPROTO || load_transcript(t, argv[i]))) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    fprintf(stderr, "parser benchmark: %d MB warm, %d cold passes per run\n",
+            WARM_BYTES / (1024 * 1024), COLD_PASSES);
+    fprintf(stderr, "%-12s %5s %-5s %14s %20s %17s\n",
+            "transcript", "chunk", "cache", "throughput", "lines", "latency");
+    for (size_t i=0; i<count; i++)
+        for (size_t j=0; j<sizeof(chunks)/sizeof(*chunks); j++)
+            bench(&transcripts[i], chunks[j]);
+
+    for (size_t i=0; i<count; i++) {
+        free(transcripts[i].data);
+        free(transcripts[i].exchanges);
+    }
+    free(transcripts);
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,197 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Line classification benchmark. Classifies a realistic mix of SIM800 lines
+ * (URC storms at network handover, socket notifications, responses) the way
+ * the SIM800 driver and the generic scanner do: once with linear
+ * at_prefix_in_table() scans and once with compiled prefix matchers.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <attentive/parser.h>
+
+#define ITERATIONS 200000
+
+/* Copy of the SIM800 driver's URC table. */
+static const char *const sim800_urc_responses[] = {
+    "+CIPRXGET: 1,",
+    "+FTPGET: 1,",
+    "+PDP: DEACT",
+    "+SAPBR 1: DEACT",
+    "*PSNWID: ",
+    "*PSUTTZ: ",
+    "+CTZV: ",
+    "DST: ",
+    "+CIEV: ",
+    "RDY",
+    "+CPIN: READY",
+    "Call Ready",
+    "SMS Ready",
+    "NORMAL POWER DOWN",
+    "UNDER-VOLTAGE POWER DOWN",
+    "UNDER-VOLTAGE WARNNING",
+    "OVER-VOLTAGE POWER DOWN",
+    "OVER-VOLTAGE WARNNING",
+    NULL
+};
+
+static const char *const sim800_socket_statuses[] = {
+    "CONNECT OK",
+    "CONNECT FAIL",
+    "ALREADY CONNECT",
+    "CLOSED",
+    NULL
+};
+
+static const char *const generic_responses[] = {
+    "RING",
+    "OK",
+    "ERROR",
+    "NO CARRIER",
+    "+CME ERROR:",
+    "+CMS ERROR:",
+    NULL
+};
+
+/* Previous generic scanner tables. */
+static const char *const urc_responses[] = { "RING", NULL };
+static const char *const final_ok_responses[] = { "OK", NULL };
+static const char *const final_responses[] = {
+    "OK", "ERROR", "NO CARRIER", "+CME ERROR:", "+CMS ERROR:", NULL
+};
+
+/* Lines seen during a handover URC storm followed by a socket read loop. */
+static const char *const lines[] = {
+    "+CIEV: 10,\"26201\",\"Telekom.de\",\"Telekom.de\", 0, 0",
+    "*PSNWID: \"262\",\"01\", \"Telekom.de\", 0, \"Telekom.de\", 0",
+    "*PSUTTZ: 2014,11,3,10,15,41,\"+4\",0",
+    "+CTZV: +4,0",
+    "DST: 0",
+    "+CIEV: 10,\"26201\",\"Telekom.de\",\"Telekom.de\", 0, 0",
+    "+CIPRXGET: 1,0",
+    "+CIPRXGET: 2,0,128,0",
+    "OK",
+    "+CIPRXGET: 1,1",
+    "1, CONNECT OK",
+    "+CSQ: 21,0",
+    "OK",
+    "+CREG: 0,1",
+    "OK",
+    "+CIPACK: 1024,1024,0",
+    "OK",
+    "DATA ACCEPT:1,128",
+    "2, CLOSED",
+    "+CME ERROR: operation not allowed",
+    "+PDP: DEACT",
+    "SHUT OK",
+    "+CIPRXGET: 1,2",
+    "RING",
+    NULL
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int classify_linear(const char *line)
+{
+    if (at_prefix_in_table(line, sim800_urc_responses))
+        return 1;
+
+    if (line[0] >= '0' && line[0] < '6' && !strncmp(line+1, ", ", 2)) {
+        if (!strcmp(line+3, "CONNECT OK"))
+            return 2;
+        if (!strcmp(line+3, "CONNECT FAIL") ||
+            !strcmp(line+3, "ALREADY CONNECT") ||
+            !strcmp(line+3, "CLOSED"))
+            return 3;
+    }
+
+    if (at_prefix_in_table(line, urc_responses))
+        return 4;
+    else if (at_prefix_in_table(line, final_ok_responses))
+        return 5;
+    else if (at_prefix_in_table(line, final_responses))
+        return 6;
+    else
+        return 7;
+}
+
+static struct at_prefix_matcher *urc_matcher, *status_matcher, *generic_matcher;
+
+static int classify_compiled(const char *line)
+{
+    static const int generic_types[] = { 4, 5, 6, 6, 6, 6 };
+
+    if (at_prefix_matcher_find(urc_matcher, line) != -1)
+        return 1;
+
+    if (line[0] >= '0' && line[0] < '6' && !strncmp(line+1, ", ", 2)) {
+        int status = at_prefix_matcher_find(status_matcher, line+3);
+        if (status != -1 && line[3+strlen(sim800_socket_statuses[status])] == '\0')
+            return status == 0 ? 2 : 3;
+    }
+
+    int match = at_prefix_matcher_find(generic_matcher, line);
+    return match != -1 ? generic_types[match] : 7;
+}
+
+static double bench(int (*classify)(const char *), unsigned long *checksum)
+{
+    double start = now();
+    for (int i=0; i<ITERATIONS; i++)
+        for (const char *const *line=lines; *line; line++)
+            *checksum += classify(*line);
+    return now() - start;
+}
+
+int main()
+{
+    urc_matcher = at_prefix_matcher_alloc(sim800_urc_responses);
+    status_matcher = at_prefix_matcher_alloc(sim800_socket_statuses);
+    generic_matcher = at_prefix_matcher_alloc(generic_responses);
+    if (!urc_matcher || !status_matcher || !generic_matcher)
+        return EXIT_FAILURE;
+
+    size_t nlines = 0;
+    for (const char *const *line=lines; *line; line++, nlines++)
+        if (classify_linear(*line) != classify_compiled(*line)) {
+            fprintf(stderr, "classification mismatch: %s\n", *line);
+            return EXIT_FAILURE;
+        }
+
+    unsigned long linear_sum = 0, compiled_sum = 0;
+    double linear = bench(classify_linear, &linear_sum);
+    double compiled = bench(classify_compiled, &compiled_sum);
+    if (linear_sum != compiled_sum)
+        return EXIT_FAILURE;
+
+    double total = (double) nlines * ITERATIONS;
+    fprintf(stderr, "prefix matching benchmark: %zu-line SIM800 mix, %d iterations\n",
+            nlines, ITERATIONS);
+    fprintf(stderr, "linear   %8.1f ns/line\n", linear / total * 1e9);
+    fprintf(stderr, "compiled %8.1f ns/line   (%.1fx)\n", compiled / total * 1e9, linear / compiled);
+
+    at_prefix_matcher_free(urc_matcher);
+    at_prefix_matcher_free(status_matcher);
+    at_prefix_matcher_free(generic_matcher);
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,386 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Reactor scaling benchmark. Simulates a bank of modems on pty pairs and
+ * drives it first with one reader thread per channel, then with a reactor
+ * (one loop per CPU), for a few bank sizes:
+ *
+ * - commands: one caller thread per CPU cycles through its share of the bank
+ *   sending AT and waiting for OK,
+ * - async: the main thread alone keeps every modem busy; each completion
+ *   handler queues the next AT with at_command_async,
+ * - coro: one coroutine per modem sends AT in a loop, on one scheduler
+ *   thread per CPU (see attentive/coro.h),
+ * - urcs: every modem reports URC_ROUNDS unsolicited lines at once.
+ *
+ * Besides throughput it reports the process thread count and the context
+ * switches per line, which is what a bank of mostly idle modems costs.
+ * Linux only (epoll, /proc/self/status).
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <attentive/at-unix.h>
+#include <attentive/coro.h>
+
+#define BENCH_SECONDS 1
+#define URC_ROUNDS 100
+
+static const size_t bank_sizes[] = { 8, 64, 200 };
+
+static const char urc_line[] = "+CREG: 1\r\n";
+static const char ok_line[] = "\r\nOK\r\n";
+
+struct bench_modem {
+    int master;
+    char path[64];
+    struct at *at;
+};
+
+struct bench_bank {
+    size_t count;
+    struct bench_modem *modems;
+    int epfd;               /**< Simulator side: all pty masters. */
+    int stopfd;
+    pthread_t simulator;
+};
+
+struct bench_caller {
+    struct bench_bank *bank;
+    size_t first;
+    size_t step;
+    unsigned long commands;
+    unsigned long failures;
+};
+
+struct bench_coro {
+    struct at *at;
+    unsigned long commands;
+};
+
+static volatile bool stop;
+static unsigned long urcs_seen;
+static unsigned long async_done;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long context_switches(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+static int thread_count(void)
+{
+    int threads = 0;
+    char line[128];
+
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "Threads: %d", &threads) == 1)
+            break;
+    fclose(f);
+
+    return threads;
+}
+
+static int pty_open(struct bench_modem *modem)
+{
+    modem->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (modem->master == -1 || grantpt(modem->master) || unlockpt(modem->master))
+        return -1;
+    snprintf(modem->path, sizeof(modem->path), "%s", ptsname(modem->master));
+
+    /* Raw mode sticks as long as the channel keeps the slave open. */
+    int slave = open(modem->path, O_RDWR | O_NOCTTY);
+    if (slave == -1)
+        return -1;
+    struct termios attr;
+    tcgetattr(slave, &attr);
+    cfmakeraw(&attr);
+    tcsetattr(slave, TCSANOW, &attr);
+
+    modem->at = NULL;
+    return slave;
+}
+
+/**
+ * Modem side: answers every command line on every pty with OK.
+ */
+static void *simulator_thread(void *arg)
+{
+    struct bench_bank *bank = arg;
+    struct epoll_event events[64];
+    char buf[256];
+
+    while (true) {
+        int count = epoll_wait(bank->epfd, events, 64, -1);
+        for (int i=0; i<count; i++) {
+            struct bench_modem *modem = events[i].data.ptr;
+            if (!modem)
+                return NULL;
+
+            ssize_t len = read(modem->master, buf, sizeof(buf));
+            for (ssize_t j=0; j<len; j++)
+                if (buf[j] == '\r' && write(modem->master, ok_line, strlen(ok_line)) < 0)
+                    break;
+        }
+    }
+}
+
+static void handle_urc(const char *line, size_t len, void *arg)
+{
+    (void) line;
+    (void) len;
+    (void) arg;
+    __atomic_add_fetch(&urcs_seen, 1, __ATOMIC_RELAXED);
+}
+
+static const struct at_callbacks at_callbacks = {
+    .handle_urc = handle_urc,
+};
+
+static void bank_open(struct bench_bank *bank, size_t count, struct at_reactor *reactor)
+{
+    struct at_unix_config config = { .reactor = reactor };
+
+    bank->count = count;
+    bank->modems = calloc(count, sizeof(struct bench_modem));
+    bank->epfd = epoll_create1(0);
+    bank->stopfd = eventfd(0, 0);
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(bank->epfd, EPOLL_CTL_ADD, bank->stopfd, &event);
+
+    for (size_t i=0; i<count; i++) {
+        struct bench_modem *modem = &bank->modems[i];
+        int slave = pty_open(modem);
+        if (slave == -1) {
+            perror("pty");
+            exit(1);
+        }
+
+        modem->at = at_alloc_unix_config(modem->path, 0, &config);
+        if (!modem->at || at_open(modem->at)) {
+            perror("at_open");
+            exit(1);
+        }
+        at_set_callbacks(modem->at, &at_callbacks, NULL);
+        at_set_timeout(modem->at, 5);
+        close(slave);
+
+        event.data.ptr = modem;
+        epoll_ctl(bank->epfd, EPOLL_CTL_ADD, modem->master, &event);
+    }
+
+    pthread_create(&bank->simulator, NULL, simulator_thread, bank);
+}
+
+static void bank_close(struct bench_bank *bank)
+{
+    eventfd_write(bank->stopfd, 1);
+    pthread_join(bank->simulator, NULL);
+
+    for (size_t i=0; i<bank->count; i++) {
+        at_free(bank->modems[i].at);
+        close(bank->modems[i].master);
+    }
+    close(bank->stopfd);
+    close(bank->epfd);
+    free(bank->modems);
+}
+
+static void *caller_thread(void *arg)
+{
+    struct bench_caller *caller = arg;
+    struct bench_bank *bank = caller->bank;
+
+    while (!stop) {
+        for (size_t i=caller->first; i<bank->count && !stop; i+=caller->step) {
+            if (at_command(bank->modems[i].at, "AT"))
+                caller->commands++;
+            else
+                caller->failures++;
+        }
+    }
+
+    return NULL;
+}
+
+static void handle_async(const char *response, int status, void *arg)
+{
+    struct at *at = arg;
+
+    if (response && !status)
+        __atomic_add_fetch(&async_done, 1, __ATOMIC_RELAXED);
+    if (!stop)
+        at_command_async(at, handle_async, at, "AT");
+}
+
+static void coro_caller(void *arg)
+{
+    struct bench_coro *coro = arg;
+
+    while (!stop)
+        if (at_command(coro->at, "AT"))
+            coro->commands++;
+}
+
+static void *scheduler_thread(void *arg)
+{
+    at_coro_sched_run(arg);
+    return NULL;
+}
+
+static void bench_bank(const char *name, size_t count, struct at_reactor *reactor, int cpus)
+{
+    struct bench_bank bank;
+    bank_open(&bank, count, reactor);
+    int threads = thread_count();
+
+    /* Commands: one caller per CPU, each with its share of the bank. */
+    size_t ncallers = ((size_t) cpus < count ? (size_t) cpus : count);
+    struct bench_caller callers[ncallers];
+    pthread_t caller_threads[ncallers];
+
+    stop = false;
+    long switches = context_switches();
+    double start = now();
+    for (size_t i=0; i<ncallers; i++) {
+        callers[i] = (struct bench_caller) { .bank = &bank, .first = i, .step = ncallers };
+        pthread_create(&caller_threads[i], NULL, caller_thread, &callers[i]);
+    }
+    sleep(BENCH_SECONDS);
+    stop = true;
+
+    unsigned long commands = 0, failures = 0;
+    for (size_t i=0; i<ncallers; i++) {
+        pthread_join(caller_threads[i], NULL);
+        commands += callers[i].commands;
+        failures += callers[i].failures;
+    }
+    double command_time = now() - start;
+    long command_switches = context_switches() - switches;
+
+    /* Async: no caller threads at all. */
+    stop = false;
+    __atomic_store_n(&async_done, 0, __ATOMIC_RELAXED);
+    start = now();
+    for (size_t i=0; i<count; i++)
+        at_command_async(bank.modems[i].at, handle_async, bank.modems[i].at, "AT");
+    sleep(BENCH_SECONDS);
+    stop = true;
+    for (size_t i=0; i<count; i++)
+        at_command_drain(bank.modems[i].at);
+    double async_time = now() - start;
+    unsigned long async_commands = __atomic_load_n(&async_done, __ATOMIC_RELAXED);
+
+    /* Coroutines: one per modem, a scheduler thread per CPU. */
+    struct bench_coro *coros = calloc(count, sizeof(struct bench_coro));
+    struct at_coro_sched *scheds[cpus];
+    pthread_t sched_threads[cpus];
+    stop = false;
+    for (int i=0; i<cpus; i++)
+        scheds[i] = at_coro_sched_alloc(0);
+    for (size_t i=0; i<count; i++) {
+        coros[i].at = bank.modems[i].at;
+        at_coro_spawn(scheds[i % cpus], coro_caller, &coros[i]);
+    }
+    start = now();
+    for (int i=0; i<cpus; i++)
+        pthread_create(&sched_threads[i], NULL, scheduler_thread, scheds[i]);
+    sleep(BENCH_SECONDS);
+    int coro_threads = thread_count();
+    stop = true;
+    unsigned long coro_commands = 0;
+    for (int i=0; i<cpus; i++) {
+        pthread_join(sched_threads[i], NULL);
+        at_coro_sched_free(scheds[i]);
+    }
+    double coro_time = now() - start;
+    for (size_t i=0; i<count; i++)
+        coro_commands += coros[i].commands;
+    free(coros);
+
+    /* URCs: every modem speaks up at once. */
+    unsigned long urcs = count * URC_ROUNDS;
+    __atomic_store_n(&urcs_seen, 0, __ATOMIC_RELAXED);
+    switches = context_switches();
+    start = now();
+    for (int round=0; round<URC_ROUNDS; round++)
+        for (size_t i=0; i<count; i++)
+            if (write(bank.modems[i].master, urc_line, strlen(urc_line)) < 0)
+                urcs--;
+    while (__atomic_load_n(&urcs_seen, __ATOMIC_RELAXED) < urcs && now() - start < 10)
+        usleep(100);
+    double urc_time = now() - start;
+    long urc_switches = context_switches() - switches;
+
+    fprintf(stderr, "%-8s %4zu modems %4d threads | %8.0f cmd/s %8.1f us/cmd %6.2f csw/cmd%s"
+                    " | %8.0f async/s | %8.0f coro/s %4d threads | %9.0f urc/s %6.2f csw/urc\n",
+            name, count, threads,
+            commands / command_time, command_time * ncallers / (commands ? commands : 1) * 1e6,
+            (double) command_switches / (commands ? commands : 1),
+            failures ? " (failures)" : "",
+            async_commands / async_time,
+            coro_commands / coro_time, coro_threads,
+            urcs / urc_time, (double) urc_switches / urcs);
+
+    bank_close(&bank);
+}
+
+int main()
+{
+    /* Keep channel logging out of the measurement. */
+    if (!freopen("/dev/null", "w", stdout))
+        return EXIT_FAILURE;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        cpus = 1;
+
+    struct at_reactor *reactor = at_reactor_alloc(0);
+    if (!reactor) {
+        perror("at_reactor_alloc");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "reactor benchmark: %ld CPUs, %d s of commands, %d URCs per modem\n",
+            cpus, BENCH_SECONDS, URC_ROUNDS);
+    for (size_t i=0; i<sizeof(bank_sizes)/sizeof(*bank_sizes); i++) {
+        bench_bank("threads", bank_sizes[i], NULL, cpus);
+        bench_bank("reactor", bank_sizes[i], reactor, cpus);
+    }
+
+    at_reactor_free(reactor);
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */
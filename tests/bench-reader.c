@@ -0,0 +1,297 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Reader thread benchmark. Pushes a URC flood through a pty pair and measures
+ * the receive path in three configurations:
+ *
+ * - bytewise: the historical reader loop (one read() per byte, two mutex
+ *   round trips per byte),
+ * - chunked: the same loop reading AT_READ_CHUNK bytes at a time,
+ * - at_unix: the real at_reader_thread, end to end,
+ * - loopback: the same over an in-memory transport instead of a pty.
+ *
+ * read() syscalls are counted via /proc/self/io (syscr), so the figures are
+ * only available on Linux.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <attentive/at-unix.h>
+
+#define BENCH_BYTES (4 * 1024 * 1024)
+#define READ_CHUNK 4096
+
+static const char urc_line[] = "+CIPRXGET: 1,0\r\n";
+
+struct bench_pty {
+    int master;
+    int slave;
+    char path[64];
+};
+
+struct bench_writer {
+    int fd;
+    size_t total;
+};
+
+static volatile size_t lines_seen;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long read_syscalls(void)
+{
+    unsigned long syscr = 0;
+    char key[32];
+    unsigned long value;
+
+    FILE *f = fopen("/proc/self/io", "r");
+    if (!f)
+        return 0;
+    while (fscanf(f, "%31[^:]: %lu\n", key, &value) == 2)
+        if (!strcmp(key, "syscr"))
+            syscr = value;
+    fclose(f);
+
+    return syscr;
+}
+
+static int pty_open(struct bench_pty *pty)
+{
+    pty->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pty->master == -1 || grantpt(pty->master) || unlockpt(pty->master))
+        return -1;
+    snprintf(pty->path, sizeof(pty->path), "%s", ptsname(pty->master));
+
+    /* Keep a slave descriptor open so the raw settings stick. */
+    pty->slave = open(pty->path, O_RDWR | O_NOCTTY);
+    if (pty->slave == -1)
+        return -1;
+    struct termios attr;
+    tcgetattr(pty->slave, &attr);
+    cfmakeraw(&attr);
+    tcsetattr(pty->slave, TCSANOW, &attr);
+
+    return 0;
+}
+
+static void pty_close(struct bench_pty *pty)
+{
+    close(pty->slave);
+    close(pty->master);
+}
+
+static void *writer_thread(void *arg)
+{
+    struct bench_writer *writer = arg;
+    static char block[READ_CHUNK];
+    size_t line = strlen(urc_line);
+
+    for (size_t i=0; i+line <= sizeof(block); i += line)
+        memcpy(block + i, urc_line, line);
+
+    size_t block_len = sizeof(block) - sizeof(block) % line;
+    for (size_t sent=0; sent < writer->total; sent += block_len)
+        if (write(writer->fd, block, block_len) != (ssize_t) block_len)
+            break;
+
+    return NULL;
+}
+
+static void handle_response(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+}
+
+static void handle_urc(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+    lines_seen++;
+}
+
+static const struct at_parser_callbacks parser_callbacks = {
+    .handle_response = handle_response,
+    .handle_urc = handle_urc,
+};
+
+static void report(const char *name, size_t bytes, double elapsed, unsigned long reads)
+{
+    fprintf(stderr, "%-10s %10.2f MB/s %12.0f bytes/s %10.4f reads/byte\n",
+            name, bytes / elapsed / 1e6, bytes / elapsed, (double) reads / bytes);
+}
+
+static size_t expected_bytes(void)
+{
+    size_t line = strlen(urc_line);
+    size_t block_len = READ_CHUNK - READ_CHUNK % line;
+    return (BENCH_BYTES + block_len - 1) / block_len * block_len;
+}
+
+/**
+ * Emulates the reader loop on a raw fd. chunk == 1 reproduces the historical
+ * one-byte-per-read loop, including its two lock round trips per read.
+ */
+static void bench_loop(const char *name, size_t chunk)
+{
+    struct bench_pty pty;
+    if (pty_open(&pty)) {
+        perror("pty");
+        exit(1);
+    }
+
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct at_parser *parser = at_parser_alloc(&parser_callbacks, 256, NULL);
+    struct bench_writer writer = { .fd = pty.master, .total = BENCH_BYTES };
+    size_t total = expected_bytes();
+    char buf[READ_CHUNK];
+    pthread_t thread;
+
+    unsigned long reads = read_syscalls();
+    double start = now();
+    pthread_create(&thread, NULL, writer_thread, &writer);
+
+    for (size_t received=0; received < total; ) {
+        ssize_t result = read(pty.slave, buf, chunk);
+        if (result <= 0)
+            break;
+
+        pthread_mutex_lock(&mutex);
+        if (chunk == 1) {
+            /* Old loop: busy flag handoff, then a separate feed section. */
+            pthread_mutex_unlock(&mutex);
+            pthread_mutex_lock(&mutex);
+        }
+        at_parser_feed(parser, buf, result);
+        pthread_mutex_unlock(&mutex);
+
+        received += result;
+    }
+
+    double elapsed = now() - start;
+    reads = read_syscalls() - reads;
+    pthread_join(thread, NULL);
+
+    report(name, total, elapsed, reads);
+
+    at_parser_free(parser);
+    pty_close(&pty);
+}
+
+static const struct at_callbacks at_callbacks = {
+    .handle_urc = handle_urc,
+};
+
+static void bench_at_unix(void)
+{
+    struct bench_pty pty;
+    if (pty_open(&pty)) {
+        perror("pty");
+        exit(1);
+    }
+
+    struct at *at = at_alloc_unix(pty.path, 0);
+    at_set_callbacks(at, &at_callbacks, NULL);
+    if (at_open(at)) {
+        perror("at_open");
+        exit(1);
+    }
+
+    struct bench_writer writer = { .fd = pty.master, .total = BENCH_BYTES };
+    size_t lines = expected_bytes() / strlen(urc_line);
+    pthread_t thread;
+
+    lines_seen = 0;
+    unsigned long reads = read_syscalls();
+    double start = now();
+    pthread_create(&thread, NULL, writer_thread, &writer);
+
+    while (lines_seen < lines)
+        usleep(100);
+
+    double elapsed = now() - start;
+    reads = read_syscalls() - reads;
+    pthread_join(thread, NULL);
+
+    report("at_unix", expected_bytes(), elapsed, reads);
+
+    at_free(at);
+    pty_close(&pty);
+}
+
+static void bench_loopback(void)
+{
+    struct at_transport *transport = at_transport_loopback_alloc();
+    if (!transport) {
+        perror("at_transport_loopback_alloc");
+        exit(1);
+    }
+
+    struct at_unix_config config = { .transport = transport };
+    struct at *at = at_alloc_unix_config(NULL, 0, &config);
+    at_set_callbacks(at, &at_callbacks, NULL);
+    if (at_open(at)) {
+        perror("at_open");
+        exit(1);
+    }
+
+    struct bench_writer writer = { .fd = at_transport_loopback_peer(transport), .total = BENCH_BYTES };
+    size_t lines = expected_bytes() / strlen(urc_line);
+    pthread_t thread;
+
+    lines_seen = 0;
+    unsigned long reads = read_syscalls();
+    double start = now();
+    pthread_create(&thread, NULL, writer_thread, &writer);
+
+    while (lines_seen < lines)
+        usleep(100);
+
+    double elapsed = now() - start;
+    reads = read_syscalls() - reads;
+    pthread_join(thread, NULL);
+
+    report("loopback", expected_bytes(), elapsed, reads);
+
+    at_free(at);
+    at_transport_free(transport);
+}
+
+int main()
+{
+    /* Keep parser logging out of the measurement. */
+    if (!freopen("/dev/null", "w", stdout))
+        return EXIT_FAILURE;
+
+    fprintf(stderr, "reader benchmark: %d bytes of URC lines over a pty\n", BENCH_BYTES);
+    bench_loop("bytewise", 1);
+    bench_loop("chunked", READ_CHUNK);
+    bench_at_unix();
+    bench_loopback();
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */
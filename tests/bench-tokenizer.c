@@ -0,0 +1,247 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Response parsing benchmark. Parses the responses the SIM800 and Telit
+ * drivers poll for, once with the sscanf formats the drivers used to have and
+ * once with the tokenizer, and checks that both agree.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <attentive/tokenizer.h>
+
+#define ITERATIONS 200000
+
+struct format {
+    const char *response;
+    int (*scan)(const char *response);
+    int (*tokenize)(const char *response);
+};
+
+static int scan_creg(const char *response)
+{
+    int creg;
+    return sscanf(response, "+CREG: %*d,%d", &creg) == 1 ? creg : -1;
+}
+
+static int tokenize_creg(const char *response)
+{
+    struct at_tok tok;
+    at_tok_init(&tok, response);
+    at_tok_expect(&tok, "+CREG: ");
+    at_tok_skip(&tok);
+    int creg = at_tok_int(&tok);
+    return tok.error ? -1 : creg;
+}
+
+static int scan_csq(const char *response)
+{
+    int rssi;
+    return sscanf(response, "+CSQ: %d,%*d", &rssi) == 1 ? rssi : -1;
+}
+
+static int tokenize_csq(const char *response)
+{
+    struct at_tok tok;
+    at_tok_init(&tok, response);
+    at_tok_expect(&tok, "+CSQ: ");
+    int rssi = at_tok_int(&tok);
+    return tok.error ? -1 : rssi;
+}
+
+static int scan_ciprxget(const char *response)
+{
+    int requested, confirmed;
+    if (sscanf(response, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed) != 2)
+        return -1;
+    return requested + confirmed;
+}
+
+static int tokenize_ciprxget(const char *response)
+{
+    struct at_tok tok;
+    at_tok_init(&tok, response);
+    at_tok_expect(&tok, "+CIPRXGET: 2,");
+    at_tok_skip(&tok);
+    int requested = at_tok_int(&tok);
+    int confirmed = at_tok_int(&tok);
+    return tok.error ? -1 : requested + confirmed;
+}
+
+static int scan_cipack(const char *response)
+{
+    int nacklen;
+    return sscanf(response, "+CIPACK: %*d,%*d,%d", &nacklen) == 1 ? nacklen : -1;
+}
+
+static int tokenize_cipack(const char *response)
+{
+    struct at_tok tok;
+    at_tok_init(&tok, response);
+    at_tok_expect(&tok, "+CIPACK: ");
+    at_tok_skip(&tok);
+    at_tok_skip(&tok);
+    int nacklen = at_tok_int(&tok);
+    return tok.error ? -1 : nacklen;
+}
+
+static int scan_si(const char *response)
+{
+    int ack_waiting;
+    return sscanf(response, "#SI: %*d,%*d,%*d,%*d,%d", &ack_waiting) == 1 ? ack_waiting : -1;
+}
+
+static int tokenize_si(const char *response)
+{
+    struct at_tok tok;
+    at_tok_init(&tok, response);
+    at_tok_expect(&tok, "#SI: ");
+    for (int i=0; i<4; i++)
+        at_tok_skip(&tok);
+    int ack_waiting = at_tok_int(&tok);
+    return tok.error ? -1 : ack_waiting;
+}
+
+static int scan_sgact(const char *response)
+{
+    int ip[4];
+    if (sscanf(response, "#SGACT: %d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3]) != 4)
+        return -1;
+    return ip[0] + ip[1] + ip[2] + ip[3];
+}
+
+static int tokenize_sgact(const char *response)
+{
+    struct at_tok tok;
+    at_tok_init(&tok, response);
+    at_tok_expect(&tok, "#SGACT: ");
+    int sum = 0;
+    for (int i=0; i<4; i++) {
+        if (i > 0)
+            at_tok_expect(&tok, ".");
+        sum += at_tok_int(&tok);
+    }
+    return tok.error ? -1 : sum;
+}
+
+static int scan_cclk(const char *response)
+{
+    int year, mon, mday, hour, min, sec, offset;
+    if (sscanf(response, "+CCLK: \"%d/%d/%d,%d:%d:%d%d\"",
+               &year, &mon, &mday, &hour, &min, &sec, &offset) != 7)
+        return -1;
+    return year + mon + mday + hour + min + sec + offset;
+}
+
+static int tokenize_cclk(const char *response)
+{
+    struct at_tok tok;
+    at_tok_init(&tok, response);
+    at_tok_expect(&tok, "+CCLK: \"");
+    int sum = at_tok_int(&tok);
+    at_tok_expect(&tok, "/");
+    sum += at_tok_int(&tok);
+    at_tok_expect(&tok, "/");
+    sum += at_tok_int(&tok);
+    sum += at_tok_int(&tok);
+    at_tok_expect(&tok, ":");
+    sum += at_tok_int(&tok);
+    at_tok_expect(&tok, ":");
+    sum += at_tok_int(&tok);
+    sum += at_tok_int(&tok);
+    return tok.error ? -1 : sum;
+}
+
+static int scan_ccid(const char *response)
+{
+    char iccid[24];
+    if (sscanf(response, "#CCID: %23[0-9]", iccid) != 1)
+        return -1;
+    return (int) strlen(iccid);
+}
+
+static int tokenize_ccid(const char *response)
+{
+    char iccid[24];
+    struct at_tok tok;
+    at_tok_init(&tok, response);
+    at_tok_expect(&tok, "#CCID: ");
+    size_t len = at_tok_digits(&tok, iccid, sizeof(iccid));
+    return tok.error ? -1 : (int) len;
+}
+
+static const struct format formats[] = {
+    { "+CREG: 0,1", scan_creg, tokenize_creg },
+    { "+CSQ: 21,0", scan_csq, tokenize_csq },
+    { "+CIPRXGET: 2,0,1460,0", scan_ciprxget, tokenize_ciprxget },
+    { "+CIPACK: 1024,1024,0", scan_cipack, tokenize_cipack },
+    { "#SI: 1,123,456,789,0", scan_si, tokenize_si },
+    { "#SGACT: 10.170.23.112", scan_sgact, tokenize_sgact },
+    { "+CCLK: \"14/11/03,10:15:41+04\"", scan_cclk, tokenize_cclk },
+    { "#CCID: 8949022111111111111", scan_ccid, tokenize_ccid },
+    { NULL, NULL, NULL }
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(const struct format *format, bool tokenize, unsigned long *checksum)
+{
+    int (*parse)(const char *) = tokenize ? format->tokenize : format->scan;
+
+    double start = now();
+    for (int i=0; i<ITERATIONS; i++) {
+        /* Keep the compiler from hoisting the call out of the loop. */
+        const char *response = format->response;
+        __asm__ volatile ("" : "+r" (response));
+        *checksum += parse(response);
+    }
+    return now() - start;
+}
+
+int main()
+{
+    for (const struct format *format=formats; format->response; format++)
+        if (format->scan(format->response) == -1 ||
+            format->scan(format->response) != format->tokenize(format->response)) {
+            fprintf(stderr, "parse mismatch: %s\n", format->response);
+            return EXIT_FAILURE;
+        }
+
+    fprintf(stderr, "response parsing benchmark: %d iterations\n", ITERATIONS);
+    fprintf(stderr, "%-34s %10s %10s\n", "response", "sscanf", "tokenizer");
+
+    double scan_total = 0, tokenize_total = 0;
+    unsigned long scan_sum = 0, tokenize_sum = 0;
+    for (const struct format *format=formats; format->response; format++) {
+        double scan = bench(format, false, &scan_sum);
+        double tokenize = bench(format, true, &tokenize_sum);
+        scan_total += scan;
+        tokenize_total += tokenize;
+        fprintf(stderr, "%-34s %7.1f ns %7.1f ns   (%.1fx)\n", format->response,
+                scan / ITERATIONS * 1e9, tokenize / ITERATIONS * 1e9, scan / tokenize);
+    }
+    if (scan_sum != tokenize_sum)
+        return EXIT_FAILURE;
+
+    fprintf(stderr, "%-34s %10s %10s   (%.1fx)\n", "total", "", "", scan_total / tokenize_total);
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */
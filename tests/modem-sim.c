@@ -0,0 +1,1367 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Modem simulator. Opens a pty and answers on it like a SIM800 or a Telit
+ * modem would, as far as the sim800 and telit2 drivers can tell: the basic
+ * 27.007 commands, the PDP context, TCP sockets and FTP downloads. SIM800
+ * quirks are reproduced (OK in the middle of AT+CIPSTATUS, "SHUT OK", no
+ * final OK after AT+CIFSR, "n, CONNECT OK" URCs, silence after AT&K0).
+ *
+ * The remote end of every socket is an echo server which can also send some
+ * data of its own right after connecting; FTP downloads are files of a given
+ * size. Payloads are a repeating a-z pattern.
+ *
+ * Timing is configurable, so driver throughput and time to connect can be
+ * measured reproducibly without hardware:
+ *
+ *   modem-sim -m telit -l /tmp/modem -t 20 -L 'AT#SD=300' -b 11520 -n 20000
+ *
+ * answers every command after 20 ms (socket connects after 300 ms), sends at
+ * most 11520 bytes/s down the serial line (115200 baud) and lets the network
+ * deliver 20000 bytes/s. Per-command rules can also drop a share of the
+ * responses, to exercise timeouts. Rules can be read from a file, one
+ * "<prefix> <latency ms> [<drop %>]" per line.
+ *
+ * The pty path is printed on stdout. Runs until interrupted.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_LINE_LENGTH 256
+#define SIM_RULES       32
+#define SIM_SETTINGS    32
+#define SIM_NSOCKETS    7       /* SIM800 uses 0-5, Telit 1-6. */
+#define SIM_RXGET_MAX   1460    /* AT+CIPRXGET=2 chunk limit. */
+#define SIM_SRECV_MAX   1500    /* AT#SRECV chunk limit. */
+
+enum sim_model {
+    SIM_SIM800,
+    SIM_TELIT,
+};
+
+/* SIM800 GPRS states, as reported by AT+CIPSTATUS. */
+enum sim_ip_state {
+    SIM_IP_INITIAL,
+    SIM_IP_START,
+    SIM_IP_GPRSACT,
+    SIM_IP_STATUS,
+};
+
+static const char *const sim_ip_states[] = {
+    "IP INITIAL",
+    "IP START",
+    "IP GPRSACT",
+    "IP STATUS",
+};
+
+/* Growable output buffer. */
+struct sim_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+/* Latency and response loss of the commands starting with a prefix. */
+struct sim_rule {
+    char prefix[32];
+    int latency_ms;
+    int drop_percent;       /**< -1: use the global setting. */
+};
+
+/* Output due at some point: a response or a URC. */
+struct sim_event {
+    int64_t at;             /**< Monotonic ms. */
+    struct sim_buf out;
+    struct sim_event *next;
+};
+
+/* Value set with AT+X=value, reported by AT+X?. */
+struct sim_setting {
+    char name[24];
+    char value[32];
+};
+
+/* Data stream from the remote end of a socket or an FTP download. */
+struct sim_stream {
+    int64_t since;          /**< Start of the transfer, for the network rate. */
+    uint64_t delivered;     /**< Bytes read by the driver. */
+    size_t pattern_left;    /**< Pattern bytes the server has yet to send. */
+    struct sim_buf echo;    /**< Echoed data, not read yet from echo_pos on. */
+    size_t echo_pos;
+};
+
+struct sim_socket {
+    bool connected;
+    uint64_t sent;          /**< Bytes written by the driver. */
+    struct sim_stream rx;
+};
+
+struct sim;
+
+/**
+ * Command handler.
+ *
+ * @param args Everything after the command prefix.
+ * @param out Response, sent at sim->reply_at.
+ */
+typedef void (*sim_handler_t)(struct sim *sim, const char *args, struct sim_buf *out);
+
+/*
+ * Commands are matched by prefix if it ends with '=', exactly otherwise.
+ */
+struct sim_command {
+    const char *prefix;
+    sim_handler_t handler;
+};
+
+struct sim {
+    enum sim_model model;
+    const struct sim_command *commands;
+    int master;
+
+    /* Settings. */
+    int latency_ms;         /**< Response latency of commands without a rule. */
+    int connect_ms;         /**< Time for sockets, PDP and FTP to connect. */
+    int drop_percent;       /**< Share of responses lost. */
+    long line_rate;         /**< Serial line bytes/s, or 0. */
+    long net_rate;          /**< Network bytes/s per stream, or 0. */
+    long max_baud;          /**< Fastest AT+IPR accepted, or 0 for any. */
+    size_t server_bytes;    /**< Sent by the server right after a connect. */
+    size_t ftp_bytes;       /**< FTP file size. */
+    bool verbose;
+    struct sim_rule rules[SIM_RULES];
+    int nrules;
+
+    /* Serial line state. */
+    bool echo;
+    char line[SIM_LINE_LENGTH];
+    size_t line_len;
+    size_t data_left;       /**< Raw bytes to take before reading lines again. */
+    size_t data_len;        /**< Size of the whole write. */
+    int data_socket;
+    int64_t ready_at;       /**< The last response goes out then. */
+    int64_t reply_at;       /**< Time of the response being prepared. */
+    struct sim_event *events;       /**< Pending output, by time. */
+
+    /* Modem state. */
+    struct sim_setting settings[SIM_SETTINGS];
+    enum sim_ip_state ip_state;
+    bool bearer;            /**< SIM800 AT+SAPBR bearer is open. */
+    struct sim_socket sockets[SIM_NSOCKETS];
+    bool ftp_open;
+    bool ftp_active;
+    char ftp_name[64];
+    struct sim_stream ftp;
+};
+
+static volatile sig_atomic_t sim_stop;
+
+static void sim_signal(int signum)
+{
+    (void) signum;
+    sim_stop = 1;
+}
+
+static int64_t sim_clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (int64_t) 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sim_buf_append(struct sim_buf *buf, const void *data, size_t len)
+{
+    if (buf->len + len > buf->size) {
+        size_t size = (buf->size ? buf->size : 256);
+        while (size < buf->len + len)
+            size *= 2;
+        buf->data = realloc(buf->data, size);
+        if (!buf->data) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        buf->size = size;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void sim_buf_printf(struct sim_buf *buf, const char *format, ...)
+{
+    char text[512];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(text, sizeof(text), format, ap);
+    va_end(ap);
+    if (len > (int) sizeof(text) - 1)
+        len = sizeof(text) - 1;
+    sim_buf_append(buf, text, len);
+}
+
+/* Response line in verbose format: <CR><LF>text<CR><LF>. */
+#define sim_line(buf, ...) sim_buf_printf(buf, "\r\n" __VA_ARGS__), sim_buf_append(buf, "\r\n", 2)
+
+static void sim_ok(struct sim_buf *out)
+{
+    sim_line(out, "OK");
+}
+
+static void sim_error(struct sim_buf *out)
+{
+    sim_line(out, "ERROR");
+}
+
+/**
+ * Queue output. Events due at the same time go out in queueing order.
+ */
+static struct sim_buf *sim_schedule(struct sim *sim, int64_t at)
+{
+    struct sim_event *event = calloc(1, sizeof(struct sim_event));
+    if (!event) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    event->at = at;
+
+    struct sim_event **pos = &sim->events;
+    while (*pos && (*pos)->at <= at)
+        pos = &(*pos)->next;
+    event->next = *pos;
+    *pos = event;
+
+    return &event->out;
+}
+
+/* URC some time after the response being prepared. */
+#define sim_urc(sim, delay_ms, ...) sim_line(sim_schedule(sim, (sim)->reply_at + (delay_ms)), __VA_ARGS__)
+
+/**
+ * Write to the serial line, at the line rate if there is one.
+ */
+static void sim_send(struct sim *sim, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t result = write(sim->master, data, len);
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            return;
+        }
+        data += result;
+        len -= result;
+
+        if (sim->line_rate) {
+            int64_t ns = result * (int64_t) 1000000000 / sim->line_rate;
+            struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+/*
+ * Remote data streams.
+ */
+
+static void sim_stream_start(struct sim_stream *stream, size_t pattern)
+{
+    stream->since = sim_clock_ms();
+    stream->delivered = 0;
+    stream->pattern_left = pattern;
+    stream->echo.len = 0;
+    stream->echo_pos = 0;
+}
+
+static size_t sim_stream_pending(const struct sim_stream *stream)
+{
+    return stream->pattern_left + (stream->echo.len - stream->echo_pos);
+}
+
+/* Bytes that have arrived over the network so far. */
+static size_t sim_stream_available(const struct sim *sim, const struct sim_stream *stream)
+{
+    size_t pending = sim_stream_pending(stream);
+    if (!sim->net_rate)
+        return pending;
+
+    uint64_t arrived = (uint64_t) (sim_clock_ms() - stream->since) * sim->net_rate / 1000;
+    uint64_t room = (arrived > stream->delivered ? arrived - stream->delivered : 0);
+    return (room < pending ? room : pending);
+}
+
+/* Move up to len received bytes to out. */
+static void sim_stream_read(struct sim_stream *stream, size_t len, struct sim_buf *out)
+{
+    stream->delivered += len;
+
+    while (len > 0 && stream->pattern_left > 0) {
+        char byte = 'a' + (stream->delivered - len) % 26;
+        sim_buf_append(out, &byte, 1);
+        stream->pattern_left--;
+        len--;
+    }
+
+    sim_buf_append(out, stream->echo.data + stream->echo_pos, len);
+    stream->echo_pos += len;
+    if (stream->echo_pos == stream->echo.len)
+        stream->echo.len = stream->echo_pos = 0;
+}
+
+/*
+ * Generic commands.
+ */
+
+static struct sim_setting *sim_setting(struct sim *sim, const char *name, bool create)
+{
+    for (int i=0; i<SIM_SETTINGS; i++) {
+        struct sim_setting *setting = &sim->settings[i];
+        if (!strcmp(setting->name, name))
+            return setting;
+        if (!setting->name[0]) {
+            if (!create)
+                return NULL;
+            snprintf(setting->name, sizeof(setting->name), "%s", name);
+            return setting;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * AT+X=value and AT#X=value are accepted and remembered; AT+X? reports the
+ * remembered value. Covers all the configuration commands the drivers use.
+ */
+static void sim_generic(struct sim *sim, const char *line, struct sim_buf *out)
+{
+    char name[24];
+    size_t len = strcspn(line + 2, "=?");
+    if ((line[2] != '+' && line[2] != '#') || len >= sizeof(name) || !line[2+len]) {
+        sim_error(out);
+        return;
+    }
+    memcpy(name, line + 2, len);
+    name[len] = '\0';
+    const char *rest = line + 2 + len;
+
+    if (!strcmp(rest, "?")) {
+        struct sim_setting *setting = sim_setting(sim, name, false);
+        if (!setting) {
+            sim_error(out);
+            return;
+        }
+        sim_line(out, "%s: %s", name, setting->value);
+    } else if (rest[0] == '=' && strcmp(rest, "=?")) {
+        struct sim_setting *setting = sim_setting(sim, name, true);
+        if (setting)
+            snprintf(setting->value, sizeof(setting->value), "%s", rest + 1);
+    }
+    sim_ok(out);
+}
+
+static void sim_at(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) sim;
+    (void) args;
+    sim_ok(out);
+}
+
+/* AT+IPR=<rate>; with a line rate set, the line follows (at 10 bits/byte).
+ * AT+IPR? reports the rate, as for other settings. */
+static void sim_ipr(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    long baud = atol(args);
+    if (baud < 0 || (sim->max_baud && baud > sim->max_baud)) {
+        sim_error(out);
+        return;
+    }
+    if (sim->line_rate && baud)
+        sim->line_rate = baud / 10;
+    struct sim_setting *setting = sim_setting(sim, "+IPR", true);
+    if (setting)
+        snprintf(setting->value, sizeof(setting->value), "%ld", baud);
+    sim_ok(out);
+}
+
+static void sim_echo_off(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    sim->echo = false;
+    sim_ok(out);
+}
+
+static void sim_echo_on(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    sim->echo = true;
+    sim_ok(out);
+}
+
+static void sim_silent(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) sim;
+    (void) args;
+    (void) out;
+}
+
+static void sim_cgsn(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) sim;
+    (void) args;
+    sim_line(out, "866104020000001");
+    sim_ok(out);
+}
+
+static void sim_ccid(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    sim_line(out, "%s8948000000000000001", sim->model == SIM_TELIT ? "#CCID: " : "");
+    sim_ok(out);
+}
+
+static void sim_creg(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) sim;
+    (void) args;
+    sim_line(out, "+CREG: 0,1");
+    sim_ok(out);
+}
+
+static void sim_csq(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) sim;
+    (void) args;
+    sim_line(out, "+CSQ: 20,0");
+    sim_ok(out);
+}
+
+static void sim_cclk(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) sim;
+    (void) args;
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    sim_line(out, "+CCLK: \"%02d/%02d/%02d,%02d:%02d:%02d+00\"",
+             tm.tm_year % 100, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    sim_ok(out);
+}
+
+/**
+ * Socket number, checked against the model's range.
+ *
+ * @returns Socket, or NULL if args don't start with a valid number.
+ */
+static struct sim_socket *sim_socket_arg(struct sim *sim, const char *args, int *connid)
+{
+    char *end;
+    long id = strtol(args, &end, 10);
+    int first = (sim->model == SIM_SIM800 ? 0 : 1);
+    if (end == args || id < first || id >= first + 6)
+        return NULL;
+
+    *connid = id;
+    return &sim->sockets[id];
+}
+
+/* Data for the driver: one URC when there was none waiting. */
+static void sim_socket_notify(struct sim *sim, int connid, int delay_ms)
+{
+    if (sim->model == SIM_SIM800)
+        sim_urc(sim, delay_ms, "+CIPRXGET: 1,%d", connid);
+    else
+        sim_urc(sim, delay_ms, "SRING: %d", connid);
+}
+
+static void sim_socket_connect(struct sim *sim, struct sim_socket *socket)
+{
+    socket->connected = true;
+    socket->sent = 0;
+    sim_stream_start(&socket->rx, sim->server_bytes);
+    /* The transfer starts once the connection is up. */
+    socket->rx.since = sim->reply_at + sim->connect_ms;
+}
+
+static void sim_close_all(struct sim *sim)
+{
+    for (int i=0; i<SIM_NSOCKETS; i++)
+        sim->sockets[i].connected = false;
+    sim->ftp_open = sim->ftp_active = false;
+}
+
+/* Driver data written to a socket: echoed back by the server. */
+static void sim_socket_write(struct sim *sim, int connid, const char *data, size_t len)
+{
+    struct sim_socket *socket = &sim->sockets[connid];
+
+    bool idle = !sim_stream_pending(&socket->rx);
+    socket->sent += len;
+    sim_buf_append(&socket->rx.echo, data, len);
+    if (idle)
+        sim_socket_notify(sim, connid, 0);
+}
+
+/*
+ * SIM800.
+ */
+
+static void sim800_cipstatus(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+
+    /* OK goes first, then the state and one line per connection. */
+    sim_ok(out);
+    sim_line(out, "STATE: %s", sim_ip_states[sim->ip_state]);
+    for (int i=0; i<6; i++) {
+        if (sim->sockets[i].connected)
+            sim_line(out, "C: %d,0,\"TCP\",\"192.0.2.1\",\"80\",\"CONNECTED\"", i);
+        else
+            sim_line(out, "C: %d,,\"\",\"\",\"\",\"INITIAL\"", i);
+    }
+}
+
+static void sim800_cstt(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    if (sim->ip_state != SIM_IP_INITIAL) {
+        sim_error(out);
+        return;
+    }
+    sim->ip_state = SIM_IP_START;
+    sim_ok(out);
+}
+
+static void sim800_ciicr(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    if (sim->ip_state != SIM_IP_START) {
+        sim_error(out);
+        return;
+    }
+    /* Attaching takes a while. */
+    sim->reply_at += sim->connect_ms;
+    sim->ip_state = SIM_IP_GPRSACT;
+    sim_ok(out);
+}
+
+static void sim800_cifsr(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    if (sim->ip_state < SIM_IP_GPRSACT) {
+        sim_error(out);
+        return;
+    }
+    /* Just the address, no OK. */
+    sim->ip_state = SIM_IP_STATUS;
+    sim_line(out, "10.0.0.2");
+}
+
+static void sim800_cipshut(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    sim->ip_state = SIM_IP_INITIAL;
+    sim_close_all(sim);
+    sim_line(out, "SHUT OK");
+}
+
+static void sim800_sapbr(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    /* AT+SAPBR=3,... configures, AT+SAPBR=1,1 opens, AT+SAPBR=0,1 closes. */
+    if (!strcmp(args, "1,1")) {
+        if (sim->bearer) {
+            sim_error(out);
+            return;
+        }
+        sim->reply_at += sim->connect_ms;
+        sim->bearer = true;
+    } else if (!strcmp(args, "0,1")) {
+        sim->bearer = false;
+        sim_urc(sim, 0, "+SAPBR 1: DEACT");
+    }
+    sim_ok(out);
+}
+
+static void sim800_cipstart(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    int connid;
+    struct sim_socket *socket = sim_socket_arg(sim, args, &connid);
+    if (!socket || sim->ip_state != SIM_IP_STATUS) {
+        sim_error(out);
+        return;
+    }
+    if (socket->connected) {
+        sim_ok(out);
+        sim_urc(sim, 0, "%d, ALREADY CONNECT", connid);
+        return;
+    }
+
+    sim_ok(out);
+    sim_socket_connect(sim, socket);
+    sim_urc(sim, sim->connect_ms, "%d, CONNECT OK", connid);
+    if (sim->server_bytes)
+        sim_socket_notify(sim, connid, sim->connect_ms);
+}
+
+static void sim800_cipsend(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    int connid;
+    struct sim_socket *socket = sim_socket_arg(sim, args, &connid);
+    const char *comma = strchr(args, ',');
+    long len = (comma ? strtol(comma + 1, NULL, 10) : 0);
+    if (!socket || !socket->connected || len <= 0) {
+        sim_error(out);
+        return;
+    }
+
+    sim_buf_printf(out, "\r\n> ");
+    sim->data_left = sim->data_len = len;
+    sim->data_socket = connid;
+}
+
+static void sim800_cipsend_done(struct sim *sim, int connid, size_t len, struct sim_buf *out)
+{
+    struct sim_setting *quick = sim_setting(sim, "+CIPQSEND", false);
+    if (quick && !strcmp(quick->value, "1"))
+        sim_line(out, "DATA ACCEPT:%d,%zu", connid, len);
+    else
+        sim_line(out, "%d, SEND OK", connid);
+}
+
+static void sim800_ciprxget(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    /* Only mode 2 (read data) is a command; the rest are settings. */
+    if (strncmp(args, "2,", 2)) {
+        sim_generic(sim, "AT+CIPRXGET=", out);
+        struct sim_setting *setting = sim_setting(sim, "+CIPRXGET", true);
+        snprintf(setting->value, sizeof(setting->value), "%s", args);
+        return;
+    }
+
+    int connid;
+    struct sim_socket *socket = sim_socket_arg(sim, args + 2, &connid);
+    const char *comma = strchr(args + 2, ',');
+    long len = (comma ? strtol(comma + 1, NULL, 10) : 0);
+    if (!socket || !socket->connected || len <= 0 || len > SIM_RXGET_MAX) {
+        sim_error(out);
+        return;
+    }
+
+    size_t available = sim_stream_available(sim, &socket->rx);
+    size_t chunk = ((size_t) len < available ? (size_t) len : available);
+    sim_line(out, "+CIPRXGET: 2,%d,%zu,%zu", connid, chunk, available - chunk);
+    if (chunk) {
+        /* The payload follows the header line right away. */
+        out->len -= 2;
+        sim_buf_append(out, "\r\n", 2);
+        sim_stream_read(&socket->rx, chunk, out);
+        sim_buf_append(out, "\r\n", 2);
+    }
+    sim_ok(out);
+}
+
+static void sim800_cipack(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    int connid;
+    struct sim_socket *socket = sim_socket_arg(sim, args, &connid);
+    if (!socket || !socket->connected) {
+        sim_error(out);
+        return;
+    }
+    /* Everything sent is acknowledged by the time anyone asks. */
+    sim_line(out, "+CIPACK: %llu,%llu,0",
+             (unsigned long long) socket->sent, (unsigned long long) socket->sent);
+    sim_ok(out);
+}
+
+static void sim800_cipclose(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    int connid;
+    struct sim_socket *socket = sim_socket_arg(sim, args, &connid);
+    if (!socket || !socket->connected) {
+        sim_error(out);
+        return;
+    }
+    socket->connected = false;
+    sim_line(out, "%d, CLOSE OK", connid);
+}
+
+static void sim800_ftpget(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    if (!strcmp(args, "1")) {
+        /* Open the session; the result comes as a URC. */
+        if (!sim->bearer) {
+            sim_error(out);
+            return;
+        }
+        sim_ok(out);
+        sim->ftp_active = true;
+        sim_stream_start(&sim->ftp, sim->ftp_bytes);
+        sim->ftp.since = sim->reply_at + sim->connect_ms;
+        sim_urc(sim, sim->connect_ms, "+FTPGET: 1,1");
+        return;
+    }
+
+    long len = (!strncmp(args, "2,", 2) ? strtol(args + 2, NULL, 10) : 0);
+    if (!sim->ftp_active || len <= 0) {
+        sim_error(out);
+        return;
+    }
+
+    size_t available = sim_stream_available(sim, &sim->ftp);
+    size_t chunk = ((size_t) len < available ? (size_t) len : available);
+    sim_line(out, "+FTPGET: 2,%zu", chunk);
+    if (chunk) {
+        out->len -= 2;
+        sim_buf_append(out, "\r\n", 2);
+        sim_stream_read(&sim->ftp, chunk, out);
+        sim_buf_append(out, "\r\n", 2);
+    }
+    sim_ok(out);
+
+    /* End of file is reported separately. */
+    if (!sim_stream_pending(&sim->ftp)) {
+        sim->ftp_active = false;
+        sim_urc(sim, 0, "+FTPGET: 1,0");
+    }
+}
+
+static void sim800_ftpquit(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    sim->ftp_active = false;
+    sim_ok(out);
+}
+
+static const struct sim_command sim800_commands[] = {
+    { "AT", sim_at },
+    { "ATE0", sim_echo_off },
+    { "ATE1", sim_echo_on },
+    { "AT&W0", sim_at },
+    { "AT&K0", sim_silent },        /* No response at all. */
+    { "AT+IPR=", sim_ipr },
+    { "AT+CGSN", sim_cgsn },
+    { "AT+CCID", sim_ccid },
+    { "AT+CREG?", sim_creg },
+    { "AT+CSQ", sim_csq },
+    { "AT+CCLK?", sim_cclk },
+    { "AT+CIPSTATUS", sim800_cipstatus },
+    { "AT+CSTT=", sim800_cstt },
+    { "AT+CIICR", sim800_ciicr },
+    { "AT+CIFSR", sim800_cifsr },
+    { "AT+CIPSHUT", sim800_cipshut },
+    { "AT+SAPBR=", sim800_sapbr },
+    { "AT+CIPSTART=", sim800_cipstart },
+    { "AT+CIPSEND=", sim800_cipsend },
+    { "AT+CIPRXGET=", sim800_ciprxget },
+    { "AT+CIPACK=", sim800_cipack },
+    { "AT+CIPCLOSE=", sim800_cipclose },
+    { "AT+FTPGET=", sim800_ftpget },
+    { "AT+FTPQUIT", sim800_ftpquit },
+    { NULL, NULL }
+};
+
+/*
+ * Telit.
+ */
+
+static void telit_sgact(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    if (!strcmp(args, "1,1")) {
+        if (sim->ip_state == SIM_IP_STATUS) {
+            sim_line(out, "+CME ERROR: context already activated");
+            return;
+        }
+        sim->reply_at += sim->connect_ms;
+        sim->ip_state = SIM_IP_STATUS;
+        sim_line(out, "#SGACT: 10.0.0.2");
+        sim_ok(out);
+    } else if (!strcmp(args, "1,0")) {
+        sim->ip_state = SIM_IP_INITIAL;
+        sim_close_all(sim);
+        sim_ok(out);
+    } else {
+        sim_error(out);
+    }
+}
+
+static void telit_sd(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    int connid;
+    struct sim_socket *socket = sim_socket_arg(sim, args, &connid);
+    if (!socket) {
+        sim_error(out);
+        return;
+    }
+    if (sim->ip_state != SIM_IP_STATUS) {
+        sim_line(out, "+CME ERROR: context not opened");
+        return;
+    }
+
+    /* Command mode connect: OK once connected. */
+    sim_socket_connect(sim, socket);
+    sim->reply_at += sim->connect_ms;
+    sim_ok(out);
+    if (sim->server_bytes)
+        sim_socket_notify(sim, connid, 0);
+}
+
+static void telit_ssendext(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    int connid;
+    struct sim_socket *socket = sim_socket_arg(sim, args, &connid);
+    const char *comma = strchr(args, ',');
+    long len = (comma ? strtol(comma + 1, NULL, 10) : 0);
+    if (!socket || !socket->connected || len <= 0) {
+        sim_error(out);
+        return;
+    }
+
+    sim_buf_printf(out, "\r\n> ");
+    sim->data_left = sim->data_len = len;
+    sim->data_socket = connid;
+}
+
+static void telit_ssendext_done(struct sim *sim, int connid, size_t len, struct sim_buf *out)
+{
+    (void) sim;
+    (void) connid;
+    (void) len;
+    sim_ok(out);
+}
+
+static void telit_srecv(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    int connid;
+    struct sim_socket *socket = sim_socket_arg(sim, args, &connid);
+    const char *comma = strchr(args, ',');
+    long len = (comma ? strtol(comma + 1, NULL, 10) : 0);
+    if (!socket || !socket->connected || len <= 0 || len > SIM_SRECV_MAX) {
+        sim_error(out);
+        return;
+    }
+
+    size_t available = sim_stream_available(sim, &socket->rx);
+    if (!available) {
+        /* That's what "no data" looks like. */
+        sim_line(out, "+CME ERROR: activation failed");
+        return;
+    }
+
+    size_t chunk = ((size_t) len < available ? (size_t) len : available);
+    sim_buf_printf(out, "\r\n#SRECV: %d,%zu\r\n", connid, chunk);
+    sim_stream_read(&socket->rx, chunk, out);
+    sim_buf_append(out, "\r\n", 2);
+    sim_ok(out);
+}
+
+static void telit_si(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    int connid;
+    struct sim_socket *socket = sim_socket_arg(sim, args, &connid);
+    if (!socket) {
+        sim_error(out);
+        return;
+    }
+    sim_line(out, "#SI: %d,%llu,%llu,%zu,0", connid,
+             (unsigned long long) socket->sent, (unsigned long long) socket->rx.delivered,
+             sim_stream_available(sim, &socket->rx));
+    sim_ok(out);
+}
+
+static void telit_ss(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    int connid;
+    struct sim_socket *socket = sim_socket_arg(sim, args, &connid);
+    if (!socket) {
+        sim_error(out);
+        return;
+    }
+    if (socket->connected)
+        sim_line(out, "#SS: %d,%d,10.0.0.2,1025,192.0.2.1,80", connid,
+                 sim_stream_pending(&socket->rx) ? 3 : 2);
+    else
+        sim_line(out, "#SS: %d,0", connid);
+    sim_ok(out);
+}
+
+static void telit_sh(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    int connid;
+    struct sim_socket *socket = sim_socket_arg(sim, args, &connid);
+    if (!socket) {
+        sim_error(out);
+        return;
+    }
+    socket->connected = false;
+    sim_ok(out);
+}
+
+static void telit_ftpopen(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    if (sim->ip_state != SIM_IP_STATUS) {
+        sim_line(out, "+CME ERROR: context not opened");
+        return;
+    }
+    sim->reply_at += sim->connect_ms;
+    sim->ftp_open = true;
+    sim_ok(out);
+}
+
+static void telit_ftpgetpkt(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    /* "<name>",<viewmode> */
+    const char *quote = (args[0] == '"' ? strchr(args + 1, '"') : NULL);
+    if (!sim->ftp_open || !quote) {
+        sim_error(out);
+        return;
+    }
+    snprintf(sim->ftp_name, sizeof(sim->ftp_name), "%.*s", (int) (quote - args - 1), args + 1);
+
+    sim->ftp_active = true;
+    sim_stream_start(&sim->ftp, sim->ftp_bytes);
+    sim_ok(out);
+}
+
+static void telit_ftpgetpkt_query(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    sim_line(out, "#FTPGETPKT: \"%s\",0,%d", sim->ftp_name, !sim_stream_pending(&sim->ftp));
+    sim_ok(out);
+}
+
+static void telit_ftprecv(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    long len = strtol(args, NULL, 10);
+    if (!sim->ftp_active || !sim_stream_pending(&sim->ftp) || len <= 0) {
+        sim_line(out, "+CME ERROR: operation not allowed");
+        return;
+    }
+
+    size_t available = sim_stream_available(sim, &sim->ftp);
+    size_t chunk = ((size_t) len < available ? (size_t) len : available);
+    sim_buf_printf(out, "\r\n#FTPRECV: %zu\r\n", chunk);
+    if (chunk) {
+        sim_stream_read(&sim->ftp, chunk, out);
+        sim_buf_append(out, "\r\n", 2);
+    }
+    sim_ok(out);
+}
+
+static void telit_ftpclose(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    sim->ftp_open = sim->ftp_active = false;
+    sim_ok(out);
+}
+
+static void telit_agpssnd(struct sim *sim, const char *args, struct sim_buf *out)
+{
+    (void) args;
+    if (sim->ip_state != SIM_IP_STATUS) {
+        sim_line(out, "+CME ERROR: context not opened");
+        return;
+    }
+    sim_ok(out);
+    sim_urc(sim, sim->connect_ms, "#AGPSRING: 200,52.229700,21.011800,110.0,0.0,\"\",0");
+}
+
+static const struct sim_command telit_commands[] = {
+    { "AT", sim_at },
+    { "ATE0", sim_echo_off },
+    { "ATE1", sim_echo_on },
+    { "AT&K0", sim_at },
+    { "AT&K3", sim_at },
+    { "AT+IPR=", sim_ipr },
+    { "AT+CGSN", sim_cgsn },
+    { "AT#CCID", sim_ccid },
+    { "AT+CREG?", sim_creg },
+    { "AT+CSQ", sim_csq },
+    { "AT+CCLK?", sim_cclk },
+    { "AT#SGACT=", telit_sgact },
+    { "AT#SD=", telit_sd },
+    { "AT#SSENDEXT=", telit_ssendext },
+    { "AT#SRECV=", telit_srecv },
+    { "AT#SI=", telit_si },
+    { "AT#SS=", telit_ss },
+    { "AT#SH=", telit_sh },
+    { "AT#FTPOPEN=", telit_ftpopen },
+    { "AT#FTPGETPKT=", telit_ftpgetpkt },
+    { "AT#FTPGETPKT?", telit_ftpgetpkt_query },
+    { "AT#FTPRECV=", telit_ftprecv },
+    { "AT#FTPCLOSE", telit_ftpclose },
+    { "AT#AGPSSND", telit_agpssnd },
+    { NULL, NULL }
+};
+
+/*
+ * Serial line.
+ */
+
+static const struct sim_rule *sim_rule_find(const struct sim *sim, const char *line)
+{
+    const struct sim_rule *best = NULL;
+    for (int i=0; i<sim->nrules; i++) {
+        const struct sim_rule *rule = &sim->rules[i];
+        size_t len = strlen(rule->prefix);
+        if (!strncmp(line, rule->prefix, len) && (!best || len > strlen(best->prefix)))
+            best = rule;
+    }
+    return best;
+}
+
+static const struct sim_command *sim_command_find(const struct sim *sim, const char *line)
+{
+    for (const struct sim_command *command=sim->commands; command->prefix; command++) {
+        size_t len = strlen(command->prefix);
+        if (command->prefix[len-1] == '=') {
+            if (!strncmp(line, command->prefix, len))
+                return command;
+        } else if (!strcmp(line, command->prefix)) {
+            return command;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Schedule a response, unless it gets lost.
+ *
+ * @returns True if the response goes out.
+ */
+static bool sim_reply(struct sim *sim, const char *what, int drop_percent, struct sim_buf *out)
+{
+    if (drop_percent && rand() % 100 < drop_percent) {
+        if (sim->verbose)
+            fprintf(stderr, "modem-sim: dropped response to %s\n", what);
+        free(out->data);
+        return false;
+    }
+
+    struct sim_buf *event = sim_schedule(sim, sim->reply_at);
+    *event = *out;
+    sim->ready_at = sim->reply_at;
+    return true;
+}
+
+static void sim_handle_line(struct sim *sim, const char *line)
+{
+    const struct sim_rule *rule = sim_rule_find(sim, line);
+    int latency = (rule ? rule->latency_ms : sim->latency_ms);
+    int drop = (rule && rule->drop_percent >= 0 ? rule->drop_percent : sim->drop_percent);
+
+    int64_t now = sim_clock_ms();
+    int64_t start = (sim->ready_at > now ? sim->ready_at : now);
+    if (sim->echo)
+        sim_line(sim_schedule(sim, start), "%s", line);
+    sim->reply_at = start + latency;
+
+    if (sim->verbose)
+        fprintf(stderr, "modem-sim: %s\n", line);
+
+    struct sim_buf out = { 0 };
+    const struct sim_command *command = sim_command_find(sim, line);
+    if (command)
+        command->handler(sim, line + strlen(command->prefix), &out);
+    else if (!strncmp(line, "AT", 2))
+        sim_generic(sim, line, &out);
+    else
+        sim_error(&out);
+
+    /* A lost prompt means no data is coming. */
+    if (!sim_reply(sim, line, drop, &out))
+        sim->data_left = 0;
+}
+
+static void sim_handle_data(struct sim *sim, const char *data, size_t len)
+{
+    sim_socket_write(sim, sim->data_socket, data, len);
+    sim->data_left -= len;
+    if (sim->data_left)
+        return;
+
+    int64_t now = sim_clock_ms();
+    sim->reply_at = (sim->ready_at > now ? sim->ready_at : now) + sim->latency_ms;
+
+    struct sim_buf out = { 0 };
+    if (sim->model == SIM_SIM800)
+        sim800_cipsend_done(sim, sim->data_socket, sim->data_len, &out);
+    else
+        telit_ssendext_done(sim, sim->data_socket, sim->data_len, &out);
+    sim_reply(sim, "data", sim->drop_percent, &out);
+}
+
+static void sim_feed(struct sim *sim, const char *buf, size_t len)
+{
+    while (len > 0) {
+        if (sim->data_left) {
+            size_t run = (len < sim->data_left ? len : sim->data_left);
+            sim_handle_data(sim, buf, run);
+            buf += run;
+            len -= run;
+            continue;
+        }
+
+        char c = *buf++;
+        len--;
+        if (c == '\r' || c == '\n') {
+            if (sim->line_len) {
+                sim->line[sim->line_len] = '\0';
+                sim->line_len = 0;
+                sim_handle_line(sim, sim->line);
+            }
+        } else if (sim->line_len < sizeof(sim->line) - 1) {
+            sim->line[sim->line_len++] = c;
+        }
+    }
+}
+
+/**
+ * Send out everything that's due.
+ *
+ * @returns Milliseconds until the next event, or -1 if none.
+ */
+static int sim_flush(struct sim *sim)
+{
+    while (sim->events) {
+        struct sim_event *event = sim->events;
+        int64_t wait = event->at - sim_clock_ms();
+        if (wait > 0)
+            return (int) wait;
+
+        sim->events = event->next;
+        sim_send(sim, event->out.data, event->out.len);
+        free(event->out.data);
+        free(event);
+    }
+    return -1;
+}
+
+/*
+ * Setup.
+ */
+
+static int sim_add_rule(struct sim *sim, const char *prefix, int latency_ms, int drop_percent)
+{
+    if (sim->nrules == SIM_RULES || strlen(prefix) >= sizeof(sim->rules[0].prefix))
+        return -1;
+
+    struct sim_rule *rule = &sim->rules[sim->nrules++];
+    strcpy(rule->prefix, prefix);
+    rule->latency_ms = latency_ms;
+    rule->drop_percent = drop_percent;
+    return 0;
+}
+
+/* PREFIX=MS[,DROP%] */
+static int sim_parse_rule(struct sim *sim, const char *arg)
+{
+    char prefix[32];
+    int latency, drop = -1;
+    const char *eq = strrchr(arg, '=');
+    if (!eq || eq == arg || (size_t) (eq - arg) >= sizeof(prefix))
+        return -1;
+    if (sscanf(eq + 1, "%d,%d", &latency, &drop) < 1)
+        return -1;
+
+    memcpy(prefix, arg, eq - arg);
+    prefix[eq - arg] = '\0';
+    return sim_add_rule(sim, prefix, latency, drop);
+}
+
+/* One "<prefix> <latency ms> [<drop %>]" per line; '#' starts a comment. */
+static int sim_load_rules(struct sim *sim, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    char line[128];
+    int result = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char prefix[32];
+        int latency, drop = -1;
+        if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+            continue;
+        if (sscanf(line, "%31s %d %d", prefix, &latency, &drop) < 2 ||
+            sim_add_rule(sim, prefix, latency, drop))
+        {
+            fprintf(stderr, "modem-sim: %s: bad rule: %s", path, line);
+            result = -1;
+            break;
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+/**
+ * Open a pty in raw mode.
+ *
+ * @returns Slave descriptor, kept open so the line settings stick and the
+ *          master never sees a hangup between clients.
+ */
+static int sim_open_pty(struct sim *sim, char *path, size_t size)
+{
+    sim->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim->master == -1 || grantpt(sim->master) || unlockpt(sim->master))
+        return -1;
+    snprintf(path, size, "%s", ptsname(sim->master));
+
+    int slave = open(path, O_RDWR | O_NOCTTY);
+    if (slave == -1)
+        return -1;
+
+    struct termios attr;
+    tcgetattr(slave, &attr);
+    cfmakeraw(&attr);
+    tcsetattr(slave, TCSANOW, &attr);
+
+    return slave;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -m MODEL        sim800 (default) or telit\n"
+            "  -l PATH         symlink to the pty\n"
+            "  -t MS           response latency (default: 0)\n"
+            "  -L PREFIX=MS[,DROP]  latency and lost responses %% of matching commands\n"
+            "  -f FILE         read -L rules from a file: PREFIX MS [DROP] per line\n"
+            "  -c MS           time to connect sockets, PDP and FTP (default: 100)\n"
+            "  -d PERCENT      share of lost responses (default: 0)\n"
+            "  -b BYTES        serial line rate per second (default: unlimited)\n"
+            "  -n BYTES        network rate per second per stream (default: unlimited)\n"
+            "  -B BAUD         fastest AT+IPR rate accepted (default: any)\n"
+            "  -s BYTES        data sent by the server on connect (default: 0)\n"
+            "  -F BYTES        FTP file size (default: 65536)\n"
+            "  -r SEED         random seed for lost responses (default: 1)\n"
+            "  -E              start with echo off\n"
+            "  -v              log commands to stderr\n"
+            "  -h              show this help\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sim sim = {
+        .model = SIM_SIM800,
+        .connect_ms = 100,
+        .ftp_bytes = 65536,
+        .echo = true,
+    };
+    const char *link = NULL;
+    unsigned seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:l:t:L:f:c:d:b:n:B:s:F:r:Evh")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (!strcmp(optarg, "sim800"))
+                    sim.model = SIM_SIM800;
+                else if (!strcmp(optarg, "telit"))
+                    sim.model = SIM_TELIT;
+                else {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'l': link = optarg; break;
+            case 't': sim.latency_ms = atoi(optarg); break;
+            case 'L':
+                if (sim_parse_rule(&sim, optarg)) {
+                    fprintf(stderr, "modem-sim: bad rule: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'f':
+                if (sim_load_rules(&sim, optarg)) {
+                    perror(optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c': sim.connect_ms = atoi(optarg); break;
+            case 'd': sim.drop_percent = atoi(optarg); break;
+            case 'b': sim.line_rate = atol(optarg); break;
+            case 'n': sim.net_rate = atol(optarg); break;
+            case 'B': sim.max_baud = atol(optarg); break;
+            case 's': sim.server_bytes = strtoul(optarg, NULL, 10); break;
+            case 'F': sim.ftp_bytes = strtoul(optarg, NULL, 10); break;
+            case 'r': seed = strtoul(optarg, NULL, 10); break;
+            case 'E': sim.echo = false; break;
+            case 'v': sim.verbose = true; break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    sim.commands = (sim.model == SIM_SIM800 ? sim800_commands : telit_commands);
+    srand(seed);
+
+    char path[64];
+    int slave = sim_open_pty(&sim, path, sizeof(path));
+    if (slave == -1) {
+        perror("pty");
+        return EXIT_FAILURE;
+    }
+    if (link) {
+        unlink(link);
+        if (symlink(path, link)) {
+            perror(link);
+            return EXIT_FAILURE;
+        }
+    }
+    printf("%s\n", path);
+    fflush(stdout);
+
+    struct sigaction sa = { .sa_handler = sim_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!sim_stop) {
+        struct pollfd pfd = { .fd = sim.master, .events = POLLIN };
+        int result = poll(&pfd, 1, sim_flush(&sim));
+        if (result == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (result > 0) {
+            char buf[4096];
+            ssize_t len = read(sim.master, buf, sizeof(buf));
+            if (len > 0)
+                sim_feed(&sim, buf, len);
+        }
+    }
+
+    if (link)
+        unlink(link);
+    close(slave);
+    close(sim.master);
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */
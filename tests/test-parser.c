@@ -6,15 +6,26 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
+/* For mkstemp and usleep. */
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <check.h>
 #include <glib.h>
 
+#include <attentive/at-unix.h>
+#include <attentive/coro.h>
 #include <attentive/parser.h>
+#include <attentive/record.h>
+#include <attentive/response.h>
+#include <attentive/stats.h>
+#include <attentive/tokenizer.h>
 
 
 #define STR_LEN(s) s, strlen(s)
@@ -122,6 +133,14 @@ START_TEST(test_parser_response)
     at_parser_await_response(parser);
     at_parser_feed(parser, STR_LEN("123456789\r\nERROR\r\n"));
     expect_nothing();
+    ck_assert(at_parser_failed(parser));
+
+    expect_response("");
+    at_parser_await_response(parser);
+    ck_assert(!at_parser_failed(parser));
+    at_parser_feed(parser, STR_LEN("OK\r\n"));
+    expect_nothing();
+    ck_assert(!at_parser_failed(parser));
 
     at_parser_free(parser);
 }
@@ -199,12 +218,60 @@ START_TEST(test_parser_overflow)
     at_parser_await_response(parser);
     at_parser_feed(parser, STR_LEN("1234\r\nOK\r\n"));
     expect_nothing();
+    ck_assert(!at_parser_overflowed(parser));
 
-    /* this one doesn't. */
-    /* TODO: We could be better behaved when it comes to overflows. Not crashing is enough for now. */
+    /* this one doesn't; the final response must still get through. */
+    expect_response("");
     at_parser_await_response(parser);
     at_parser_feed(parser, STR_LEN("12345\r\nOK\r\n"));
     expect_nothing();
+    ck_assert(at_parser_overflowed(parser));
+
+    /* neither does this one; the final line is kept. */
+    expect_response("ERROR");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("123\r\n456\r\nERROR\r\n"));
+    expect_nothing();
+    ck_assert(at_parser_overflowed(parser));
+
+    /* the flag is cleared for the next command. */
+    expect_response("12");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("12\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(!at_parser_overflowed(parser));
+
+    at_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_parser_growth)
+{
+    printf(":: test_parser_growth\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 8, NULL);
+    ck_assert(parser != NULL);
+    at_parser_set_buffer_growth(parser, 8, 32);
+
+    expect_prepare();
+
+    /* grows to fit... */
+    expect_response("1234567890\nabcdefghij");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("1234567890\r\nabcdefghij\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(!at_parser_overflowed(parser));
+
+    /* ...but not past the limit; lines before the overflowing one are dropped. */
+    expect_response("ABCDEFGHIJ");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("1234567890\r\nabcdefghij\r\nABCDEFGHIJ\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(at_parser_overflowed(parser));
 
     at_parser_free(parser);
 }
@@ -274,6 +341,161 @@ START_TEST(test_parser_hexdata)
 }
 END_TEST
 
+START_TEST(test_parser_hexdata_long)
+{
+    printf(":: test_parser_hexdata_long\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+
+    /* Mixed case digits with occasional separators, long enough for the
+     * bulk decoding path. */
+    static const char digits[] = "0123456789abcdef0123456789ABCDEF";
+    uint8_t payload[200];
+    char input[512];
+    size_t pos = sprintf(input, "\r\n+HEXDATA: %d\r\n", (int) sizeof(payload));
+    for (size_t i=0; i<sizeof(payload); i++) {
+        payload[i] = (uint8_t) (i * 37 + 11);
+        input[pos++] = digits[(payload[i] >> 4) + (i & 16)];
+        input[pos++] = digits[(payload[i] & 15) + (i & 16)];
+        if (i % 23 == 22)
+            input[pos++] = ' ';
+    }
+    pos += sprintf(input+pos, "\r\nOK\r\n");
+
+    for (size_t chunk=1; chunk<=pos; chunk+=7) {
+        uint8_t data[sizeof(payload)];
+        memset(data, 0, sizeof(data));
+
+        expect_prepare();
+        expect_response("+HEXDATA: 200");
+        at_parser_set_data_buffer(parser, data, sizeof(data));
+        at_parser_await_response(parser);
+        for (size_t i=0; i<pos; i+=chunk)
+            at_parser_feed(parser, input+i, pos-i < chunk ? pos-i : chunk);
+        expect_nothing();
+        ck_assert(!memcmp(data, payload, sizeof(payload)));
+    }
+
+    at_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_parser_data_buffer)
+{
+    printf(":: test_parser_data_buffer\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 24, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* Raw data goes to the data buffer, not the (too small) response buffer. */
+    char data[32];
+    memset(data, 0, sizeof(data));
+    expect_urc("RING");
+    expect_response("+RAWDATA: 18");
+    at_parser_set_data_buffer(parser, data, sizeof(data));
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+RAWDATA: 18\r\nabcd\r\nRING\r\n\x01\xffxyzp\r\nRING\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(!memcmp(data, "abcd\r\nRING\r\n\x01\xffxyzp\0", 19));
+
+    /* Excess data is discarded. */
+    memset(data, 0, sizeof(data));
+    expect_response("+RAWDATA: 8");
+    at_parser_set_data_buffer(parser, data, 4);
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+RAWDATA: 8\r\n12345678\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(!memcmp(data, "1234\0", 5));
+
+    /* Hex data is stored decoded. */
+    memset(data, 0, sizeof(data));
+    expect_response("+HEXDATA: 10");
+    at_parser_set_data_buffer(parser, data, sizeof(data));
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+HEXDATA: 10\r\n61 62 6364 01 ff 78797a70\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(!memcmp(data, "abcd\x01\xffxyzp\0", 11));
+
+    memset(data, 0, sizeof(data));
+    expect_response("+HEXDATA: 10");
+    at_parser_set_data_buffer(parser, data, 4);
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+HEXDATA: 10\r\n61 62 6364 01 ff 78797a70\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(!memcmp(data, "abcd\0", 5));
+
+    /* The setting only applies to a single response. */
+    expect_response("+RAWDATA: 4\nwxyz");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+RAWDATA: 4\r\nwxyz\r\nOK\r\n"));
+    expect_nothing();
+
+    at_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_parser_line_handler)
+{
+    printf(":: test_parser_line_handler\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 24, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* Intermediate lines are streamed; the listing never has to fit. */
+    GQueue lines = G_QUEUE_INIT;
+    g_queue_push_tail(&lines, "+CMGL: 1,\"REC READ\"");
+    g_queue_push_tail(&lines, "first message");
+    g_queue_push_tail(&lines, "+CMGL: 2,\"REC UNREAD\"");
+    g_queue_push_tail(&lines, "second message");
+    expect_urc("RING");
+    expect_response("");
+    at_parser_set_line_handler(parser, (at_response_handler_t) assert_line_expected, &lines);
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+CMGL: 1,\"REC READ\"\r\nfirst message\r\n"
+                                   "RING\r\n+CMGL: 2,\"REC UNREAD\"\r\nsecond message\r\n\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(g_queue_is_empty(&lines));
+    ck_assert(!at_parser_overflowed(parser));
+
+    /* Final responses are still delivered as the response. */
+    g_queue_push_tail(&lines, "+COPS: (2,\"A\")");
+    expect_response("+CME ERROR: 3");
+    at_parser_set_line_handler(parser, (at_response_handler_t) assert_line_expected, &lines);
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+COPS: (2,\"A\")\r\n+CME ERROR: 3\r\n"));
+    expect_nothing();
+    ck_assert(g_queue_is_empty(&lines));
+
+    /* The setting only applies to a single response. */
+    expect_response("one\ntwo");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\none\r\ntwo\r\nOK\r\n"));
+    expect_nothing();
+
+    at_parser_free(parser);
+}
+END_TEST
+
 START_TEST(test_parser_dataprompt)
 {
     printf(":: test_parser_dataprompt\n");
@@ -304,6 +526,646 @@ START_TEST(test_parser_dataprompt)
 }
 END_TEST
 
+START_TEST(test_parser_chunking)
+{
+    printf(":: test_parser_chunking\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+
+    static const char response[] =
+        "\r\nRING\r\n"
+        "+CIPSTATUS: 0,0,\"TCP\",\"123.123.123.123\",\"80\",\"CONNECTED\"\r\n"
+        "+CIPSTATUS: 1,,\"\",\"\",\"\",\"INITIAL\"\r\n"
+        "\r\nRING\r\nOK\r\n\r\nRING\r\n";
+
+    /* The result must not depend on how the input is split. */
+    for (size_t chunk=1; chunk<=strlen(response); chunk++) {
+        expect_prepare();
+
+        expect_urc("RING");
+        expect_urc("RING");
+        expect_response("+CIPSTATUS: 0,0,\"TCP\",\"123.123.123.123\",\"80\",\"CONNECTED\"\n"
+                        "+CIPSTATUS: 1,,\"\",\"\",\"\",\"INITIAL\"");
+        expect_urc("RING");
+        at_parser_await_response(parser);
+        for (size_t i=0; i<strlen(response); i+=chunk) {
+            size_t len = strlen(response) - i;
+            at_parser_feed(parser, response+i, len < chunk ? len : chunk);
+        }
+        expect_nothing();
+
+        expect_response("");
+        at_parser_expect_dataprompt(parser);
+        at_parser_await_response(parser);
+        for (size_t i=0; i<4; i+=chunk)
+            at_parser_feed(parser, "\r\n> "+i, 4-i < chunk ? 4-i : chunk);
+        expect_nothing();
+    }
+
+    at_parser_free(parser);
+}
+END_TEST
+
+/* Reference implementation: index of the first matching prefix. */
+static int prefix_find_linear(const char *line, const char *const table[])
+{
+    for (int i=0; table[i] != NULL; i++)
+        if (!strncmp(line, table[i], strlen(table[i])))
+            return i;
+    return -1;
+}
+
+START_TEST(test_prefix_matcher)
+{
+    printf(":: test_prefix_matcher\n");
+
+    static const char *const table[] = {
+        "+CIPRXGET: 1,",
+        "+CIEV: ",
+        "RING",
+        "OK",
+        "OK AGAIN",
+        "+C",
+        "RING",
+        "\xff\x01",
+        NULL
+    };
+    static const char *const lines[] = {
+        "", "O", "OK", "OK AGAIN", "OKAY", "RING", "RINGING", "RIN",
+        "+C", "+CIEV: 1,2", "+CIEV:", "+CIPRXGET: 1,0", "+CIPRXGET: 2,1",
+        "\xff\x01\x02", "\xff", "+CME ERROR: 3", "DST: 1",
+        NULL
+    };
+
+    struct at_prefix_matcher *matcher = at_prefix_matcher_alloc(table);
+    ck_assert(matcher != NULL);
+    for (const char *const *line=lines; *line; line++) {
+        ck_assert_int_eq(at_prefix_matcher_find(matcher, *line), prefix_find_linear(*line, table));
+        ck_assert_int_eq(at_prefix_matcher_find(matcher, *line) != -1, at_prefix_in_table(*line, table));
+    }
+    at_prefix_matcher_free(matcher);
+
+    /* Degenerate tables. */
+    static const char *const empty[] = { NULL };
+    matcher = at_prefix_matcher_alloc(empty);
+    ck_assert(matcher != NULL);
+    ck_assert_int_eq(at_prefix_matcher_find(matcher, "OK"), -1);
+    at_prefix_matcher_free(matcher);
+
+    static const char *const everything[] = { "OK", "", NULL };
+    matcher = at_prefix_matcher_alloc(everything);
+    ck_assert(matcher != NULL);
+    ck_assert_int_eq(at_prefix_matcher_find(matcher, "OK"), 0);
+    ck_assert_int_eq(at_prefix_matcher_find(matcher, "ERROR"), 1);
+    ck_assert_int_eq(at_prefix_matcher_find(matcher, ""), 1);
+    at_prefix_matcher_free(matcher);
+}
+END_TEST
+
+static void handle_log(enum at_log_level level, const char *msg, size_t len, void *arg)
+{
+    GQueue *q = arg;
+    ck_assert_int_eq(len, strlen(msg));
+    g_queue_push_tail(q, g_strdup_printf("%d %s", level, msg));
+}
+
+static void expect_log(GQueue *q, const char *line)
+{
+    char *logged = g_queue_pop_head(q);
+    ck_assert_msg(logged != NULL);
+    ck_assert_str_eq(logged, line);
+    g_free(logged);
+}
+
+START_TEST(test_log)
+{
+    printf(":: test_log\n");
+
+    GQueue q = G_QUEUE_INIT;
+    struct at_log *log = at_log_alloc(3);
+    ck_assert(log != NULL);
+    at_log_set_handler(log, handle_log, &q);
+
+    /* levels above the current one are dropped */
+    at_log(log, AT_LOG_DEBUG, "dropped");
+    at_log(log, AT_LOG_INFO, "kept %d", 1);
+    ck_assert_int_eq(at_log_drain(log), 1);
+    expect_log(&q, "3 kept 1");
+    ck_assert(g_queue_is_empty(&q));
+
+    /* a full ring drops messages and reports it on the next drain */
+    at_log_set_level(log, AT_LOG_DEBUG);
+    for (int i=0; i<6; i++)
+        at_log(log, AT_LOG_DEBUG, "message %d", i);
+    ck_assert_int_eq(at_log_drain(log), 4);
+    for (int i=0; i<4; i++) {
+        char line[16];
+        sprintf(line, "4 message %d", i);
+        expect_log(&q, line);
+    }
+    expect_log(&q, "2 log: 2 messages dropped");
+    ck_assert(g_queue_is_empty(&q));
+
+    /* the ring is reusable after wrapping around */
+    at_log(log, AT_LOG_ERROR, "%s", "wrapped");
+    at_log_free(log);
+    expect_log(&q, "1 wrapped");
+    ck_assert(g_queue_is_empty(&q));
+}
+END_TEST
+
+START_TEST(test_tokenizer)
+{
+    printf(":: test_tokenizer\n");
+
+    struct at_tok tok;
+    char buf[8];
+
+    /* +CREG-style integer fields, skipped fields and hex strings */
+    at_tok_init(&tok, "+CREG: 2,1,\"00C3\",\"1F0A\", -7");
+    ck_assert(at_tok_expect(&tok, "+CREG: "));
+    ck_assert(at_tok_skip(&tok));
+    ck_assert_int_eq(at_tok_int(&tok), 1);
+    ck_assert_int_eq(at_tok_hex(&tok), 0x00c3);
+    ck_assert_int_eq(at_tok_hex(&tok), 0x1f0a);
+    ck_assert_int_eq(at_tok_int(&tok), -7);
+    ck_assert(!tok.error);
+    ck_assert_str_eq(tok.pos, "");
+
+    /* quoted strings may contain commas; unquoted ones end at one */
+    at_tok_init(&tok, "\"a,b\",cd,,\"\"");
+    ck_assert_int_eq(at_tok_string(&tok, buf, sizeof(buf)), 3);
+    ck_assert_str_eq(buf, "a,b");
+    ck_assert_int_eq(at_tok_string(&tok, buf, sizeof(buf)), 2);
+    ck_assert_str_eq(buf, "cd");
+    ck_assert_int_eq(at_tok_string(&tok, buf, sizeof(buf)), 0);
+    ck_assert_int_eq(at_tok_string(&tok, buf, sizeof(buf)), 0);
+    ck_assert(!tok.error);
+
+    /* locale-independent fractions */
+    at_tok_init(&tok, "52.2297,-21.0122,.5");
+    ck_assert(fabsf(at_tok_float(&tok) - 52.2297f) < 1e-4);
+    ck_assert(fabsf(at_tok_float(&tok) + 21.0122f) < 1e-4);
+    ck_assert(fabsf(at_tok_float(&tok) - 0.5f) < 1e-6);
+    ck_assert(!tok.error);
+
+    /* errors are sticky */
+    at_tok_init(&tok, "+CSQ: 21,0");
+    ck_assert(!at_tok_expect(&tok, "+CREG: "));
+    ck_assert_int_eq(at_tok_int(&tok), 0);
+    ck_assert(tok.error);
+
+    /* bounds: integer range and destination size */
+    at_tok_init(&tok, "2147483647,-2147483648");
+    ck_assert_int_eq(at_tok_int(&tok), 2147483647);
+    ck_assert_int_eq(at_tok_int(&tok), -2147483647-1);
+    ck_assert(!tok.error);
+    at_tok_init(&tok, "2147483648");
+    at_tok_int(&tok);
+    ck_assert(tok.error);
+    at_tok_init(&tok, "89490221111");
+    ck_assert_int_eq(at_tok_string(&tok, buf, sizeof(buf)), 0);
+    ck_assert_str_eq(buf, "");
+    ck_assert(tok.error);
+    at_tok_init(&tok, "\"unterminated");
+    ck_assert(!at_tok_skip(&tok));
+
+    /* digit runs stop at a non-digit and are truncated to fit */
+    at_tok_init(&tok, "8949022111111111111F");
+    ck_assert_int_eq(at_tok_digits(&tok, buf, sizeof(buf)), 7);
+    ck_assert_str_eq(buf, "8949022");
+    ck_assert(!tok.error);
+    ck_assert_str_eq(tok.pos, "F");
+    at_tok_init(&tok, "ERROR");
+    ck_assert_int_eq(at_tok_digits(&tok, buf, sizeof(buf)), 0);
+    ck_assert_str_eq(buf, "");
+    ck_assert(tok.error);
+
+    /* missing fields and missing responses */
+    at_tok_init(&tok, "+CREG: 1");
+    at_tok_expect(&tok, "+CREG: ");
+    at_tok_skip(&tok);
+    at_tok_int(&tok);
+    ck_assert(tok.error);
+    at_tok_init(&tok, NULL);
+    ck_assert(tok.error);
+}
+END_TEST
+
+START_TEST(test_parser_storage)
+{
+    printf(":: test_parser_storage\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+    };
+    static char storage[2][2048] __attribute__ ((aligned (AT_STORAGE_ALIGN)));
+    ck_assert(at_parser_sizeof(16) % AT_STORAGE_ALIGN == 0);
+    ck_assert(at_parser_sizeof(16) <= sizeof(storage[0]));
+
+    /* Instances live entirely in the storage, back to back. */
+    memset(storage, 0x55, sizeof(storage));
+    struct at_parser *parser = at_parser_init(storage[0], &cbs, 16, NULL);
+    ck_assert(parser == (struct at_parser *) storage[0]);
+    ck_assert(storage[1][0] == 0x55);
+
+    expect_prepare();
+    expect_response("+CSQ: 21,0");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+CSQ: 21,0\r\n\r\nOK\r\n"));
+    expect_nothing();
+
+    /* A grown buffer moves to the heap. */
+    at_parser_set_buffer_growth(parser, 16, 64);
+    expect_response("0123456789\nabcdefghij\nKLMNOPQRST");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n0123456789\r\nabcdefghij\r\nKLMNOPQRST\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(!at_parser_overflowed(parser));
+    at_parser_free(parser);
+
+    /* Logs too. */
+    ck_assert(at_log_sizeof(4) <= sizeof(storage[1]));
+    GQueue q = G_QUEUE_INIT;
+    struct at_log *log = at_log_init(storage[1], 4);
+    ck_assert(log == (struct at_log *) storage[1]);
+    at_log_set_handler(log, handle_log, &q);
+    at_log(log, AT_LOG_ERROR, "in storage");
+    at_log_free(log);
+    expect_log(&q, "1 in storage");
+    ck_assert(g_queue_is_empty(&q));
+}
+END_TEST
+
+START_TEST(test_response_pool)
+{
+    printf(":: test_response_pool\n");
+
+    struct at_response_pool *pool = at_response_pool_alloc(2, 8);
+    ck_assert(pool != NULL);
+
+    /* Responses are copied and outlive the source. */
+    char line[] = "+CSQ: 9";
+    struct at_response *a = at_response_pool_get(pool, line, 7);
+    ck_assert(a != NULL);
+    line[6] = '5';
+    ck_assert_str_eq(a->text, "+CSQ: 9");
+    ck_assert_int_eq(a->len, 7);
+
+    struct at_response *b = at_response_pool_get(pool, STR_LEN(""));
+    ck_assert(b != NULL);
+    ck_assert_str_eq(b->text, "");
+
+    /* The pool is bounded. */
+    errno = 0;
+    ck_assert(at_response_pool_get(pool, STR_LEN("OK")) == NULL);
+    ck_assert_int_eq(errno, ENOBUFS);
+    at_response_release(b);
+    errno = 0;
+    ck_assert(at_response_pool_get(pool, STR_LEN("too long!")) == NULL);
+    ck_assert_int_eq(errno, EMSGSIZE);
+
+    /* Slabs are recycled when the last reference is dropped. */
+    ck_assert(at_response_ref(a) == a);
+    at_response_release(a);
+    ck_assert_str_eq(a->text, "+CSQ: 9");
+    b = at_response_pool_get(pool, STR_LEN("12345678"));
+    ck_assert(b != NULL && b != a);
+    ck_assert(at_response_pool_get(pool, STR_LEN("OK")) == NULL);
+    at_response_release(a);
+    a = at_response_pool_get(pool, STR_LEN("OK"));
+    ck_assert(a != NULL);
+    ck_assert_str_eq(a->text, "OK");
+    ck_assert_str_eq(b->text, "12345678");
+
+    at_response_release(a);
+    at_response_release(b);
+    at_response_pool_free(pool);
+}
+END_TEST
+
+START_TEST(test_stats)
+{
+    printf(":: test_stats\n");
+
+    struct at_stats *stats = at_stats_alloc(2, 1);
+    ck_assert(stats != NULL);
+
+    /* Commands are keyed on their name, without parameters. */
+    at_stats_record_command(stats, STR_LEN("AT+CIPRXGET=2,0,1460\r"), 1000);
+    at_stats_record_input(stats, 10, 1100);
+    at_stats_record_input(stats, 10, 1900);
+    at_stats_record_response(stats, 0, false, 2000);
+    at_stats_record_command(stats, STR_LEN("AT+CIPRXGET?\r"), 3000);
+    at_stats_record_input(stats, 7, 3003);
+    at_stats_record_response(stats, 0, true, 3005);
+    at_stats_record_command(stats, STR_LEN("AT+CIPRXGET=2\r"), 4000);
+    at_stats_record_response(stats, ETIMEDOUT, false, 9000);
+    at_stats_record_command(stats, STR_LEN("ATE0\r"), 10000);
+    at_stats_record_response(stats, ENOBUFS, false, 10500);
+
+    /* The table is full; the next prefix isn't tracked. */
+    at_stats_record_command(stats, STR_LEN("AT&W0\r"), 11000);
+    at_stats_record_response(stats, 0, false, 11010);
+
+    at_stats_record_urc(stats, STR_LEN("+CREG: 1"));
+    at_stats_record_urc(stats, STR_LEN("+CREG: 5"));
+    at_stats_record_urc(stats, STR_LEN("RING"));
+
+    ck_assert_int_eq(stats->bytes_out, 21 + 13 + 14 + 5 + 6);
+    ck_assert_int_eq(stats->bytes_in, 27);
+    ck_assert_int_eq(stats->overflows, 1);
+    ck_assert_int_eq(stats->untracked, 2);
+
+    const struct at_stats_command *command = at_stats_command(stats, 0);
+    ck_assert(command != NULL);
+    ck_assert_str_eq(command->prefix, "AT+CIPRXGET");
+    ck_assert_int_eq(command->count, 3);
+    ck_assert_int_eq(command->errors, 1);
+    ck_assert_int_eq(command->timeouts, 1);
+    ck_assert_int_eq(command->overflows, 0);
+    /* First byte after 100 and 3 us, final after 1000 and 5 us. */
+    ck_assert_int_eq(at_stats_percentile(&command->first_byte, 0.5), 4);
+    ck_assert_int_eq(at_stats_percentile(&command->first_byte, 1.0), 112);
+    ck_assert_int_eq(at_stats_percentile(&command->final, 0.5), 6);
+    ck_assert_int_eq(at_stats_percentile(&command->final, 0.99), 1024);
+
+    command = at_stats_command(stats, 1);
+    ck_assert(command != NULL);
+    ck_assert_str_eq(command->prefix, "ATE");
+    ck_assert_int_eq(command->overflows, 1);
+    ck_assert(at_stats_command(stats, 2) == NULL);
+
+    const struct at_stats_urc *urc = at_stats_urc(stats, 0);
+    ck_assert(urc != NULL);
+    ck_assert_str_eq(urc->prefix, "+CREG");
+    ck_assert_int_eq(urc->count, 2);
+    ck_assert(at_stats_urc(stats, 1) == NULL);
+
+    /* Snapshots are independent of the original. */
+    char report[512];
+    struct at_stats *copy = at_stats_alloc(2, 1);
+    at_stats_copy(copy, stats);
+    at_stats_reset(stats);
+    ck_assert(at_stats_command(stats, 0) == NULL);
+    ck_assert_int_eq(stats->bytes_out, 0);
+    size_t len = at_stats_format(copy, report, sizeof(report));
+    ck_assert_int_eq(len, strlen(report));
+    ck_assert(strstr(report, "AT+CIPRXGET") != NULL);
+    ck_assert(strstr(report, "+CREG") != NULL);
+
+    /* Truncated reports still tell the full length. */
+    ck_assert_int_eq(at_stats_format(copy, report, 8), len);
+    ck_assert_int_eq(strlen(report), 7);
+
+    at_stats_free(copy);
+    at_stats_free(stats);
+}
+END_TEST
+
+START_TEST(test_record)
+{
+    printf(":: test_record\n");
+
+    char path[] = "/tmp/test-record-XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert(fd != -1);
+    close(fd);
+
+    /* Two sessions appended to one file. */
+    for (int i=0; i<2; i++) {
+        struct at_record *record = at_record_alloc(path, 0);
+        ck_assert(record != NULL);
+        at_record_write(record, AT_RECORD_INPUT, STR_LEN("\r\nRING\r\n"));
+        at_record_write(record, AT_RECORD_COMMAND, STR_LEN("AT+CSQ\r"));
+        at_record_write(record, AT_RECORD_INPUT, STR_LEN("\r\n+CSQ: 20,0\r\n\r\nOK\r\n"));
+        at_record_response(record, 0, false);
+        ck_assert_int_eq(at_record_flush(record), 0);
+        ck_assert_int_eq(at_record_dropped(record), 0);
+        at_record_free(record);
+    }
+
+    struct at_replay *replay = at_replay_alloc(path);
+    ck_assert(replay != NULL);
+
+    static const enum at_record_type types[] = {
+        AT_RECORD_START, AT_RECORD_INPUT, AT_RECORD_COMMAND, AT_RECORD_INPUT, AT_RECORD_RESPONSE,
+    };
+    struct at_record_entry entry;
+    uint64_t last = 0;
+    for (int i=0; i<10; i++) {
+        ck_assert_int_eq(at_replay_next(replay, &entry), 1);
+        ck_assert_int_eq(entry.type, types[i % 5]);
+        ck_assert(entry.time_us >= last);
+        last = entry.time_us;
+    }
+    ck_assert_int_eq(entry.len, 2);
+    ck_assert_int_eq(at_replay_next(replay, &entry), 0);
+
+    /* Replayed traffic reaches the parser like the original did. */
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+    expect_prepare();
+    for (int i=0; i<2; i++) {
+        expect_urc("RING");
+        expect_response("+CSQ: 20,0");
+    }
+    at_replay_rewind(replay);
+    ck_assert_int_eq(at_replay_feed(replay, parser, 0), 2 * (8 + 20));
+    expect_nothing();
+    at_parser_free(parser);
+    at_replay_free(replay);
+
+    /* Anything else is refused. */
+    ck_assert(at_replay_alloc("/dev/null") == NULL);
+    ck_assert_int_eq(errno, EPROTO);
+
+#ifdef __linux__
+    /* What a failed write didn't get out counts as lost. */
+    struct at_record *record = at_record_alloc("/dev/full", 0);
+    ck_assert(record != NULL);
+    at_record_write(record, AT_RECORD_INPUT, STR_LEN("\r\nRING\r\n"));
+    ck_assert_int_eq(at_record_flush(record), -1);
+    ck_assert_int_eq(errno, ENOSPC);
+    ck_assert(at_record_dropped(record) > 8);
+    at_record_free(record);
+#endif
+
+    unlink(path);
+}
+END_TEST
+
+struct coro_test {
+    pthread_mutex_t mutex;
+    struct at_coro_waitq waitq;
+    bool ready;
+    int order[4];
+    int count;
+};
+
+static struct coro_test coro_test;
+
+static void coro_sleeper(void *arg)
+{
+    int ms = (int) (intptr_t) arg;
+    at_coro_sleep_ms(ms);
+    coro_test.order[coro_test.count++] = ms;
+}
+
+static void coro_waiter(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&coro_test.mutex);
+    /* Nobody wakes it up before the timeout... */
+    ck_assert(!at_coro_wait(&coro_test.waitq, &coro_test.mutex, 5));
+    /* ...but the other thread does now. */
+    while (!coro_test.ready)
+        at_coro_wait(&coro_test.waitq, &coro_test.mutex, 0);
+    coro_test.order[coro_test.count++] = 0;
+    pthread_mutex_unlock(&coro_test.mutex);
+}
+
+static void *coro_waker(void *arg)
+{
+    (void) arg;
+    usleep(50000);
+    pthread_mutex_lock(&coro_test.mutex);
+    coro_test.ready = true;
+    at_coro_wake_all(&coro_test.waitq);
+    pthread_mutex_unlock(&coro_test.mutex);
+    return NULL;
+}
+
+START_TEST(test_coro)
+{
+    printf(":: test_coro\n");
+
+    pthread_mutex_init(&coro_test.mutex, NULL);
+    struct at_coro_sched *sched = at_coro_sched_alloc(0);
+    ck_assert(sched != NULL);
+    ck_assert(at_coro_self() == NULL);
+
+    /* Sleepers finish in deadline order; the waiter when woken up. */
+    ck_assert_int_eq(at_coro_spawn(sched, coro_sleeper, (void *) 30), 0);
+    ck_assert_int_eq(at_coro_spawn(sched, coro_waiter, NULL), 0);
+    ck_assert_int_eq(at_coro_spawn(sched, coro_sleeper, (void *) 10), 0);
+    ck_assert_int_eq(at_coro_spawn(sched, coro_sleeper, (void *) 20), 0);
+    pthread_t thread;
+    pthread_create(&thread, NULL, coro_waker, NULL);
+    at_coro_sched_run(sched);
+    pthread_join(thread, NULL);
+
+    ck_assert_int_eq(coro_test.count, 4);
+    ck_assert_int_eq(coro_test.order[0], 10);
+    ck_assert_int_eq(coro_test.order[1], 20);
+    ck_assert_int_eq(coro_test.order[2], 30);
+    ck_assert_int_eq(coro_test.order[3], 0);
+
+    at_coro_sched_free(sched);
+    pthread_mutex_destroy(&coro_test.mutex);
+}
+END_TEST
+
+static struct {
+    int fd;                 /**< Modem end of the loopback transport. */
+    int go[2];              /**< Pipe releasing the reply to the queued command. */
+    char async_response[32];
+} channel_test;
+
+/** Read one command line from the channel. */
+static void modem_read_command(int fd, const char *expected)
+{
+    char line[32];
+    size_t len = 0;
+    while (len < sizeof(line) - 1 && (len == 0 || line[len-1] != '\r')) {
+        ssize_t n = read(fd, line + len, 1);
+        ck_assert(n == 1);
+        len++;
+    }
+    line[len] = '\0';
+    ck_assert_str_eq(line, expected);
+}
+
+static void modem_write(int fd, const char *reply)
+{
+    ck_assert(write(fd, reply, strlen(reply)) == (ssize_t) strlen(reply));
+}
+
+static void *channel_modem(void *arg)
+{
+    (void) arg;
+    char go;
+
+    /* Hold the queued command's reply until the main thread says so. */
+    modem_read_command(channel_test.fd, "AT+A\r");
+    ck_assert(read(channel_test.go[0], &go, 1) == 1);
+    modem_write(channel_test.fd, "\r\n+RAWDATA: 4\r\nasyn\r\nOK\r\n");
+
+    modem_read_command(channel_test.fd, "AT+S\r");
+    modem_write(channel_test.fd, "\r\n+RAWDATA: 4\r\nsync\r\nOK\r\n");
+    return NULL;
+}
+
+static void channel_async_done(const char *response, int status, void *arg)
+{
+    (void) arg;
+    ck_assert_int_eq(status, 0);
+    snprintf(channel_test.async_response, sizeof(channel_test.async_response), "%s", response);
+}
+
+START_TEST(test_channel_settings)
+{
+    printf(":: test_channel_settings\n");
+
+    struct at_transport *transport = at_transport_loopback_alloc();
+    ck_assert(transport != NULL);
+    struct at_unix_config config = { .transport = transport };
+    struct at *at = at_alloc_unix_config(NULL, 0, &config);
+    ck_assert(at != NULL);
+    static const struct at_callbacks cbs = {
+        .scan_line = line_scanner,
+    };
+    at_set_callbacks(at, &cbs, NULL);
+    at_set_timeout(at, 5);
+    ck_assert_int_eq(at_open(at), 0);
+
+    channel_test.fd = at_transport_loopback_peer(transport);
+    ck_assert_int_eq(pipe(channel_test.go), 0);
+    pthread_t thread;
+    pthread_create(&thread, NULL, channel_modem, NULL);
+
+    /* Settings made while a queued command is in flight wait for the next
+     * synchronous command instead of applying to the queued one. */
+    char data[8];
+    memset(data, 0, sizeof(data));
+    ck_assert_int_eq(at_command_async(at, channel_async_done, NULL, "AT+A"), 0);
+    at_set_data_buffer(at, data, sizeof(data));
+    ck_assert(write(channel_test.go[1], "", 1) == 1);
+    const char *response = at_command(at, "AT+S");
+    ck_assert(response != NULL);
+    ck_assert_str_eq(response, "+RAWDATA: 4");
+    ck_assert(!memcmp(data, "sync\0", 5));
+    ck_assert_str_eq(channel_test.async_response, "+RAWDATA: 4\nasyn");
+
+    pthread_join(thread, NULL);
+    close(channel_test.go[0]);
+    close(channel_test.go[1]);
+    at_close(at);
+    at_free(at);
+    at_transport_free(transport);
+}
+END_TEST
+
 Suite *attentive_suite(void)
 {
     Suite *s = suite_create("attentive");
@@ -315,9 +1177,47 @@ Suite *attentive_suite(void)
     tcase_add_test(tc, test_parser_urc);
     tcase_add_test(tc, test_parser_mixed);
     tcase_add_test(tc, test_parser_overflow);
+    tcase_add_test(tc, test_parser_growth);
+    tcase_add_test(tc, test_parser_storage);
     tcase_add_test(tc, test_parser_rawdata);
     tcase_add_test(tc, test_parser_hexdata);
+    tcase_add_test(tc, test_parser_hexdata_long);
+    tcase_add_test(tc, test_parser_data_buffer);
+    tcase_add_test(tc, test_parser_line_handler);
     tcase_add_test(tc, test_parser_dataprompt);
+    tcase_add_test(tc, test_parser_chunking);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("prefix");
+    tcase_add_test(tc, test_prefix_matcher);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("log");
+    tcase_add_test(tc, test_log);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("response");
+    tcase_add_test(tc, test_response_pool);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("tokenizer");
+    tcase_add_test(tc, test_tokenizer);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("stats");
+    tcase_add_test(tc, test_stats);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("record");
+    tcase_add_test(tc, test_record);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("coro");
+    tcase_add_test(tc, test_coro);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("channel");
+    tcase_add_test(tc, test_channel_settings);
     suite_add_tcase(s, tc);
 
     return s;